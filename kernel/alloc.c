@@ -2,96 +2,761 @@
 // Author: Joseph Umana
 // Date: 2025-01-19
 //
-// A simple fixed memory allocator.
+// A simple page allocator, sized from the device tree.
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 #include "panic.h"
 #include "alloc.h"
+#include "fdt.h"
 #include "print.h"
 #include "string.h"
+#include "lock.h"
+
+// What we assume when the device tree doesn't tell us. Matches the -m in
+// the Makefile.
+#define FALLBACK_MEM_SIZE (128 * 1024 * 1024)
 
-// TODO: Implement locks
 struct block {
     struct block* next;
 };
 
-// Global variable that tracks allocated memory
+struct mem_range {
+    uint64_t base;
+    uint64_t end;
+};
+
+/*
+ * Global variable that tracks allocated memory. Free pages sit on one of
+ * three lists:
+ *
+ *   free   - dirty, handed out as is by kalloc()
+ *   clean  - zeroed except for the link word, preferred by kalloc_zeroed()
+ *   scrub  - given back with kfree_s(), never handed out before zeroing
+ *
+ * alloc_zero_work() moves pages from scrub and free over to clean.
+ * nfree counts all three, less whatever is being zeroed right now.
+ */
 struct {
+    spinlock lock;
     struct block* free;
+    struct block* clean;
+    struct block* scrub;
+    uint64_t nfree;
+    uint64_t nclean;
+    uint64_t nscrub;
 } kernel_heap = {0};
 
-void init_memory() {
-    char* ptr = (char*)PAGE_START;
+static struct mem_region mem_regions[MAX_MEM_REGIONS];
+static int mem_nregions;
 
-    printk("alloc: starting at %p", (void*)ptr);
-    printk("alloc: ending at %p", (void*)PAGE_END);
+static struct mem_range mem_reserved[MAX_MEM_RESERVED];
+static int mem_nreserved;
 
-    uint64_t alloced = 0;
+static uint64_t mem_npages;
 
-    for (; ptr + PAGE_SIZE <= (char*)PAGE_END; ptr += PAGE_SIZE) {
-        #ifdef DEBUG
-            // Print every 100th allocation
-            // printk is *way* too slow.
-            if (alloced % 100 == 0) {
-                printk("alloc: allocated %lu pages", alloced);
+static struct alloc_stats alloc_stats;
+
+// Registered under kernel_heap.lock, read without it
+static alloc_shrinker alloc_shrinkers[ALLOC_MAX_SHRINKERS];
+static atomic_int alloc_nshrinkers;
+// Set while a hart runs the shrinkers, one at a time is plenty
+static atomic_bool alloc_shrinking;
+
+#ifdef ALLOC_STATS
+// Open addressing on the return address. Guarded by kernel_heap.lock.
+static struct alloc_site alloc_sites[ALLOC_SITES];
+
+static uint16_t alloc_site_slot(uint64_t site) {
+    // Fibonacci hashing, instructions are at least 2 byte aligned
+    uint64_t h = ((site >> 1) * 0x9e3779b97f4a7c15ULL) >> 56;
+
+    for (int probe = 0; probe < ALLOC_SITES; probe++) {
+        uint16_t slot = (h + probe) & (ALLOC_SITES - 1);
+
+        // Slot 0 is the overflow slot
+        if (slot == 0)
+            continue;
+
+        if (alloc_sites[slot].site == site)
+            return slot;
+
+        if (alloc_sites[slot].site == 0) {
+            alloc_sites[slot].site = site;
+            return slot;
+        }
+    }
+
+    return 0;
+}
+
+static void alloc_account(struct page* pg, uint64_t site) {
+    struct alloc_site* as = &alloc_sites[alloc_site_slot(site)];
+
+    pg->site = as - alloc_sites;
+
+    as->allocs++;
+    if (++as->live > as->peak)
+        as->peak = as->live;
+
+    alloc_stats.allocs++;
+    if (alloc_stats.in_use > alloc_stats.peak)
+        alloc_stats.peak = alloc_stats.in_use;
+}
+
+static void alloc_unaccount(struct page* pg) {
+    struct alloc_site* as = &alloc_sites[pg->site];
+
+    as->frees++;
+    as->live--;
+
+    alloc_stats.frees++;
+}
+#endif
+
+void mem_add_region(uint64_t base, uint64_t size) {
+    uint64_t start = PAGE_ROUNDUP(base);
+    uint64_t end = PAGE_ROUNDDOWN(base + size);
+
+    if (end <= start)
+        return;
+
+    if (mem_nregions == MAX_MEM_REGIONS) {
+        printk("alloc: too many memory regions, ignoring %p", (void*)base);
+        return;
+    }
+
+    mem_regions[mem_nregions++] = (struct mem_region){
+        .base = start,
+        .npages = (end - start) >> PAGE_SHIFT,
+    };
+}
+
+void mem_reserve(uint64_t base, uint64_t size) {
+    if (size == 0)
+        return;
+
+    // Wrapped around, nothing sensible to reserve
+    if (base + size < base)
+        return;
+
+    if (mem_nreserved == MAX_MEM_RESERVED)
+        panicf("alloc: too many reserved ranges");
+
+    // Anything touching a page takes the whole page
+    mem_reserved[mem_nreserved++] = (struct mem_range){
+        .base = PAGE_ROUNDDOWN(base),
+        .end = PAGE_ROUNDUP(base + size),
+    };
+}
+
+/*
+ * Reads one reg property worth of (address, size) pairs into the memory map
+ * or the reserved list.
+ */
+static void mem_scan_reg(const void* dtb, int node, int acells, int scells,
+        bool reserve) {
+    int len;
+    const uint8_t* reg = fdt_getprop(dtb, node, "reg", &len);
+
+    if (!reg)
+        return;
+
+    int entry = 4 * (acells + scells);
+
+    for (; len >= entry; len -= entry, reg += entry) {
+        uint64_t base = fdt_read_cells(reg, acells);
+        uint64_t size = fdt_read_cells(reg + 4 * acells, scells);
+
+        if (reserve) {
+            mem_reserve(base, size);
+        } else {
+            printk("alloc: memory at %p, %lu KiB", (void*)base, size >> 10);
+            mem_add_region(base, size);
+        }
+    }
+}
+
+static int mem_cells(const void* dtb, int node, const char* name, int def) {
+    const void* val = fdt_getprop(dtb, node, name, NULL);
+    return val ? (int)fdt_read_cells(val, 1) : def;
+}
+
+/*
+ * Reads the memreserve block. It's a list of big endian (address, size)
+ * pairs that ends with a pair of zeros.
+ */
+static void mem_scan_rsvmap(const void* dtb) {
+    const uint8_t* fdt = dtb;
+    const uint8_t* p = fdt + fdt_read_cells(fdt + 16, 1);
+
+    for (;; p += 16) {
+        uint64_t base = fdt_read_cells(p, 2);
+        uint64_t size = fdt_read_cells(p + 8, 2);
+
+        if (base == 0 && size == 0)
+            break;
+
+        mem_reserve(base, size);
+    }
+}
+
+void init_memory_map(const void* dtb) {
+    if (fdt_check(dtb)) {
+        int root = fdt_path_offset(dtb, "/");
+        int acells = mem_cells(dtb, root, "#address-cells", 2);
+        int scells = mem_cells(dtb, root, "#size-cells", 1);
+
+        for (int node = fdt_first_subnode(dtb, root); node >= 0;
+                node = fdt_next_subnode(dtb, node)) {
+            const char* type = fdt_getprop(dtb, node, "device_type", NULL);
+
+            if (type && strcmp(type, "memory") == 0)
+                mem_scan_reg(dtb, node, acells, scells, false);
+        }
+
+        // Firmware like OpenSBI shows up here
+        int resv = fdt_path_offset(dtb, "/reserved-memory");
+        if (resv >= 0) {
+            int racells = mem_cells(dtb, resv, "#address-cells", acells);
+            int rscells = mem_cells(dtb, resv, "#size-cells", scells);
+
+            for (int node = fdt_first_subnode(dtb, resv); node >= 0;
+                    node = fdt_next_subnode(dtb, node)) {
+                mem_scan_reg(dtb, node, racells, rscells, true);
             }
-        #endif
-        if (kfree(ptr))
-            panicf("Initial memory free failed");
+        }
+
+        mem_scan_rsvmap(dtb);
+        mem_reserve((uint64_t)dtb, fdt_totalsize(dtb));
+
+        // Left where it is for the ramdisk
+        uint64_t start, end;
+        if (fdt_initrd(dtb, &start, &end) == 0)
+            mem_reserve(start, end - start);
+    }
 
-        alloced++;
+    if (mem_nregions == 0) {
+        printk("alloc: no memory in the device tree, assuming %lu KiB",
+                (uint64_t)FALLBACK_MEM_SIZE >> 10);
+        mem_add_region((uint64_t)KERNEL_BASE, FALLBACK_MEM_SIZE);
     }
 
-    printk("alloc: allocated %lu pages", alloced);
+    mem_reserve((uint64_t)KERNEL_BASE, (uint64_t)_end - (uint64_t)KERNEL_BASE);
+
+    init_memory_layout();
 }
 
-int kfree_s(void* ptr) {
+/*
+ * Finds size bytes inside a region that don't overlap anything reserved.
+ * Returns 0 if there is no such gap.
+ */
+static uint64_t mem_find_gap(struct mem_region* r, uint64_t size) {
+    uint64_t start = r->base;
+    uint64_t end = r->base + (r->npages << PAGE_SHIFT);
+    bool moved = true;
+
+    // Hop over reserved ranges until nothing overlaps anymore
+    while (moved) {
+        moved = false;
+
+        for (int i = 0; i < mem_nreserved; i++) {
+            if (mem_reserved[i].base < start + size
+                    && mem_reserved[i].end > start) {
+                start = mem_reserved[i].end;
+                moved = true;
+            }
+        }
+
+        if (start + size > end)
+            return 0;
+    }
+
+    return start;
+}
+
+void init_memory_layout(void) {
+    mem_npages = 0;
+
+    for (int i = 0; i < mem_nregions; i++) {
+        struct mem_region* r = &mem_regions[i];
+        uint64_t meta_size = PAGE_ROUNDUP(r->npages * sizeof(struct page));
+        uint64_t meta = mem_find_gap(r, meta_size);
+
+        if (!meta)
+            panicf("alloc: no room for page metadata");
+
+        mem_reserve(meta, meta_size);
+
+        r->pages = (struct page*)meta;
+        memset(r->pages, 0, r->npages * sizeof(struct page));
+
+        mem_npages += r->npages;
+    }
+
+    // Reserved ranges are few and small, so marking them page by page
+    // up front is cheaper than checking every page against the list.
+    for (int i = 0; i < mem_nreserved; i++) {
+        for (uint64_t a = mem_reserved[i].base; a < mem_reserved[i].end;
+                a += PAGE_SIZE) {
+            struct page* pg = page_meta((void*)a);
+
+            if (pg)
+                pg->flags |= PG_RESERVED;
+        }
+    }
+
+    printk("alloc: %lu pages in %d regions, %d reserved ranges", mem_npages,
+            mem_nregions, mem_nreserved);
+}
+
+void init_memory_slice(int slice, int nslices) {
+    uint64_t per_slice = (mem_npages + nslices - 1) / nslices;
+    uint64_t first = slice * per_slice;
+    uint64_t last = first + per_slice;
+
+    if (last > mem_npages)
+        last = mem_npages;
+
+    if (first >= last)
+        return;
+
+    // Chain the slice up privately, then splice it in with one trip
+    // through the lock so slices don't fight over it.
+    struct block* head = NULL;
+    struct block* tail = NULL;
+    uint64_t alloced = 0;
+    uint64_t index = 0;
+
+    for (int i = 0; i < mem_nregions; i++) {
+        struct mem_region* r = &mem_regions[i];
+
+        if (last <= index)
+            break;
+
+        uint64_t from = first > index ? first - index : 0;
+        uint64_t to = last - index < r->npages ? last - index : r->npages;
+
+        index += r->npages;
+
+        if (from >= to)
+            continue;
+
+        printk("alloc: slice %d pages %p to %p", slice,
+                (void*)(r->base + (from << PAGE_SHIFT)),
+                (void*)(r->base + (to << PAGE_SHIFT)));
+
+        for (uint64_t pfn = from; pfn < to; pfn++) {
+            if (r->pages[pfn].flags & PG_RESERVED)
+                continue;
+
+            struct block* block =
+                (struct block*)(r->base + (pfn << PAGE_SHIFT));
+
+            r->pages[pfn].flags |= PG_FREE;
+            block->next = head;
+            head = block;
+
+            if (!tail)
+                tail = block;
+
+            alloced++;
+
+            #ifdef DEBUG
+                // Print every 100th allocation, after the reserved check
+                // so a reserved run doesn't repeat the same line.
+                // printk is *way* too slow.
+                if (alloced % 100 == 0) {
+                    printk("alloc: allocated %lu pages", alloced);
+                }
+            #endif
+        }
+    }
+
+    if (head) {
+        acquire(&kernel_heap.lock);
+        tail->next = kernel_heap.free;
+        kernel_heap.free = head;
+        kernel_heap.nfree += alloced;
+        release(&kernel_heap.lock);
+    }
+
+    printk("alloc: slice %d allocated %lu pages", slice, alloced);
+}
+
+void init_memory(const void* dtb) {
+    init_memory_map(dtb);
+    init_memory_slice(0, 1);
+}
+
+uint64_t mem_total_pages(void) {
+    return mem_npages;
+}
+
+uint64_t mem_free_pages(void) {
+    return kernel_heap.nfree;
+}
+
+struct page* page_meta(const void* addr) {
+    uint64_t a = (uint64_t)addr;
+
+    for (int i = 0; i < mem_nregions; i++) {
+        struct mem_region* r = &mem_regions[i];
+
+        if (a >= r->base && a < r->base + (r->npages << PAGE_SHIFT))
+            return &r->pages[(a - r->base) >> PAGE_SHIFT];
+    }
+
+    return NULL;
+}
+
+/*
+ * Checks that ptr is a page we hand out. Returns its metadata or NULL.
+ */
+static struct page* kfree_check(void* ptr) {
     if ((uint64_t)ptr % PAGE_SIZE != 0)
-        return -1;
+        return NULL;
 
-    if (ptr < (void*)PAGE_START)
-        return -1;
+    struct page* pg = page_meta(ptr);
 
-    if (ptr >= (void*)PAGE_END)
-        return -1;
-    
-    // Zeros the page
-    memset_s(ptr, 0, PAGE_SIZE);
+    if (!pg || (pg->flags & PG_RESERVED))
+        return NULL;
+
+    return pg;
+}
 
+static int kfree_push(struct page* pg, void* ptr, bool scrub, void* caller) {
     struct block* block = (struct block*)ptr;
-    block->next = kernel_heap.free;
-    kernel_heap.free = block;
+
+    acquire(&kernel_heap.lock);
+
+    if (pg->flags & PG_FREE) {
+        alloc_stats.double_frees++;
+        release(&kernel_heap.lock);
+
+        #ifdef DEBUG
+            printk("alloc: double free of %p from %p", ptr, caller);
+            panicf("Double free");
+        #else
+            (void)caller;
+        #endif
+
+        return -1;
+    }
+
+    #ifdef ALLOC_STATS
+        alloc_unaccount(pg);
+    #endif
+    alloc_stats.in_use--;
+
+    pg->flags |= PG_FREE;
+
+    if (scrub) {
+        block->next = kernel_heap.scrub;
+        kernel_heap.scrub = block;
+        kernel_heap.nscrub++;
+    } else {
+        block->next = kernel_heap.free;
+        kernel_heap.free = block;
+    }
+
+    kernel_heap.nfree++;
+    release(&kernel_heap.lock);
 
     return 0;
 }
 
-int kfree(void* ptr)  {
-    struct block* block = (struct block*)ptr;
+int kfree_s(void* ptr) {
+    struct page* pg = kfree_check(ptr);
 
-    if ((uint64_t)ptr % PAGE_SIZE != 0)
+    if (!pg)
         return -1;
 
-    if (ptr < (void*)PAGE_START)
+    // No zeroing here, the page waits on the scrub list until
+    // alloc_zero_work() or the next kalloc that needs it gets to it.
+    return kfree_push(pg, ptr, true, __builtin_return_address(0));
+}
+
+int kfree(void* ptr)  {
+    struct page* pg = kfree_check(ptr);
+
+    if (!pg)
         return -1;
 
-    if (ptr >= (void*)PAGE_END)
+    return kfree_push(pg, ptr, false, __builtin_return_address(0));
+}
+
+static struct block* heap_pop(struct block** list) {
+    struct block* block = *list;
+
+    if (block)
+        *list = block->next;
+
+    return block;
+}
+
+/*
+ * Takes a page off the lists. Set *dirty when the caller still has to
+ * zero it, either because it asked for zeros or the page came off scrub.
+ * Must hold kernel_heap.lock.
+ */
+static struct block* heap_take(bool zeroed, bool* dirty) {
+    struct block* block;
+
+    if (zeroed && (block = heap_pop(&kernel_heap.clean))) {
+        kernel_heap.nclean--;
+        *dirty = false;
+        return block;
+    }
+
+    if ((block = heap_pop(&kernel_heap.free))) {
+        *dirty = zeroed;
+        return block;
+    }
+
+    if ((block = heap_pop(&kernel_heap.clean))) {
+        kernel_heap.nclean--;
+        *dirty = false;
+        return block;
+    }
+
+    if ((block = heap_pop(&kernel_heap.scrub))) {
+        kernel_heap.nscrub--;
+        *dirty = true;
+        return block;
+    }
+
+    return NULL;
+}
+
+int alloc_register_shrinker(alloc_shrinker fn) {
+    acquire(&kernel_heap.lock);
+
+    int n = atomic_load(&alloc_nshrinkers);
+    if (n == ALLOC_MAX_SHRINKERS) {
+        release(&kernel_heap.lock);
         return -1;
+    }
+
+    alloc_shrinkers[n] = fn;
+    atomic_store(&alloc_nshrinkers, n + 1);
 
-    block->next = kernel_heap.free;
-    kernel_heap.free = block;
+    release(&kernel_heap.lock);
 
     return 0;
 }
 
-void* kalloc() {
-    struct block* block = kernel_heap.free;
+int alloc_shrink(int nr) {
+    if (atomic_exchange(&alloc_shrinking, true))
+        return 0;
 
-    if (!block)
+    int freed = 0;
+    int n = atomic_load(&alloc_nshrinkers);
+
+    for (int i = 0; i < n; i++) {
+        freed += alloc_shrinkers[i](nr);
+    }
+
+    atomic_store(&alloc_shrinking, false);
+
+    return freed;
+}
+
+static void* kalloc_from(uint64_t site, bool zeroed) {
+    bool dirty = false;
+
+    acquire(&kernel_heap.lock);
+
+    struct block* block = heap_take(zeroed, &dirty);
+
+    // Last chance, whatever the caches can give back right away
+    if (!block) {
+        release(&kernel_heap.lock);
+        alloc_shrink(ALLOC_SHRINK_BATCH);
+        acquire(&kernel_heap.lock);
+        block = heap_take(zeroed, &dirty);
+    }
+
+    if (!block) {
+        release(&kernel_heap.lock);
+        printk("alloc: out of memory, %lu pages in use, %lu at peak",
+                alloc_stats.in_use, alloc_stats.peak);
+        alloc_dump_sites(8);
         panicf("Out of memory");
+    }
+
+    struct page* pg = page_meta(block);
+
+    kernel_heap.nfree--;
+    pg->flags &= ~PG_FREE;
 
-    kernel_heap.free = block->next;
+    alloc_stats.in_use++;
+    if (dirty)
+        alloc_stats.zeroed_inline++;
+
+    #ifdef ALLOC_STATS
+        alloc_account(pg, site);
+    #else
+        (void)site;
+    #endif
+
+    bool low = kernel_heap.nfree < ALLOC_LOW_PAGES;
+
+    release(&kernel_heap.lock);
+
+    if (low)
+        alloc_shrink(ALLOC_SHRINK_BATCH);
+
+    // Off the lock, nobody else can see the page anymore
+    if (dirty)
+        memset(block, 0, PAGE_SIZE);
+    else
+        block->next = NULL;
 
     return (void*)block;
 }
 
+void* kalloc() {
+    return kalloc_from((uint64_t)__builtin_return_address(0), false);
+}
+
+void* kalloc_zeroed(void) {
+    return kalloc_from((uint64_t)__builtin_return_address(0), true);
+}
+
+int alloc_zero_work(int budget) {
+    int done = 0;
+
+    // Every idle hart calls this on every trip around its loop, and almost
+    // always there's nothing to do. Look before taking the heap lock off
+    // whoever is allocating. The counts only change under the lock, a
+    // stale read just means this trip or the next one sorts it out.
+    if (__atomic_load_n(&kernel_heap.nscrub, __ATOMIC_RELAXED) == 0
+        && __atomic_load_n(&kernel_heap.nclean, __ATOMIC_RELAXED)
+            >= ZERO_POOL_TARGET)
+        return 0;
+
+    while (done < budget) {
+        acquire(&kernel_heap.lock);
+
+        // Pages waiting for a scrub come first, they hold someone's data
+        struct block* block = heap_pop(&kernel_heap.scrub);
+
+        if (block)
+            kernel_heap.nscrub--;
+        else if (kernel_heap.nclean < ZERO_POOL_TARGET)
+            block = heap_pop(&kernel_heap.free);
+
+        // Still PG_FREE while we hold it, so a stray kfree is caught
+        if (block)
+            kernel_heap.nfree--;
+
+        release(&kernel_heap.lock);
+
+        if (!block)
+            break;
+
+        memset(block, 0, PAGE_SIZE);
+
+        acquire(&kernel_heap.lock);
+        block->next = kernel_heap.clean;
+        kernel_heap.clean = block;
+        kernel_heap.nclean++;
+        kernel_heap.nfree++;
+        alloc_stats.zeroed_background++;
+        release(&kernel_heap.lock);
+
+        done++;
+    }
+
+    return done;
+}
+
+uint64_t mem_clean_pages(void) {
+    return kernel_heap.nclean;
+}
+
+void alloc_get_stats(struct alloc_stats* out) {
+    acquire(&kernel_heap.lock);
+    *out = alloc_stats;
+    release(&kernel_heap.lock);
+}
+
+#ifdef ALLOC_STATS
+void alloc_dump_sites(int top) {
+    // Selection by live pages, the table is small and this is rare
+    static bool shown[ALLOC_SITES];
+
+    acquire(&kernel_heap.lock);
+
+    memset(shown, 0, sizeof(shown));
+
+    for (int n = 0; n < top; n++) {
+        int best = -1;
+
+        for (int i = 0; i < ALLOC_SITES; i++) {
+            if (shown[i] || alloc_sites[i].allocs == 0)
+                continue;
+
+            if (best < 0 || alloc_sites[i].live > alloc_sites[best].live)
+                best = i;
+        }
+
+        if (best < 0)
+            break;
+
+        shown[best] = true;
+
+        struct alloc_site* as = &alloc_sites[best];
+        printk("alloc,%p,%lu,%lu,%lu,%lu", (void*)as->site, as->live,
+                as->peak, as->allocs, as->frees);
+    }
+
+    release(&kernel_heap.lock);
+}
+
+void alloc_leak_mark(void) {
+    acquire(&kernel_heap.lock);
+
+    for (int i = 0; i < ALLOC_SITES; i++) {
+        alloc_sites[i].mark = alloc_sites[i].live;
+    }
+
+    release(&kernel_heap.lock);
+}
+
+uint64_t alloc_leak_check(void) {
+    uint64_t leaked = 0;
+
+    acquire(&kernel_heap.lock);
+
+    for (int i = 0; i < ALLOC_SITES; i++) {
+        struct alloc_site* as = &alloc_sites[i];
+
+        if (as->live <= as->mark)
+            continue;
+
+        printk("alloc: %lu pages from %p still held since the mark",
+                as->live - as->mark, (void*)as->site);
+        leaked += as->live - as->mark;
+    }
+
+    release(&kernel_heap.lock);
+
+    return leaked;
+}
+#else
+void alloc_dump_sites(int top) {
+    (void)top;
+    printk("alloc: built without ALLOC_STATS, no call sites");
+}
+
+void alloc_leak_mark(void) {
+}
+
+uint64_t alloc_leak_check(void) {
+    printk("alloc: built without ALLOC_STATS, can't check for leaks");
+    return 0;
+}
+#endif
@@ -1,27 +1,204 @@
 #pragma once
+#include <stdint.h>
 
-extern char* _end;
+// End of the kernel image, provided by linker.ld. The host build renames
+// this to a static arena (see host/stubs.c).
+extern char _end[];
 
 #define KERNEL_BASE (void*)0x80000000
 
 // 4 KiB is standard for page sizes
 #define PAGE_SIZE 4096
-
-// Right now, our board has 128MB of ram
-// 128 * 1024 = 131072
-// 131072 / 4 = 32768
-// We can have up to 32768 pages
-// Let's just use like 32,000 pages to be safe.
-#define NUM_PAGES 32000
+#define PAGE_SHIFT 12
 
 #define PAGE_ROUNDUP(x) ((x + PAGE_SIZE - 1) & -PAGE_SIZE)
+#define PAGE_ROUNDDOWN(x) ((x) & -PAGE_SIZE)
+
+// Most discontiguous RAM ranges we keep track of
+#define MAX_MEM_REGIONS 8
+
+// Most reserved ranges we honour, on top of the kernel and device tree
+#define MAX_MEM_RESERVED 16
+
+// Allocation accounting. Costs a hash lookup per kalloc/kfree, so it's
+// off unless asked for. Debug builds always have it.
+#if defined(DEBUG) && !defined(ALLOC_STATS)
+#define ALLOC_STATS
+#endif
+
+// Call sites tracked, power of two. Slot 0 collects whatever doesn't fit.
+#define ALLOC_SITES 256
+
+// Pre-zeroed pages alloc_zero_work() keeps around. Pages freed with
+// kfree_s() are always zeroed, on top of this.
+#define ZERO_POOL_TARGET 1024
+
+// Below this many free pages, every kalloc asks the shrinkers for memory
+// back. Caches freeing through RCU only get pages back a grace period
+// later, so this has to start well before the heap is empty.
+#define ALLOC_LOW_PAGES 256
+
+// Objects asked of each shrinker per call, and most shrinkers registered
+#define ALLOC_SHRINK_BATCH 16
+#define ALLOC_MAX_SHRINKERS 4
+
+// Page flags
+#define PG_RESERVED (1 << 0)  // never handed out
+#define PG_FREE (1 << 1)      // on the free list
+
+/*
+ * Per-page metadata. Kept to a few bytes so the whole array stays small and
+ * dense; a 4 GiB guest needs 2 MiB of it.
+ */
+struct page {
+    uint16_t flags;
+#ifdef ALLOC_STATS
+    // Slot in the call site table of whoever allocated it
+    uint16_t site;
+#endif
+};
+
+struct alloc_stats {
+    uint64_t in_use;
+    uint64_t peak;
+    uint64_t allocs;
+    uint64_t frees;
+    // kfree calls on pages that were already free
+    uint64_t double_frees;
+    // Pages zeroed on the way out of kalloc, and ahead of time by
+    // alloc_zero_work()
+    uint64_t zeroed_inline;
+    uint64_t zeroed_background;
+};
+
+struct alloc_site {
+    // Return address of the kalloc call, 0 for the overflow slot
+    uint64_t site;
+    uint64_t live;
+    uint64_t peak;
+    uint64_t allocs;
+    uint64_t frees;
+    // live at the last alloc_leak_mark()
+    uint64_t mark;
+};
+
+/*
+ * A contiguous range of RAM. Every region carries its own metadata array,
+ * so holes between regions cost nothing.
+ */
+struct mem_region {
+    uint64_t base;
+    uint64_t npages;
+    struct page* pages;
+};
 
-#define PAGE_START PAGE_ROUNDUP((uint64_t)&_end)
+/*
+ * Builds the memory map from the memory nodes of the device tree. Reserves
+ * the kernel image, the device tree itself, the memreserve block and any
+ * /reserved-memory children. Falls back to 128 MiB at KERNEL_BASE when there
+ * is no usable tree.
+ *
+ * Must run on one hart before any init_memory_slice().
+ */
+void init_memory_map(const void* dtb);
 
-#define PAGE_END (PAGE_START + (NUM_PAGES * PAGE_SIZE))
+/*
+ * Registers RAM or carves a range out of it, for when there is no device
+ * tree to describe it. Both must come before init_memory_layout().
+ */
+void mem_add_region(uint64_t base, uint64_t size);
+void mem_reserve(uint64_t base, uint64_t size);
 
-void init_memory();
+/*
+ * Places the metadata arrays and marks reserved pages. init_memory_map()
+ * calls this itself.
+ */
+void init_memory_layout(void);
+
+/*
+ * Puts one of nslices equal slices of the usable pages on the free list.
+ * Every slice can be done by a different hart at the same time.
+ */
+void init_memory_slice(int slice, int nslices);
+
+/*
+ * Brings up the whole heap on the calling hart.
+ */
+void init_memory(const void* dtb);
+
+// Pages managed, including reserved ones, pages on the free lists and
+// how many of those are already zeroed
+uint64_t mem_total_pages(void);
+uint64_t mem_free_pages(void);
+uint64_t mem_clean_pages(void);
+
+/*
+ * Metadata of the page holding addr, or NULL if we don't manage it.
+ */
+struct page* page_meta(const void* addr);
+
+/*
+ * Copies the global counters. Zeros without ALLOC_STATS, except for
+ * in_use, double_frees and the zeroing counters which are always kept.
+ */
+void alloc_get_stats(struct alloc_stats* out);
+
+/*
+ * Prints the top call sites by pages held, one per line:
+ *
+ *     alloc,<site>,<live>,<peak>,<allocs>,<frees>
+ *
+ * Sites are return addresses, feed them to addr2line.
+ */
+void alloc_dump_sites(int top);
+
+/*
+ * Remembers how many pages every call site holds right now.
+ * alloc_leak_check() then reports every site that holds more since, and
+ * returns how many pages that adds up to.
+ */
+void alloc_leak_mark(void);
+uint64_t alloc_leak_check(void);
+
+/*
+ * Gives back up to nr objects' worth of memory and returns how many it
+ * freed. Called from inside kalloc(), maybe on a hart that holds the
+ * cache's own lock around that kalloc(), so it must only try_acquire()
+ * its locks, and it must not allocate.
+ */
+typedef int (*alloc_shrinker)(int nr);
+
+/*
+ * Has kalloc() call fn when the heap runs low and once more before it
+ * gives up. Returns -1 if ALLOC_MAX_SHRINKERS are registered already.
+ */
+int alloc_register_shrinker(alloc_shrinker fn);
+
+/*
+ * Asks every shrinker for up to nr objects. Returns how many came back.
+ * Does nothing if another hart is already at it.
+ */
+int alloc_shrink(int nr);
 
 void* kalloc();
 int kfree(void* ptr) __attribute__((warn_unused_result));
+
+/*
+ * Frees a page that held something worth hiding. The page is zeroed before
+ * anyone gets it again, but not here: it waits for alloc_zero_work() or
+ * the kalloc that finally needs it.
+ */
 int kfree_s(void* ptr) __attribute__((warn_unused_result));
+
+/*
+ * A page of zeros. Comes from the pre-zeroed pool and only zeroes inline
+ * when that has run dry.
+ */
+void* kalloc_zeroed(void);
+
+/*
+ * Background zeroing, for idle loops. Zeroes up to budget pages, scrub
+ * pages first, then dirty ones until ZERO_POOL_TARGET pages are clean.
+ * Returns how many it did, 0 once there is nothing left to do.
+ */
+int alloc_zero_work(int budget);
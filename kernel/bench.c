@@ -0,0 +1,823 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// In-kernel benchmarks. Built into every kernel but only run when compiled
+// with -DBENCH (see `make bench`).
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bench.h"
+#include "alloc.h"
+#include "block.h"
+#include "blkring.h"
+#include "cblk.h"
+#include "clint.h"
+#include "console.h"
+#include "dcache.h"
+#include "fs.h"
+#include "lock.h"
+#include "net.h"
+#include "panic.h"
+#include "print.h"
+#include "rcu.h"
+#include "riscv.h"
+#include "string.h"
+#include "trap.h"
+
+// Number of pages held at once by the allocator benchmarks
+#define BENCH_PAGES 1024
+
+#define BENCH_LOCK_ITERS 100000
+#define BENCH_PRINTK_ITERS 64
+// Lines in the bulk printk benchmark, like dumping a profile
+#define BENCH_PRINTK_BULK 1024
+#define BENCH_TRAP_ITERS 10000
+
+// Every memory benchmark moves roughly this many bytes in total
+#define BENCH_MEM_TOTAL (4 * 1024 * 1024)
+
+// Every disk benchmark writes this many sectors in total
+#define BENCH_DISK_SECTORS 1024
+
+// Rounds over the first BENCH_DISK_SECTORS of zvda per compression
+// benchmark
+#define BENCH_ZBLK_ROUNDS 4
+
+// Lookups per hart in the read scaling benchmarks, and how often the RCU
+// readers pass a quiescent state
+#define BENCH_READ_ITERS 100000
+#define BENCH_READ_QS 256
+#define BENCH_READ_ENTRIES 16
+#define BENCH_RCU_SYNC_ITERS 100
+
+// Path resolutions per path lookup benchmark
+#define BENCH_NAMEI_ITERS 10000
+
+// Frames per network benchmark, sent in batches with one notify each
+#define BENCH_NET_PKTS 4096
+#define BENCH_NET_BATCH 32
+
+struct bench_sample {
+    uint64_t cycles;
+    uint64_t ticks;
+};
+
+static void* bench_pages[BENCH_PAGES];
+
+static inline void bench_start(struct bench_sample* s) {
+    s->ticks = rdtime();
+    s->cycles = rdcycle();
+}
+
+static inline void bench_stop(struct bench_sample* s) {
+    s->cycles = rdcycle() - s->cycles;
+    s->ticks = rdtime() - s->ticks;
+}
+
+static void bench_report(const char* name, uint64_t iters, uint64_t bytes,
+        struct bench_sample* s) {
+    printk("bench,%s,%lu,%lu,%lu,%lu", name, iters, bytes, s->cycles,
+            s->ticks);
+}
+
+static void bench_alloc(void) {
+    struct bench_sample s;
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        bench_pages[i] = kalloc();
+    }
+    bench_stop(&s);
+    bench_report("kalloc", BENCH_PAGES, 0, &s);
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        if (kfree(bench_pages[i]))
+            panicf("bench: kfree failed");
+    }
+    bench_stop(&s);
+    bench_report("kfree", BENCH_PAGES, 0, &s);
+
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        bench_pages[i] = kalloc();
+    }
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        if (kfree_s(bench_pages[i]))
+            panicf("bench: kfree_s failed");
+    }
+    bench_stop(&s);
+    bench_report("kfree_s", BENCH_PAGES, (uint64_t)BENCH_PAGES * PAGE_SIZE,
+            &s);
+
+    // What kfree_s used to pay for, now left to the idle harts. Drains the
+    // scrub list and tops up the pool for the next one.
+    uint64_t zeroed = 0;
+    int n;
+
+    bench_start(&s);
+    while ((n = alloc_zero_work(64)) > 0) {
+        zeroed += n;
+    }
+    bench_stop(&s);
+    bench_report("zero_work", zeroed, zeroed * PAGE_SIZE, &s);
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        bench_pages[i] = kalloc_zeroed();
+    }
+    bench_stop(&s);
+    bench_report("kalloc_zeroed", BENCH_PAGES, 0, &s);
+
+    for (int i = 0; i < BENCH_PAGES; i++) {
+        if (kfree(bench_pages[i]))
+            panicf("bench: kfree failed");
+    }
+}
+
+static void bench_mem(void) {
+    static const struct {
+        size_t size;
+        const char* set_name;
+        const char* cpy_name;
+    } cases[] = {
+        { 64, "memset_64", "memcpy_64" },
+        { 512, "memset_512", "memcpy_512" },
+        { PAGE_SIZE, "memset_4096", "memcpy_4096" },
+    };
+    struct bench_sample s;
+
+    uint8_t* src = kalloc();
+    uint8_t* dst = kalloc();
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t size = cases[i].size;
+        uint64_t iters = BENCH_MEM_TOTAL / size;
+
+        bench_start(&s);
+        for (uint64_t j = 0; j < iters; j++) {
+            memset(dst, (int)j, size);
+        }
+        bench_stop(&s);
+        bench_report(cases[i].set_name, iters, iters * size, &s);
+
+        bench_start(&s);
+        for (uint64_t j = 0; j < iters; j++) {
+            memcpy(dst, src, size);
+        }
+        bench_stop(&s);
+        bench_report(cases[i].cpy_name, iters, iters * size, &s);
+    }
+
+    bench_start(&s);
+    for (uint64_t j = 0; j < BENCH_MEM_TOTAL / PAGE_SIZE; j++) {
+        memset_s(dst, 0, PAGE_SIZE);
+    }
+    bench_stop(&s);
+    bench_report("memset_s_4096", BENCH_MEM_TOTAL / PAGE_SIZE,
+            BENCH_MEM_TOTAL, &s);
+
+    if (kfree(src) || kfree(dst))
+        panicf("bench: kfree failed");
+}
+
+static void bench_lock(void) {
+    static spinlock lock;
+    struct bench_sample s;
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_LOCK_ITERS; i++) {
+        acquire(&lock);
+        release(&lock);
+    }
+    bench_stop(&s);
+    bench_report("spinlock", BENCH_LOCK_ITERS, 0, &s);
+}
+
+static void bench_printk(void) {
+    struct bench_sample s;
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_PRINTK_ITERS; i++) {
+        printk("bench-printk %d %p %s", i, (void*)bench_pages, "filler");
+    }
+    bench_stop(&s);
+    bench_report("printk", BENCH_PRINTK_ITERS, 0, &s);
+
+    // 64 byte lines, newline included, about the size of a prof, line.
+    // Includes getting the last of it out of the console.
+    const char* fill = "0123456789abcdef0123456789abcdef0123456789abc";
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_PRINTK_BULK; i++) {
+        printk("bench-bulk,%p,%s", (void*)(uint64_t)(0x1000 + i), fill);
+    }
+    console_flush();
+    bench_stop(&s);
+    bench_report("printk_bulk", BENCH_PRINTK_BULK,
+            (uint64_t)BENCH_PRINTK_BULK * 64, &s);
+}
+
+static void bench_disk(void) {
+    static const struct {
+        uint64_t size;
+        const char* name;
+    } cases[] = {
+        { SECTOR_SIZE, "blk_write_512" },
+        { PAGE_SIZE, "blk_write_4096" },
+        { 64 * 1024, "blk_write_65536" },
+    };
+    struct bench_sample s;
+
+    // Direct writes are refused while zvda holds the disk
+    if (virtio_blk.holder)
+        return;
+
+    volatile uint8_t* buf = kalloc();
+    memset((void*)buf, 0xa5, PAGE_SIZE);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint64_t per_op = cases[i].size / SECTOR_SIZE;
+        uint64_t ops = BENCH_DISK_SECTORS / per_op;
+        uint64_t sector = 0;
+
+        // The driver only takes one sector per request, so a bigger
+        // transfer is a run of back to back sector writes.
+        bench_start(&s);
+        for (uint64_t op = 0; op < ops; op++) {
+            for (uint64_t j = 0; j < per_op; j++, sector++) {
+                virtio_blk_write(buf, sector);
+            }
+        }
+        bench_stop(&s);
+        bench_report(cases[i].name, ops, ops * cases[i].size, &s);
+    }
+
+    if (kfree((void*)buf))
+        panicf("bench: kfree failed");
+}
+
+static void bench_net_frame(uint8_t* frame, uint16_t type) {
+    const uint8_t* mac = net_mac();
+
+    for (int i = 0; i < 6; i++) {
+        frame[i] = 0xff;
+        frame[6 + i] = mac[i];
+    }
+
+    frame[12] = type >> 8;
+    frame[13] = type & 0xff;
+}
+
+/*
+ * Sends count frames in batches and waits for the device to finish them.
+ */
+static void bench_net_send(const uint8_t* frame, uint32_t len, int count) {
+    for (int sent = 0; sent < count;) {
+        for (int j = 0; j < BENCH_NET_BATCH && sent < count; j++, sent++) {
+            while (net_xmit(frame, len) < 0) {
+                net_xmit_flush();
+            }
+        }
+        net_xmit_flush();
+    }
+
+    while (net_tx_inflight() > 0) {
+        __asm__ volatile ("nop");
+    }
+}
+
+/*
+ * Transmit rate at the smallest and largest frame, straight out of one
+ * page. Then receive rate, from ARP replies of QEMU's user network gateway
+ * at 10.0.2.2. Packets per second is iterations * timebase / ticks.
+ */
+static void bench_net(void) {
+    static const struct {
+        uint32_t len;
+        const char* name;
+    } cases[] = {
+        { 60, "net_tx_60" },
+        { NET_MTU, "net_tx_1514" },
+    };
+    struct bench_sample s;
+
+    if (!net_present()) {
+        printk("bench: no network device, skipping");
+        return;
+    }
+
+    uint8_t* frame = kalloc_zeroed();
+
+    // Local experimental ethertype, nobody should answer it
+    bench_net_frame(frame, 0x88b5);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        bench_start(&s);
+        bench_net_send(frame, cases[i].len, BENCH_NET_PKTS);
+        bench_stop(&s);
+        bench_report(cases[i].name, BENCH_NET_PKTS,
+                (uint64_t)BENCH_NET_PKTS * cases[i].len, &s);
+    }
+
+    // ARP who-has 10.0.2.2 tell 10.0.2.15
+    static const uint8_t arp[] = {
+        0x00, 0x01, 0x08, 0x00, 6, 4, 0x00, 0x01,
+    };
+    memset(frame, 0, PAGE_SIZE);
+    bench_net_frame(frame, 0x0806);
+    memcpy(frame + 14, arp, sizeof(arp));
+    memcpy(frame + 22, net_mac(), 6);
+    memcpy(frame + 28, (uint8_t[]){ 10, 0, 2, 15 }, 4);
+    memcpy(frame + 38, (uint8_t[]){ 10, 0, 2, 2 }, 4);
+
+    struct net_stats before, now;
+    net_get_stats(&before);
+
+    bench_start(&s);
+    uint64_t deadline = rdtime() + TIMEBASE_HZ;
+
+    for (int sent = 0; sent < BENCH_NET_PKTS && rdtime() < deadline;) {
+        bench_net_send(frame, 60, BENCH_NET_BATCH);
+        sent += BENCH_NET_BATCH;
+
+        do {
+            net_poll(NET_POLL_BUDGET);
+            net_get_stats(&now);
+        } while (now.rx_packets - before.rx_packets < (uint64_t)sent
+                && rdtime() < deadline);
+    }
+
+    bench_stop(&s);
+    bench_report("net_rx_arp", now.rx_packets - before.rx_packets,
+            now.rx_bytes - before.rx_bytes, &s);
+
+    if (kfree(frame))
+        panicf("bench: kfree failed");
+}
+
+/*
+ * Same sizes and sectors as bench_disk(), but each transfer is one op and
+ * a whole ring of them goes out per submit. Ends with a flush. names are
+ * for 512, 4096 and 65536 byte ops.
+ */
+static void bench_disk_ring(struct blkdev* dev, const char* const names[3]) {
+    static const uint32_t sizes[] = { SECTOR_SIZE, PAGE_SIZE, 64 * 1024 };
+    // Ops take one contiguous buffer, which kalloc can't do past a page
+    static uint8_t buf[64 * 1024] __attribute__((aligned(PAGE_SIZE)));
+    static struct blk_ring ring;
+    struct blk_cqe cqes[2 * BLK_RING_MAX];
+    struct bench_sample s;
+
+    if (!dev || dev->capacity < BENCH_DISK_SECTORS)
+        return;
+
+    if (blk_ring_init(&ring, dev, BLK_RING_MAX))
+        panicf("bench: no blk_ring");
+
+    memset(buf, 0x5a, sizeof(buf));
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint32_t per_op = sizes[i] / SECTOR_SIZE;
+        uint64_t ops = BENCH_DISK_SECTORS / per_op;
+        uint64_t queued = 0, done = 0, failed = 0;
+
+        bench_start(&s);
+        while (done < ops + 1) {
+            struct blk_sqe* sqe;
+
+            while (queued < ops && (sqe = blk_ring_get_sqe(&ring))) {
+                *sqe = (struct blk_sqe){
+                    .op = BLK_OP_WRITE,
+                    .sector = queued * per_op,
+                    .buf = buf,
+                    .len = sizes[i],
+                    .tag = queued,
+                };
+                queued++;
+            }
+
+            // A flush only covers writes that are done, so it waits for
+            // all of them
+            if (done == ops && queued == ops) {
+                sqe = blk_ring_get_sqe(&ring);
+                *sqe = (struct blk_sqe){ .op = BLK_OP_FLUSH, .tag = ops };
+                queued++;
+            }
+
+            blk_ring_submit(&ring);
+
+            int n = blk_ring_wait(&ring, cqes, 1, 2 * BLK_RING_MAX);
+            for (int j = 0; j < n; j++) {
+                failed += cqes[j].result != BLK_OK;
+            }
+            done += n;
+        }
+        bench_stop(&s);
+
+        if (failed)
+            printk("bench: %lu ops on %s failed", failed, dev->name);
+
+        bench_report(names[i], ops, ops * sizes[i], &s);
+    }
+
+    blk_ring_destroy(&ring);
+}
+
+static void bench_blk_done(struct blk_req* req, int result) {
+    *(volatile int*)req->priv = result;
+}
+
+// Only for devices that finish requests inside blk_add()
+static int bench_blk_sync(struct blkdev* dev, int op, uint64_t sector,
+        void* buf, uint32_t len) {
+    volatile int result = 1;
+    struct blk_req req = {
+        .op = op,
+        .sector = sector,
+        .buf = buf,
+        .len = len,
+        .done = bench_blk_done,
+        .priv = (void*)&result,
+    };
+
+    while (blk_add(dev, &req)) {
+        blk_reap(dev);
+    }
+
+    return result;
+}
+
+// Words picked at random, so it compresses about as well as a log would
+static void bench_fill_text(uint8_t* buf, size_t len) {
+    static const char* const words[] = {
+        "hart ", "request ", "sector ", "done ", "queue ", "block ", "in ",
+        "ticks", "0 ", "17 ", "256 ", "4096 ", ": ", "\n",
+    };
+    uint64_t x = 88172645463325252ULL;
+    size_t n = 0;
+
+    while (n < len) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        const char* w = words[x % (sizeof(words) / sizeof(words[0]))];
+
+        for (; *w && n < len; w++) {
+            buf[n++] = *w;
+        }
+    }
+}
+
+static void bench_fill_random(uint8_t* buf, size_t len) {
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = x;
+    }
+}
+
+/*
+ * 64 KiB requests through zvda: log text, noise that won't compress, then
+ * the text read back. Every request is one batch, compressed or
+ * decompressed on all harts. Needs `make bench COMPRESS=1`, which skips
+ * the vda benchmarks instead.
+ */
+static void bench_compress(void) {
+    static uint8_t buf[CBLK_BATCH * CBLK_CLUSTER];
+    static const struct {
+        int op;
+        bool text;
+        const char* name;
+    } cases[] = {
+        { BLK_OP_WRITE, false, "zblk_write_random" },
+        { BLK_OP_WRITE, true, "zblk_write_text" },
+        { BLK_OP_READ, true, "zblk_read_text" },
+    };
+    struct blkdev* dev = blkdev_find("zvda");
+    uint32_t per_op = sizeof(buf) / SECTOR_SIZE;
+    uint64_t ops = BENCH_ZBLK_ROUNDS * (BENCH_DISK_SECTORS / per_op);
+    struct bench_sample s;
+
+    if (!dev || dev->capacity < BENCH_DISK_SECTORS)
+        return;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint64_t failed = 0;
+
+        if (cases[i].op == BLK_OP_WRITE && cases[i].text)
+            bench_fill_text(buf, sizeof(buf));
+        else if (cases[i].op == BLK_OP_WRITE)
+            bench_fill_random(buf, sizeof(buf));
+
+        bench_start(&s);
+        for (uint64_t op = 0; op < ops; op++) {
+            uint64_t sector = op * per_op % BENCH_DISK_SECTORS;
+
+            failed += bench_blk_sync(dev, cases[i].op, sector, buf,
+                    sizeof(buf)) != BLK_OK;
+        }
+        bench_stop(&s);
+
+        if (failed)
+            printk("bench: %lu ops on %s failed", failed, dev->name);
+
+        bench_report(cases[i].name, ops, ops * sizeof(buf), &s);
+    }
+
+    cblk_dump_stats(&zvda);
+}
+
+/*
+ * Raises a software interrupt on ourselves over and over. Reports the full
+ * round trip, plus the entry-to-handler part measured by the trap code.
+ */
+static void bench_trap(void) {
+    struct bench_sample s;
+    struct trap_stats before, after;
+    uint64_t hart = r_mhartid();
+
+    trap_get_stats(hart, IRQ_M_SOFT, &before);
+
+    csr_set(mie, MIE_MSIE);
+    intr_on();
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_TRAP_ITERS; i++) {
+        *CLINT_MSIP(hart) = 1;
+        // The handler clears it
+        while (*CLINT_MSIP(hart)) {
+            __asm__ volatile ("nop");
+        }
+    }
+    bench_stop(&s);
+
+    csr_clear(mie, MIE_MSIE);
+
+    trap_get_stats(hart, IRQ_M_SOFT, &after);
+
+    bench_report("trap_soft_roundtrip", BENCH_TRAP_ITERS, 0, &s);
+
+    s.cycles = after.total - before.total;
+    s.ticks = 0;
+    bench_report("trap_soft_entry", after.count - before.count, 0, &s);
+}
+
+/*
+ * Work for the secondary harts. bench_on_harts() bumps the generation and
+ * every hart below bench_job_harts runs bench_job once for it.
+ */
+static void (*bench_job)(int hart);
+static int bench_job_harts;
+static atomic_uint bench_job_gen;
+static atomic_int bench_job_done;
+
+// Harts that have turned up in bench_secondary()
+static atomic_uint bench_harts;
+
+void bench_secondary(void) {
+    static unsigned seen[MAX_HARTS];
+    int hart = r_mhartid();
+
+    if (hart >= MAX_HARTS)
+        return;
+
+    atomic_fetch_or(&bench_harts, 1U << hart);
+
+    unsigned gen = atomic_load_explicit(&bench_job_gen, memory_order_acquire);
+    if (gen == seen[hart])
+        return;
+    seen[hart] = gen;
+
+    if (hart < bench_job_harts) {
+        bench_job(hart);
+        atomic_fetch_add(&bench_job_done, 1);
+    }
+}
+
+// Runs job on harts 0 to nharts - 1 at once, this one included
+static void bench_on_harts(void (*job)(int hart), int nharts,
+        struct bench_sample* s) {
+    bench_job = job;
+    bench_job_harts = nharts;
+    atomic_store(&bench_job_done, 0);
+
+    bench_start(s);
+    atomic_fetch_add_explicit(&bench_job_gen, 1, memory_order_release);
+
+    job(0);
+    while (atomic_load(&bench_job_done) < nharts - 1) {
+        __asm__ volatile ("nop");
+    }
+    bench_stop(s);
+}
+
+// A small read-mostly table, like a device table, behind each of the
+// three ways of reading it
+struct bench_table {
+    struct {
+        uint64_t key;
+        uint64_t val;
+    } ent[BENCH_READ_ENTRIES];
+};
+
+static struct bench_table bench_table;
+static struct bench_table* bench_table_rcu = &bench_table;
+static spinlock bench_table_lock;
+static seqlock bench_table_seq;
+
+// Keeps the lookups from being optimized away
+static volatile uint64_t bench_read_sink[MAX_HARTS];
+
+static inline uint64_t bench_table_find(const struct bench_table* t,
+        uint64_t key) {
+    for (int i = 0; i < BENCH_READ_ENTRIES; i++) {
+        if (t->ent[i].key == key)
+            return t->ent[i].val;
+    }
+
+    return 0;
+}
+
+static void bench_read_spinlock(int hart) {
+    uint64_t sum = 0;
+
+    for (int i = 0; i < BENCH_READ_ITERS; i++) {
+        acquire(&bench_table_lock);
+        sum += bench_table_find(&bench_table, i % BENCH_READ_ENTRIES);
+        release(&bench_table_lock);
+    }
+
+    bench_read_sink[hart] = sum;
+}
+
+static void bench_read_seqlock(int hart) {
+    uint64_t sum = 0;
+
+    for (int i = 0; i < BENCH_READ_ITERS; i++) {
+        unsigned seq;
+        uint64_t val;
+
+        do {
+            seq = seqlock_read_begin(&bench_table_seq);
+            val = bench_table_find(&bench_table, i % BENCH_READ_ENTRIES);
+        } while (seqlock_read_retry(&bench_table_seq, seq));
+
+        sum += val;
+    }
+
+    bench_read_sink[hart] = sum;
+}
+
+static void bench_read_rcu(int hart) {
+    uint64_t sum = 0;
+
+    for (int i = 0; i < BENCH_READ_ITERS; i++) {
+        rcu_read_lock();
+        struct bench_table* t = rcu_dereference(bench_table_rcu);
+        sum += bench_table_find(t, i % BENCH_READ_ENTRIES);
+        rcu_read_unlock();
+
+        if (i % BENCH_READ_QS == 0)
+            rcu_quiescent();
+    }
+
+    bench_read_sink[hart] = sum;
+}
+
+static void bench_read_namei(int hart) {
+    uint64_t sum = 0;
+    uint32_t ino;
+
+    // Four components each, so a tenth of the lookups of the others
+    for (int i = 0; i < BENCH_READ_ITERS / 10; i++) {
+        if (fs_namei("/usr/lib/caseos/modules", &ino) == 0)
+            sum += ino;
+
+        if (i % BENCH_READ_QS == 0)
+            rcu_quiescent();
+    }
+
+    bench_read_sink[hart] = sum;
+}
+
+/*
+ * Path resolution out of the dcache. There's no on-disk directory format
+ * yet, so the hot path is put in the cache the way the disk lookups would.
+ * The negative case misses on disk once and is answered from memory after.
+ */
+static void bench_fs(void) {
+    static const char* const hot[] = { "usr", "lib", "caseos", "modules" };
+    struct bench_sample s;
+    uint32_t ino;
+    int failed = 0;
+
+    uint32_t dir = FS_ROOT_INO;
+    for (size_t i = 0; i < sizeof(hot) / sizeof(hot[0]); i++) {
+        dcache_add(dir, hot[i], strlen(hot[i]), dir + 1);
+        dir++;
+    }
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_NAMEI_ITERS; i++) {
+        failed += fs_namei("/usr/lib/caseos/modules", &ino) != 0;
+    }
+    bench_stop(&s);
+    bench_report("namei_hot", BENCH_NAMEI_ITERS, 0, &s);
+
+    bench_start(&s);
+    for (int i = 0; i < BENCH_NAMEI_ITERS; i++) {
+        failed += fs_namei("/usr/lib/missing", &ino) == 0;
+    }
+    bench_stop(&s);
+    bench_report("namei_negative", BENCH_NAMEI_ITERS, 0, &s);
+
+    if (failed)
+        printk("bench: %d path lookups went wrong", failed);
+
+    fs_dump_stats();
+}
+
+/*
+ * The same lookups from 1, 2, 4 and 8 harts at once, as far as there are
+ * harts. Ticks are wall time for the whole round, so flat ticks across
+ * hart counts is perfect scaling.
+ */
+static void bench_read_scaling(void) {
+    static const struct {
+        void (*job)(int hart);
+        uint64_t iters;
+        const char* names[4];
+    } cases[] = {
+        { bench_read_spinlock, BENCH_READ_ITERS, { "read_spinlock_1",
+                "read_spinlock_2", "read_spinlock_4", "read_spinlock_8" } },
+        { bench_read_seqlock, BENCH_READ_ITERS, { "read_seqlock_1",
+                "read_seqlock_2", "read_seqlock_4", "read_seqlock_8" } },
+        { bench_read_rcu, BENCH_READ_ITERS, { "read_rcu_1", "read_rcu_2",
+                "read_rcu_4", "read_rcu_8" } },
+        { bench_read_namei, BENCH_READ_ITERS / 10, { "read_namei_1",
+                "read_namei_2", "read_namei_4", "read_namei_8" } },
+    };
+    struct bench_sample s;
+
+    for (int i = 0; i < BENCH_READ_ENTRIES; i++) {
+        bench_table.ent[i].key = i;
+        bench_table.ent[i].val = i * i;
+    }
+
+    // Secondary harts may still be on their way out of boot
+    int nharts = 1;
+    while (atomic_load(&bench_harts) & 1U << nharts) {
+        nharts++;
+    }
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        for (int n = 1, k = 0; n <= nharts && k < 4; n *= 2, k++) {
+            bench_on_harts(cases[c].job, n, &s);
+            bench_report(cases[c].names[k], (uint64_t)n * cases[c].iters,
+                    0, &s);
+        }
+    }
+
+    // Grace period with every other hart idle
+    bench_start(&s);
+    for (int i = 0; i < BENCH_RCU_SYNC_ITERS; i++) {
+        synchronize_rcu();
+    }
+    bench_stop(&s);
+    bench_report("rcu_synchronize", BENCH_RCU_SYNC_ITERS, 0, &s);
+}
+
+void run_benchmarks(void) {
+    printk("bench: starting, timebase %d Hz, %s console", TIMEBASE_HZ,
+            console_name());
+    printk("bench,name,iterations,bytes,cycles,ticks");
+
+    bench_alloc();
+    bench_mem();
+    bench_lock();
+    bench_printk();
+    bench_trap();
+    bench_disk();
+    // Not there with COMPRESS, zvda has it
+    bench_disk_ring(blkdev_find("vda"), (const char* const[]){
+            "blk_ring_512", "blk_ring_4096", "blk_ring_65536" });
+    // Same path minus the device, what's left is the block layer
+    bench_disk_ring(blkdev_find("ram0"), (const char* const[]){
+            "ram_ring_512", "ram_ring_4096", "ram_ring_65536" });
+    bench_compress();
+    bench_net();
+    bench_fs();
+    bench_read_scaling();
+
+    trap_dump_stats();
+    net_dump_stats();
+
+    printk("bench: done");
+}
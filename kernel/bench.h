@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * Runs the in-kernel benchmark suite.
+ *
+ * Every result is printed as one line over the serial port:
+ *
+ *     bench,<name>,<iterations>,<bytes>,<cycles>,<ticks>
+ *
+ * Ticks come from rdtime and run at TIMEBASE_HZ, so rates can be computed
+ * offline. Lines starting with anything other than "bench," are noise.
+ */
+void run_benchmarks(void);
+
+/*
+ * Called from the idle loop of every secondary hart. Runs their share of
+ * the multi-hart benchmarks, does nothing otherwise.
+ */
+void bench_secondary(void);
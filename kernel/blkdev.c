@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Table of block devices, so users can pick one by name instead of
+// calling a driver directly.
+#include <stddef.h>
+
+#include "block.h"
+#include "lock.h"
+#include "string.h"
+
+static spinlock blkdev_lock;
+static struct blkdev* blkdevs[MAX_BLKDEVS];
+static int nblkdevs;
+
+int blkdev_register(struct blkdev* dev) {
+    int ret = -1;
+
+    acquire(&blkdev_lock);
+
+    if (nblkdevs < MAX_BLKDEVS) {
+        blkdevs[nblkdevs++] = dev;
+        ret = 0;
+    }
+
+    release(&blkdev_lock);
+
+    return ret;
+}
+
+struct blkdev* blkdev_find(const char* name) {
+    struct blkdev* found = NULL;
+
+    acquire(&blkdev_lock);
+
+    for (int i = 0; i < nblkdevs; i++) {
+        if (strcmp(blkdevs[i]->name, name) == 0) {
+            if (!blkdevs[i]->holder)
+                found = blkdevs[i];
+            break;
+        }
+    }
+
+    release(&blkdev_lock);
+
+    return found;
+}
+
+struct blkdev* blkdev_get(int i) {
+    struct blkdev* dev = NULL;
+
+    acquire(&blkdev_lock);
+
+    if (i >= 0 && i < nblkdevs && !blkdevs[i]->holder)
+        dev = blkdevs[i];
+
+    release(&blkdev_lock);
+
+    return dev;
+}
+
+int blkdev_claim(struct blkdev* dev, struct blkdev* holder) {
+    int ret = -1;
+
+    acquire(&blkdev_lock);
+
+    if (!dev->holder) {
+        dev->holder = holder;
+        ret = 0;
+    }
+
+    release(&blkdev_lock);
+
+    return ret;
+}
+
+void blkdev_unclaim(struct blkdev* dev) {
+    acquire(&blkdev_lock);
+    dev->holder = NULL;
+    release(&blkdev_lock);
+}
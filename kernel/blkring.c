@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Batched submission and completion rings for block I/O, in the spirit of
+// io_uring. Every submission becomes a struct blk_req on the device's
+// queue, and the driver's completions come back through a lock free list
+// so its lock never nests inside a ring's.
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blkring.h"
+#include "alloc.h"
+#include "panic.h"
+#include "string.h"
+
+struct blk_ring_op {
+    struct blk_req req;
+    struct blk_ring* ring;
+    uint64_t tag;
+    int result;
+    // Starts once this one succeeds
+    struct blk_ring_op* link;
+    // Free, ready or finished list
+    struct blk_ring_op* next;
+};
+
+_Static_assert(sizeof(struct blk_ring_op) * BLK_RING_MAX <= PAGE_SIZE,
+        "blk_ring ops must fit a page");
+_Static_assert((sizeof(struct blk_sqe) + 2 * sizeof(struct blk_cqe))
+        * BLK_RING_MAX <= PAGE_SIZE, "blk_ring queues must fit a page");
+
+int blk_ring_init(struct blk_ring* ring, struct blkdev* dev,
+        uint32_t entries) {
+    if (entries > BLK_RING_MAX)
+        entries = BLK_RING_MAX;
+
+    while (entries & (entries - 1))
+        entries &= entries - 1;
+
+    if (entries == 0)
+        return -1;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->dev = dev;
+    ring->entries = entries;
+
+    // Both queues share a page
+    ring->sq = kalloc_zeroed();
+    ring->cq = (struct blk_cqe*)(ring->sq + entries);
+    ring->ops = kalloc_zeroed();
+
+    for (uint32_t i = 0; i < entries; i++) {
+        ring->ops[i].ring = ring;
+        ring->ops[i].next = ring->free;
+        ring->free = &ring->ops[i];
+    }
+
+    atomic_init(&ring->finished, NULL);
+
+    return 0;
+}
+
+void blk_ring_destroy(struct blk_ring* ring) {
+    if (kfree(ring->sq) || kfree(ring->ops))
+        panicf("blk_ring: freeing a ring that was never set up");
+
+    ring->sq = NULL;
+    ring->cq = NULL;
+    ring->ops = NULL;
+}
+
+struct blk_sqe* blk_ring_get_sqe(struct blk_ring* ring) {
+    if (ring->sq_tail - ring->sq_head >= ring->entries)
+        return NULL;
+
+    struct blk_sqe* sqe = &ring->sq[ring->sq_tail & (ring->entries - 1)];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_tail++;
+
+    return sqe;
+}
+
+/*
+ * Completion path of the driver, under its lock and on whatever hart
+ * reaped the device.
+ */
+static void blk_ring_done(struct blk_req* req, int result) {
+    struct blk_ring_op* op = req->priv;
+    struct blk_ring* ring = op->ring;
+
+    op->result = result;
+
+    struct blk_ring_op* head = atomic_load(&ring->finished);
+    do {
+        op->next = head;
+    } while (!atomic_compare_exchange_weak(&ring->finished, &head, op));
+}
+
+// Everything from here on must hold ring->lock
+
+static void blk_ring_post(struct blk_ring* ring, struct blk_ring_op* op,
+        int result) {
+    struct blk_cqe* cqe = &ring->cq[ring->cq_tail & (2 * ring->entries - 1)];
+
+    cqe->tag = op->tag;
+    cqe->result = result;
+    ring->cq_tail++;
+
+    op->next = ring->free;
+    ring->free = op;
+    ring->busy--;
+}
+
+static void blk_ring_ready(struct blk_ring* ring, struct blk_ring_op* op) {
+    op->next = NULL;
+
+    if (ring->ready_tail)
+        ring->ready_tail->next = op;
+    else
+        ring->ready = op;
+
+    ring->ready_tail = op;
+}
+
+/*
+ * Posts whatever the driver finished. A finished op with something linked
+ * behind it either readies the next one or cancels the rest of the chain.
+ */
+static void blk_ring_collect(struct blk_ring* ring) {
+    struct blk_ring_op* op = atomic_exchange(&ring->finished, NULL);
+
+    while (op) {
+        struct blk_ring_op* next = op->next;
+        struct blk_ring_op* link = op->link;
+        int result = op->result;
+
+        blk_ring_post(ring, op, result);
+
+        if (link && result == BLK_OK) {
+            blk_ring_ready(ring, link);
+        } else {
+            for (; link; link = link->link) {
+                blk_ring_post(ring, link, BLK_ERR_CANCELED);
+            }
+        }
+
+        op = next;
+    }
+}
+
+/*
+ * Moves ready ops onto the device's queue until it's full, then notifies
+ * once.
+ */
+static void blk_ring_start(struct blk_ring* ring) {
+    int started = 0;
+
+    while (ring->ready) {
+        struct blk_ring_op* op = ring->ready;
+        struct blk_ring_op* next = op->next;
+
+        if (blk_add(ring->dev, &op->req))
+            break;
+
+        ring->ready = next;
+        started++;
+    }
+
+    if (!ring->ready)
+        ring->ready_tail = NULL;
+
+    if (started)
+        blk_kick(ring->dev);
+}
+
+// Entries in the chain starting at sq_head, or what's there of it so far
+static uint32_t blk_ring_chain_len(struct blk_ring* ring) {
+    uint32_t mask = ring->entries - 1;
+    uint32_t n = 0;
+
+    while (ring->sq_head + n != ring->sq_tail) {
+        struct blk_sqe* sqe = &ring->sq[(ring->sq_head + n) & mask];
+
+        n++;
+        if (!(sqe->flags & BLK_SQE_LINK))
+            break;
+    }
+
+    return n;
+}
+
+int blk_ring_submit(struct blk_ring* ring) {
+    uint32_t mask = ring->entries - 1;
+    int taken = 0;
+
+    acquire(&ring->lock);
+
+    // Room we get back now is room for this batch
+    blk_reap(ring->dev);
+    blk_ring_collect(ring);
+
+    while (ring->sq_head != ring->sq_tail) {
+        uint32_t n = blk_ring_chain_len(ring);
+
+        // Every op needs a free slot now and a completion entry later
+        uint32_t pending = ring->busy + (ring->cq_tail - ring->cq_head);
+        if (pending + n > 2 * ring->entries || ring->busy + n > ring->entries)
+            break;
+
+        struct blk_ring_op* prev = NULL;
+
+        for (uint32_t i = 0; i < n; i++) {
+            struct blk_sqe* sqe = &ring->sq[ring->sq_head & mask];
+            struct blk_ring_op* op = ring->free;
+
+            ring->free = op->next;
+            ring->busy++;
+
+            op->req = (struct blk_req){
+                .op = sqe->op,
+                .sector = sqe->sector,
+                .buf = sqe->buf,
+                .len = sqe->len,
+                .done = blk_ring_done,
+                .priv = op,
+            };
+            op->tag = sqe->tag;
+            op->link = NULL;
+
+            if (prev)
+                prev->link = op;
+            else
+                blk_ring_ready(ring, op);
+
+            prev = op;
+            ring->sq_head++;
+            taken++;
+        }
+    }
+
+    blk_ring_start(ring);
+
+    release(&ring->lock);
+
+    return taken;
+}
+
+int blk_ring_reap(struct blk_ring* ring, struct blk_cqe* out, int max) {
+    uint32_t mask = 2 * ring->entries - 1;
+    int n = 0;
+
+    acquire(&ring->lock);
+
+    blk_reap(ring->dev);
+    blk_ring_collect(ring);
+    blk_ring_start(ring);
+
+    while (n < max && ring->cq_head != ring->cq_tail) {
+        out[n++] = ring->cq[ring->cq_head & mask];
+        ring->cq_head++;
+    }
+
+    release(&ring->lock);
+
+    return n;
+}
+
+int blk_ring_wait(struct blk_ring* ring, struct blk_cqe* out, int min,
+        int max) {
+    int n = 0;
+
+    while (n < min) {
+        n += blk_ring_reap(ring, out + n, max - n);
+    }
+
+    return n;
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <stdint.h>
+
+#include "block.h"
+#include "lock.h"
+
+// Most entries a ring can have, so its op table fits in a page
+#define BLK_RING_MAX 32
+
+// The next entry waits for this one and is canceled if it fails
+#define BLK_SQE_LINK (1 << 0)
+
+/*
+ * A submission. op is one of BLK_OP_*, see struct blk_req for the rest.
+ * tag comes back in the completion untouched.
+ */
+struct blk_sqe {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t len;
+    uint64_t sector;
+    void* buf;
+    uint64_t tag;
+};
+
+struct blk_cqe {
+    uint64_t tag;
+    // BLK_OK or one of BLK_ERR_*
+    int32_t result;
+    uint32_t reserved;
+};
+
+struct blk_ring_op;
+
+/*
+ * A submission and a completion queue in front of the block driver.
+ *
+ * Producers fill entries from blk_ring_get_sqe() and hand all of them over
+ * with one blk_ring_submit(), which costs one notify however many there
+ * are. Completions come back in whatever order the device finishes them and
+ * are reaped in batches with blk_ring_reap().
+ *
+ * One producer per ring, or lock around it. Completions can be reaped
+ * from anywhere.
+ */
+struct blk_ring {
+    struct blkdev* dev;
+    uint32_t entries;
+
+    struct blk_sqe* sq;
+    uint32_t sq_head;
+    uint32_t sq_tail;
+
+    // Twice the entries, so every op in flight has room to complete
+    struct blk_cqe* cq;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+
+    // Everything below is ours
+    spinlock lock;
+    struct blk_ring_op* ops;
+    struct blk_ring_op* free;
+    // Ops waiting for room in the device's queue
+    struct blk_ring_op* ready;
+    struct blk_ring_op* ready_tail;
+    // Pushed from the driver's completion path
+    _Atomic(struct blk_ring_op*) finished;
+    uint32_t busy;
+};
+
+/*
+ * Sets up a ring in front of dev with entries submissions, rounded down to
+ * a power of two and capped at BLK_RING_MAX. Returns -1 if that leaves
+ * nothing. Needs kalloc().
+ */
+int blk_ring_init(struct blk_ring* ring, struct blkdev* dev,
+        uint32_t entries);
+
+/*
+ * Gives the ring's pages back. Nothing may be in flight.
+ */
+void blk_ring_destroy(struct blk_ring* ring);
+
+/*
+ * Next free submission entry, or NULL if the queue is full. Only becomes
+ * visible to blk_ring_submit() once filled in, it's the caller's until
+ * then.
+ */
+struct blk_sqe* blk_ring_get_sqe(struct blk_ring* ring);
+
+/*
+ * Takes every filled in entry there is room for and starts the first op
+ * of every linked chain, straight onto the device's queue. A chain ends at the
+ * first entry without BLK_SQE_LINK or at the end of the batch, and is only
+ * taken whole. Returns how many entries were taken; the rest stay queued
+ * for the next call.
+ */
+int blk_ring_submit(struct blk_ring* ring);
+
+/*
+ * Moves up to max completions into out and returns how many. Picks up
+ * whatever the device finished and starts what that unblocked first.
+ */
+int blk_ring_reap(struct blk_ring* ring, struct blk_cqe* out, int max);
+
+/*
+ * Like blk_ring_reap(), but spins until at least min are there.
+ */
+int blk_ring_wait(struct blk_ring* ring, struct blk_cqe* out, int min,
+        int max);
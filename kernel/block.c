@@ -5,239 +5,234 @@
 // A simple virtio block device driver.
 // See https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf#8f
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #include "panic.h"
 #include "print.h"
-#include "alloc.h"
-#include "string.h"
 #include "lock.h"
 
+#include "block.h"
 #include "virtio.h"
 
 spinlock diskLock;
 struct virtq* queue;
 
-void virtio_blk_write(volatile uint8_t* data, volatile uint64_t sector) {
-    acquire(&diskLock);
-
-    struct virtio_blk_req* req = (struct virtio_blk_req*)kalloc();
+static struct virtio_dev blk_dev;
 
-    // Memset_s basically casts back to a volatile type so we can ignore
-    // the compiler warning by explicitly casting to (void*)
-    req->sector = sector;
-    req->reserved = 0;
-    req->type = VIRTIO_BLK_T_OUT;
+// Set once probe_block() found a block device and got through negotiation
+static bool probed;
 
-    queue->desc[0].addr = (uintptr_t)req;
-    queue->desc[0].len = sizeof(struct virtio_blk_req);
-    queue->desc[0].flags = VIRTQ_DESC_F_NEXT;
-    queue->desc[0].next = 1;
+static const struct blkdev_ops virtio_blk_ops;
 
-    queue->desc[1].addr = (uintptr_t)data;
-    queue->desc[1].len = 512;
-    queue->desc[1].flags = VIRTQ_DESC_F_NEXT;
-    queue->desc[1].next = 2;
+struct blkdev virtio_blk = {
+    .name = "vda",
+    .ops = &virtio_blk_ops,
+};
 
-    unsigned char status = 0xff;
-    queue->desc[2].addr = (uintptr_t)&status;
-    queue->desc[2].len = sizeof(status);
-    queue->desc[2].flags = VIRTQ_DESC_F_WRITE;
-    queue->desc[2].next = 0;
+// Must hold diskLock
+static int virtio_blk_add_locked(struct blk_req* req) {
+    struct virtq_buf bufs[3];
+    int n = 0;
 
-    queue->avail->ring[queue->avail->idx % VIRTIO_BLK_QUEUE_SIZE] = 0;
-    virtio_wmb();
-    queue->avail->idx++;
+    bool sized = req->len > 0 && req->len % SECTOR_SIZE == 0;
+    bool valid = queue && (req->op == BLK_OP_FLUSH
+            || (sized && req->op <= BLK_OP_DISCARD));
 
-    virtio_wmb();
-
-    *BLOCK_REG(VIRTIO_QUEUE_NOTIFY_OFFSET) = 0;
-
-    while (status == 0xff) {
-        __asm__ volatile ("nop");
+    if (!valid) {
+        req->done(req, BLK_ERR_INVAL);
+        return 0;
     }
 
-    if (kfree(req)) {
-        panicf("Failed to free virtio req");
+    // Write through or no discard, nothing for the device to do
+    if ((req->op == BLK_OP_FLUSH
+                && !virtio_has_feature(&blk_dev, VIRTIO_BLK_F_FLUSH))
+            || (req->op == BLK_OP_DISCARD
+                && !virtio_has_feature(&blk_dev, VIRTIO_BLK_F_DISCARD))) {
+        req->done(req, BLK_OK);
+        return 0;
     }
 
-    release(&diskLock);
-}
-
-struct virtq* queue_init() {
-    volatile uint32_t num_max;
-
-    *BLOCK_REG(VIRTIO_QUEUE_SEL_OFFSET) = 0;
-
-    if (*BLOCK_REG(VIRTIO_QUEUE_READY_OFFSET) != 0) {
-        panicf("virtio: Queue not ready");
-        return NULL;
+    req->hdr.reserved = 0;
+    req->hdr.sector = 0;
+    req->status = 0xff;
+
+    bufs[n++] = (struct virtq_buf){ &req->hdr, sizeof(req->hdr), false };
+
+    switch (req->op) {
+    case BLK_OP_READ:
+        req->hdr.type = VIRTIO_BLK_T_IN;
+        req->hdr.sector = req->sector;
+        bufs[n++] = (struct virtq_buf){ req->buf, req->len, true };
+        break;
+    case BLK_OP_WRITE:
+        req->hdr.type = VIRTIO_BLK_T_OUT;
+        req->hdr.sector = req->sector;
+        bufs[n++] = (struct virtq_buf){ req->buf, req->len, false };
+        break;
+    case BLK_OP_FLUSH:
+        req->hdr.type = VIRTIO_BLK_T_FLUSH;
+        break;
+    case BLK_OP_DISCARD:
+        req->hdr.type = VIRTIO_BLK_T_DISCARD;
+        req->discard.sector = req->sector;
+        req->discard.num_sectors = req->len / SECTOR_SIZE;
+        req->discard.flags = 0;
+        bufs[n++] = (struct virtq_buf){
+            &req->discard, sizeof(req->discard), false
+        };
+        break;
     }
 
-    num_max = *BLOCK_REG(VIRTIO_QUEUE_NUM_MAX_OFFSET);
+    bufs[n++] = (struct virtq_buf){
+        (void*)&req->status, sizeof(req->status), true
+    };
 
-    if (num_max < 1) {
-        panicf("virtio: Queue num max < 1");
-        return NULL;
-    }
+    return virtq_add(queue, bufs, n, req) < 0 ? -1 : 0;
+}
 
-    printk("virtio: queue num max %d", num_max);
+static int virtio_blk_add(struct blkdev* dev, struct blk_req* req) {
+    (void)dev;
 
+    acquire(&diskLock);
+    int ret = virtio_blk_add_locked(req);
+    release(&diskLock);
 
-    // Allocate the queue
-    struct virtq * queue = (struct virtq *)kalloc();
+    return ret;
+}
 
-    // Zero it out
-    // You know what, we should probably just use memset but it does not exist
-    // yet. So I guess we will just use memset_s because im too lazy to copy it
-    // and make a normal memset. It should do the same thing though.
-    // 
-    // Bye,
-    // Joseph 2025-01-21
-    // TOOD: Replace with memset() when it exists
-    memset_s(queue, 0, sizeof(struct virtq));
+static void virtio_blk_kick(struct blkdev* dev) {
+    (void)dev;
 
-    // Allocate each ring
-    // TODO: Look at storing these directly in the struct?
-    // The issue is that virtq would be bigger and may require an extra
-    // page or two.
-    queue->desc = kalloc();
-    queue->avail = kalloc();
-    queue->used = kalloc();
-    if (!queue->desc || !queue->avail || !queue->used)
-        panicf("Failed to alloc descs");
-    
-    // should be zeroed or QEMU will have an aneurysm lol
-    // especially queue->avail.
-    memset_s(queue->desc, 0, PAGE_SIZE);
-    memset_s(queue->avail, 0, PAGE_SIZE);
-    memset_s(queue->used, 0, PAGE_SIZE);
+    if (!queue)
+        return;
 
-    *BLOCK_REG(VIRTIO_QUEUE_NUM_OFFSET) = VIRTIO_BLK_QUEUE_SIZE;
+    acquire(&diskLock);
+    virtq_kick(queue);
+    release(&diskLock);
+}
 
-    *BLOCK_REG(VIRTIO_QUEUE_DESC_LOW) = (uint64_t)queue->desc;
-    *BLOCK_REG(VIRTIO_QUEUE_DESC_HIGH) = (uint64_t)queue->desc >> 32;
+static int virtio_blk_reap(struct blkdev* dev) {
+    (void)dev;
 
-    *BLOCK_REG(VIRTIO_QUEUE_DRIVER_LOW) = (uint64_t)queue->avail;
-    *BLOCK_REG(VIRTIO_QUEUE_DRIVER_HIGH) = (uint64_t)queue->avail >> 32;
+    if (!queue)
+        return 0;
 
-    *BLOCK_REG(VIRTIO_QUEUE_DEVICE_LOW) = (uint64_t)queue->used;
-    *BLOCK_REG(VIRTIO_QUEUE_DEVICE_HIGH) = (uint64_t)queue->used >> 32;
+    int n = 0;
+    struct blk_req* req;
 
-    // Finally queue ready
-    virtio_wmb();
+    acquire(&diskLock);
 
-    *BLOCK_REG(VIRTIO_QUEUE_READY_OFFSET) = 0x01;
+    while ((req = virtq_get(queue, NULL))) {
+        req->done(req, req->status == VIRTIO_BLK_S_OK ? BLK_OK : BLK_ERR_IO);
+        n++;
+    }
 
-    return queue;
-}
+    release(&diskLock);
 
-__attribute__((warning("Bad feature negotiation. Pls fix ASAP.")))
-void negotiate_features() {
-    volatile uint32_t features;
-    features = *BLOCK_REG(VIRTIO_DEVICE_FEATURES_OFFSET);
-
-    features &= ~(1 << VIRTIO_BLK_F_RO);
-    features &= ~(1 << VIRTIO_BLK_F_SCSI);
-    features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-    features &= ~(1 << VIRTIO_BLK_F_MQ);
-    features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-    features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-    features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-
-    printk("virtio: Device Features: %d", features);
-
-    printk("virtio: Proposed Features: %d", features);
-    
-    // TODO: This is a pretty bad way to negotiate features
-    // Fix it. Exclude them like how xv6 does it.
-    // kernel/virtio_disk.c line 87-95
-    *BLOCK_REG(VIRTIO_DRIVER_FEATURES_OFFSET) = features;
+    return n;
 }
 
-void init_block() {
-    volatile uint32_t * reg;
-    reg = BLOCK_REG(VIRTIO_MAGIC_OFFSET);
+static const struct blkdev_ops virtio_blk_ops = {
+    .add = virtio_blk_add,
+    .kick = virtio_blk_kick,
+    .reap = virtio_blk_reap,
+};
+
+static void blk_sync_done(struct blk_req* req, int result) {
+    *(volatile int*)req->priv = result;
+}
 
-    if (*reg != VIRTIO_MAGIC) {
-        panicf("Magic value not found");
+void virtio_blk_write(volatile uint8_t* data, volatile uint64_t sector) {
+    if (!queue) {
+        printk("virtio: no block device, dropping write of sector %lu",
+                (uint64_t)sector);
         return;
     }
 
-    printk("virtio: Magic value found");
-
-    reg = BLOCK_REG(VIRTIO_VERSION_OFFSET);
-    
-    if (*reg != VIRTIO_VERSION) {
-        panicf("Version mismatch");
+    // Whatever sits on top decides where sectors go now, e.g. zvda
+    if (virtio_blk.holder) {
+        printk("virtio: %s belongs to %s, dropping write of sector %lu",
+                virtio_blk.name, virtio_blk.holder->name, (uint64_t)sector);
         return;
     }
 
-    printk("virtio: Version %d OK", *reg);
-
-    reg = BLOCK_REG(VIRTIO_DEVICE_ID_OFFSET);
-    
-    // Blank device id should be ignored
-    if (*reg == 0x00)
-        return;
+    // Sticks out past BLK_OK and every error until it's done
+    volatile int result = 1;
 
-    printk("virtio: Starting block init");
+    struct blk_req req = {
+        .op = BLK_OP_WRITE,
+        .sector = sector,
+        .buf = (void*)data,
+        .len = SECTOR_SIZE,
+        .done = blk_sync_done,
+        .priv = (void*)&result,
+    };
 
-    // According to docs, we must reset by sending a 0
-    // to the status register.
-    printk("virtio: Resetting device");
-    RESET_VIRTIO();
+    while (blk_add(&virtio_blk, &req)) {
+        blk_reap(&virtio_blk);
+    }
 
-    // Now we set the ACKNOWLEDGE status bit
-    printk("virtio: ACK device");
-    virtio_wmb();
-    *BLOCK_REG(VIRTIO_STATUS_OFFSET) |= VIRTIO_STATUS_ACKNOWLEDGE;
+    blk_kick(&virtio_blk);
 
-    // Check if block device
-    if (*reg != 0x02) {
-        printk("virtio: Invalid device id");
-        return;
+    // Others may have requests in flight too, reap until ours is back
+    while (result == 1) {
+        blk_reap(&virtio_blk);
     }
 
-    printk("virtio: BLK device DRIVER OK");
+    if (result != BLK_OK)
+        printk("virtio: write of sector %lu failed", (uint64_t)sector);
+}
 
-    // Set the DRIVER status bit
-    virtio_wmb();
-    *BLOCK_REG(VIRTIO_STATUS_OFFSET) |= VIRTIO_STATUS_DRIVER;
+void probe_block() {
+    if (virtio_find(VIRTIO_ID_BLOCK, &blk_dev)) {
+        printk("virtio: no block device");
+        return;
+    }
 
-    printk("virtio: Negotiating features");
+    printk("virtio: Starting block init");
 
-    // Feature negotiation
-    negotiate_features();
-    virtio_wmb();
+    // Both are optional, blk_add() does without them
+    if (virtio_setup(&blk_dev, 1ULL << VIRTIO_BLK_F_FLUSH
+                | 1ULL << VIRTIO_BLK_F_DISCARD))
+        panicf("virtio: Feature subset not supported");
 
-    *BLOCK_REG(VIRTIO_STATUS_OFFSET) |= VIRTIO_STATUS_FEATURES_OK;
+    printk("virtio: Features OK");
 
-    // Check if still OK
-    bool OK = *BLOCK_REG(VIRTIO_STATUS_OFFSET) & VIRTIO_STATUS_FEATURES_OK;
+    probed = true;
+}
 
-    if (!OK)
-        panicf("virtio: Feature subset not supported");
+void init_block() {
+    if (!probed)
+        probe_block();
 
-    printk("virtio: Features OK");
+    // No block device, nothing to bring up
+    if (!probed)
+        return;
 
     // Init the queue
-    queue = queue_init();
+    queue = virtq_create(&blk_dev, 0, VIRTIO_BLK_QUEUE_SIZE);
+
+    if (!queue)
+        panicf("virtio: no block queue");
 
     // Driver OK
     // Yay! :D
-    virtio_wmb();
-    *BLOCK_REG(VIRTIO_STATUS_OFFSET) |= VIRTIO_STATUS_DRIVER_OK;
+    virtio_driver_ok(&blk_dev);
 
     printk("virtio: Driver OK");
 
     // Now we can read the config
-    volatile struct virtio_blk_config * config = (struct virtio_blk_config *)
-        BLOCK_REG(VIRTIO_CONFIG_OFFSET);
+    volatile struct virtio_blk_config * config =
+        (volatile struct virtio_blk_config *)virtio_config(&blk_dev);
 
     uint32_t capacity = config->capacity;
 
     printk("virtio: Capacity: %d sectors", capacity);
 
+    virtio_blk.capacity = config->capacity;
+    if (blkdev_register(&virtio_blk))
+        printk("virtio: no room to register %s", virtio_blk.name);
+
 }
@@ -1,5 +1,130 @@
 #pragma once
 #include <stdint.h>
 
+#include "virtio.h"
+
+#define SECTOR_SIZE 512
+
+// Request types
+#define BLK_OP_READ 0
+#define BLK_OP_WRITE 1
+#define BLK_OP_FLUSH 2
+#define BLK_OP_DISCARD 3
+
+// Request results
+#define BLK_OK 0
+#define BLK_ERR_IO -1
+// Bad length, unknown op or no device
+#define BLK_ERR_INVAL -2
+// An op it was linked behind failed
+#define BLK_ERR_CANCELED -3
+
+/*
+ * One request to the device. Fill in the first part; the driver owns the
+ * whole thing from blk_add() until done is called. Reads and writes move
+ * len bytes, a multiple of SECTOR_SIZE, to or from one contiguous buffer.
+ * Discards drop len bytes worth of sectors, flushes ignore everything but
+ * op.
+ */
+struct blk_req {
+    int op;
+    uint64_t sector;
+    void* buf;
+    uint32_t len;
+    // Called from blk_add() or blk_reap(), possibly with the driver's lock
+    // held, so it can't call back in
+    void (*done)(struct blk_req* req, int result);
+    void* priv;
+
+    // Driver's, the device reads and writes these
+    struct virtio_blk_req hdr;
+    struct virtio_blk_discard discard;
+    volatile uint8_t status;
+};
+
+struct blkdev;
+
+/*
+ * What every block driver provides. See blk_add() and friends below for
+ * what each has to do.
+ */
+struct blkdev_ops {
+    int (*add)(struct blkdev* dev, struct blk_req* req);
+    void (*kick)(struct blkdev* dev);
+    int (*reap)(struct blkdev* dev);
+};
+
+struct blkdev {
+    const char* name;
+    const struct blkdev_ops* ops;
+    // Size in sectors
+    uint64_t capacity;
+    void* priv;
+    // Device stacked on top of this one, see blkdev_claim()
+    struct blkdev* holder;
+};
+
+// Most block devices registered at once
+#define MAX_BLKDEVS 8
+
+/*
+ * Makes a device show up in blkdev_find() and blkdev_get(). Returns -1 if
+ * the table is full.
+ */
+int blkdev_register(struct blkdev* dev);
+
+// NULL if there is no such device, or it's claimed
+struct blkdev* blkdev_find(const char* name);
+struct blkdev* blkdev_get(int i);
+
+/*
+ * Hands dev over to holder, a device stacked on top of it that lays out
+ * its sectors its own way. dev then drops out of blkdev_find() and
+ * blkdev_get(), so nobody else writes underneath holder. Returns -1 if
+ * someone already holds it. blkdev_unclaim() gives it back.
+ */
+int blkdev_claim(struct blkdev* dev, struct blkdev* holder);
+void blkdev_unclaim(struct blkdev* dev);
+
+/*
+ * Queues a request. Returns -1 if the queue is full, reap and try again.
+ * Requests that never need the device are done right here: bad ones with
+ * BLK_ERR_INVAL, flushes on a device without a write cache and discards on
+ * one that can't discard with BLK_OK. Nothing reaches the device before
+ * blk_kick(). Devices that do the work on the spot, like the ramdisk,
+ * finish everything here.
+ */
+static inline int blk_add(struct blkdev* dev, struct blk_req* req) {
+    return dev->ops->add(dev, req);
+}
+
+static inline void blk_kick(struct blkdev* dev) {
+    dev->ops->kick(dev);
+}
+
+/*
+ * Calls done for every request the device has finished. Returns how many.
+ */
+static inline int blk_reap(struct blkdev* dev) {
+    return dev->ops->reap(dev);
+}
+
+/*
+ * The virtio block device, "vda" once init_block() found one. Requests to
+ * it before then fail with BLK_ERR_INVAL.
+ */
+extern struct blkdev virtio_blk;
+
+/*
+ * Finds the virtio block device, resets it and negotiates features. Doesn't
+ * touch the heap, so it can run before or alongside memory setup.
+ */
+void probe_block();
+
+/*
+ * Sets up the queue and brings the device up. Probes first if probe_block()
+ * hasn't run yet. Needs kalloc().
+ */
 void init_block();
+
 void virtio_blk_write(volatile uint8_t* data, volatile uint64_t sector);
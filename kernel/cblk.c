@@ -0,0 +1,601 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Transparent compression on top of another block device. Requests are
+// cut into clusters and handled CBLK_BATCH clusters at a time: fetch what
+// partial writes need, (de)compress every cluster of the batch in
+// parallel, then one round of I/O to the lower device.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cblk.h"
+#include "lz.h"
+#include "panic.h"
+#include "print.h"
+#include "riscv.h"
+#include "string.h"
+#include "work.h"
+
+/*
+ * One cluster of the batch being worked on. user points at the caller's
+ * bytes for it, NULL for a discard. Whole clusters are decompressed and
+ * compressed straight from and to user, partial ones go through work.
+ */
+struct cblk_slot {
+    struct blk_req req;
+    volatile int result;
+    bool io;
+    // Needs the current contents in work first
+    bool fetch;
+    int err;
+
+    uint64_t cluster;
+    uint32_t off;
+    uint32_t len;
+    uint8_t* user;
+
+    // Where the whole cluster is read to, and what gets written out
+    uint8_t* dst;
+    const uint8_t* src;
+
+    struct cblk_map old;
+    struct cblk_map new;
+
+    uint8_t* stage;
+    uint8_t* work;
+};
+
+_Static_assert(sizeof(struct cblk_slot) * CBLK_BATCH <= PAGE_SIZE,
+        "cblk slots must fit a page");
+
+struct cblk zvda;
+
+// Compression scratch, for whichever hart ends up packing a cluster
+static struct lz_state cblk_lz[MAX_HARTS];
+
+static inline bool cblk_whole(struct cblk_slot* s) {
+    return s->off == 0 && s->len == CBLK_CLUSTER;
+}
+
+static struct cblk_map cblk_get(struct cblk* c, uint64_t cluster) {
+    struct cblk_map* page = c->map[cluster / CBLK_MAP_PER_PAGE];
+
+    if (!page)
+        return (struct cblk_map){ .kind = CBLK_ZERO };
+
+    return page[cluster % CBLK_MAP_PER_PAGE];
+}
+
+// NULL if the map page couldn't be allocated
+static struct cblk_map* cblk_entry(struct cblk* c, uint64_t cluster) {
+    struct cblk_map** page = &c->map[cluster / CBLK_MAP_PER_PAGE];
+
+    if (!*page)
+        *page = kalloc_zeroed();
+
+    if (!*page)
+        return NULL;
+
+    return &(*page)[cluster % CBLK_MAP_PER_PAGE];
+}
+
+static inline uint64_t* cblk_word(struct cblk* c, uint64_t sector) {
+    return &c->bitmap[sector / CBLK_BITS_PER_PAGE]
+        [sector % CBLK_BITS_PER_PAGE / 64];
+}
+
+static void cblk_mark(struct cblk* c, uint64_t sector, uint64_t n,
+        bool used) {
+    for (uint64_t s = sector; s < sector + n; s++) {
+        if (used)
+            *cblk_word(c, s) |= 1ULL << (s % 64);
+        else
+            *cblk_word(c, s) &= ~(1ULL << (s % 64));
+    }
+}
+
+/*
+ * First fit for n sectors in a row, starting where the last one ended.
+ * Returns the first sector, or -1 if there's no such run anywhere.
+ */
+static int64_t cblk_alloc(struct cblk* c, uint64_t n) {
+    uint64_t total = c->lower_sectors;
+    uint64_t s = c->cursor;
+    uint64_t run = 0;
+
+    for (uint64_t scanned = 0; scanned < total + n;) {
+        if (s >= total) {
+            s = 0;
+            run = 0;
+        }
+
+        uint64_t word = *cblk_word(c, s);
+
+        // Skip full words whole
+        if (run == 0 && s % 64 == 0 && word == ~0ULL) {
+            s += 64;
+            scanned += 64;
+            continue;
+        }
+
+        if (word >> (s % 64) & 1) {
+            run = 0;
+        } else if (++run == n) {
+            uint64_t first = s + 1 - n;
+
+            cblk_mark(c, first, n, true);
+            c->cursor = s + 1;
+
+            return first;
+        }
+
+        s++;
+        scanned++;
+    }
+
+    return -1;
+}
+
+static void cblk_release(struct cblk* c, struct cblk_map* e) {
+    if (e->nsect)
+        cblk_mark(c, e->sector, e->nsect, false);
+}
+
+static void cblk_io_done(struct blk_req* req, int result) {
+    struct cblk_slot* s = req->priv;
+    s->result = result;
+}
+
+/*
+ * Sends every slot's request with io set to the lower device with one
+ * kick, and waits for all of them.
+ */
+static void cblk_io(struct cblk* c, int n) {
+    struct blkdev* lower = c->lower;
+
+    for (int i = 0; i < n; i++) {
+        struct cblk_slot* s = &c->slots[i];
+
+        if (!s->io)
+            continue;
+
+        s->result = 1;
+        s->req.done = cblk_io_done;
+        s->req.priv = s;
+
+        while (blk_add(lower, &s->req)) {
+            blk_kick(lower);
+            blk_reap(lower);
+        }
+    }
+
+    blk_kick(lower);
+
+    for (int i = 0; i < n; i++) {
+        struct cblk_slot* s = &c->slots[i];
+
+        if (!s->io)
+            continue;
+
+        while (s->result == 1) {
+            blk_reap(lower);
+        }
+
+        if (s->result != BLK_OK)
+            s->err = s->result;
+        s->io = false;
+    }
+}
+
+static void cblk_lower_req(struct cblk_slot* s, int op, uint64_t sector,
+        void* buf, uint32_t nsect) {
+    s->req = (struct blk_req){
+        .op = op,
+        .sector = sector,
+        .buf = buf,
+        .len = nsect * SECTOR_SIZE,
+    };
+    s->io = true;
+}
+
+// Runs on any hart, see work_parallel()
+static void cblk_unpack(void* arg, int i) {
+    struct cblk* c = arg;
+    struct cblk_slot* s = &c->slots[i];
+
+    if (!s->fetch || s->err)
+        return;
+
+    if (s->old.kind == CBLK_ZERO)
+        memset(s->dst, 0, CBLK_CLUSTER);
+    else if (s->old.kind == CBLK_LZ
+            && lz_decompress(s->stage, s->old.len, s->dst, CBLK_CLUSTER)
+                != CBLK_CLUSTER)
+        s->err = BLK_ERR_IO;
+
+    // Partial reads only want a piece of it
+    if (!s->err && s->dst == s->work && s->user && !s->src)
+        memcpy(s->user, s->work + s->off, s->len);
+}
+
+/*
+ * Reads every slot with fetch set into its dst, decompressing on as many
+ * harts as are free.
+ */
+static void cblk_fetch(struct cblk* c, int n) {
+    for (int i = 0; i < n; i++) {
+        struct cblk_slot* s = &c->slots[i];
+
+        if (!s->fetch)
+            continue;
+
+        s->old = cblk_get(c, s->cluster);
+
+        if (s->old.kind == CBLK_RAW)
+            cblk_lower_req(s, BLK_OP_READ, s->old.sector, s->dst,
+                    s->old.nsect);
+        else if (s->old.kind == CBLK_LZ)
+            cblk_lower_req(s, BLK_OP_READ, s->old.sector, s->stage,
+                    s->old.nsect);
+
+        c->stats.bytes_read_lower += s->old.nsect * SECTOR_SIZE;
+    }
+
+    cblk_io(c, n);
+    work_parallel(cblk_unpack, c, n);
+}
+
+static int cblk_batch_err(struct cblk* c, int n) {
+    for (int i = 0; i < n; i++) {
+        if (c->slots[i].err)
+            return c->slots[i].err;
+    }
+
+    return BLK_OK;
+}
+
+static int cblk_read(struct cblk* c, int n) {
+    for (int i = 0; i < n; i++) {
+        struct cblk_slot* s = &c->slots[i];
+
+        s->fetch = true;
+        s->src = NULL;
+        s->dst = cblk_whole(s) ? s->user : s->work;
+    }
+
+    cblk_fetch(c, n);
+
+    return cblk_batch_err(c, n);
+}
+
+static bool cblk_is_zero(const uint8_t* p) {
+    const uint64_t* w = (const uint64_t*)p;
+
+    for (size_t i = 0; i < CBLK_CLUSTER / sizeof(uint64_t); i++) {
+        if (w[i])
+            return false;
+    }
+
+    return true;
+}
+
+// Runs on any hart, see work_parallel()
+static void cblk_pack(void* arg, int i) {
+    struct cblk* c = arg;
+    struct cblk_slot* s = &c->slots[i];
+
+    if (s->err)
+        return;
+
+    if (!s->src || cblk_is_zero(s->src)) {
+        s->new = (struct cblk_map){ .kind = CBLK_ZERO };
+        return;
+    }
+
+    // Has to save at least a sector to be worth it
+    int len = lz_compress(&cblk_lz[this_hart()], s->src, CBLK_CLUSTER,
+            s->stage, CBLK_CLUSTER - SECTOR_SIZE);
+
+    if (len > 0) {
+        s->new = (struct cblk_map){
+            .kind = CBLK_LZ,
+            .len = len,
+            .nsect = (len + SECTOR_SIZE - 1) / SECTOR_SIZE,
+        };
+    } else {
+        s->new = (struct cblk_map){
+            .kind = CBLK_RAW,
+            .len = CBLK_CLUSTER,
+            .nsect = CBLK_CLUSTER_SECTORS,
+        };
+    }
+}
+
+static int cblk_write(struct cblk* c, int n) {
+    int ret = BLK_OK;
+    int placed = 0;
+
+    // Partial clusters start from what's there now
+    for (int i = 0; i < n; i++) {
+        struct cblk_slot* s = &c->slots[i];
+
+        s->fetch = !cblk_whole(s);
+        s->dst = s->work;
+        s->src = cblk_whole(s) ? s->user : s->work;
+    }
+
+    cblk_fetch(c, n);
+    if ((ret = cblk_batch_err(c, n)))
+        return ret;
+
+    for (int i = 0; i < n; i++) {
+        struct cblk_slot* s = &c->slots[i];
+
+        if (!s->fetch)
+            continue;
+
+        if (s->user)
+            memcpy(s->work + s->off, s->user, s->len);
+        else
+            memset(s->work + s->off, 0, s->len);
+    }
+
+    work_parallel(cblk_pack, c, n);
+
+    // Room for everything first, so a full disk changes nothing
+    for (; placed < n; placed++) {
+        struct cblk_slot* s = &c->slots[placed];
+
+        if (!cblk_entry(c, s->cluster)) {
+            ret = BLK_ERR_IO;
+            break;
+        }
+
+        if (!s->new.nsect)
+            continue;
+
+        int64_t sector = cblk_alloc(c, s->new.nsect);
+        if (sector < 0) {
+            c->stats.nospace++;
+            ret = BLK_ERR_IO;
+            break;
+        }
+
+        s->new.sector = sector;
+        cblk_lower_req(s, BLK_OP_WRITE, sector,
+                (void*)(s->new.kind == CBLK_LZ ? s->stage : s->src),
+                s->new.nsect);
+    }
+
+    if (ret == BLK_OK) {
+        cblk_io(c, n);
+        ret = cblk_batch_err(c, n);
+    } else {
+        for (int i = 0; i < n; i++) {
+            c->slots[i].io = false;
+        }
+    }
+
+    // Whatever didn't make it gives its room back, the rest replaces the
+    // old copy
+    for (int i = 0; i < placed; i++) {
+        struct cblk_slot* s = &c->slots[i];
+
+        if (ret != BLK_OK) {
+            cblk_release(c, &s->new);
+            continue;
+        }
+
+        struct cblk_map* e = cblk_entry(c, s->cluster);
+        cblk_release(c, e);
+        *e = s->new;
+
+        c->stats.bytes_written_lower += s->new.nsect * SECTOR_SIZE;
+        if (s->new.kind == CBLK_ZERO)
+            c->stats.zero++;
+        else if (s->new.kind == CBLK_RAW)
+            c->stats.raw++;
+        else
+            c->stats.lz++;
+    }
+
+    return ret;
+}
+
+static int cblk_flush(struct cblk* c) {
+    struct cblk_slot* s = &c->slots[0];
+
+    s->err = 0;
+    s->req = (struct blk_req){ .op = BLK_OP_FLUSH };
+    s->io = true;
+    cblk_io(c, 1);
+
+    return s->err;
+}
+
+static int cblk_add(struct blkdev* dev, struct blk_req* req) {
+    struct cblk* c = dev->priv;
+    uint64_t count = req->len / SECTOR_SIZE;
+    bool sized = req->len > 0 && req->len % SECTOR_SIZE == 0;
+    bool inside = req->sector < dev->capacity
+        && count <= dev->capacity - req->sector;
+    int ret = BLK_OK;
+
+    if (req->op != BLK_OP_FLUSH
+            && (!sized || !inside || req->op > BLK_OP_DISCARD)) {
+        req->done(req, BLK_ERR_INVAL);
+        return 0;
+    }
+
+    acquire(&c->lock);
+
+    if (req->op == BLK_OP_FLUSH) {
+        ret = cblk_flush(c);
+        goto out;
+    }
+
+    uint64_t start = req->sector * SECTOR_SIZE;
+    uint64_t end = start + req->len;
+    uint64_t pos = start;
+
+    while (pos < end && ret == BLK_OK) {
+        int n = 0;
+
+        for (; n < CBLK_BATCH && pos < end; n++) {
+            struct cblk_slot* s = &c->slots[n];
+            uint32_t off = pos % CBLK_CLUSTER;
+            uint32_t len = CBLK_CLUSTER - off;
+
+            if (len > end - pos)
+                len = end - pos;
+
+            s->cluster = pos / CBLK_CLUSTER;
+            s->off = off;
+            s->len = len;
+            s->user = req->op == BLK_OP_DISCARD ? NULL
+                : (uint8_t*)req->buf + (pos - start);
+            s->err = 0;
+            s->io = false;
+
+            pos += len;
+        }
+
+        if (req->op == BLK_OP_READ)
+            ret = cblk_read(c, n);
+        else
+            ret = cblk_write(c, n);
+    }
+
+    if (ret == BLK_OK && req->op == BLK_OP_READ)
+        c->stats.bytes_read += req->len;
+    else if (ret == BLK_OK && req->op == BLK_OP_WRITE)
+        c->stats.bytes_written += req->len;
+
+out:
+    release(&c->lock);
+
+    req->done(req, ret);
+    return 0;
+}
+
+static void cblk_kick(struct blkdev* dev) {
+    (void)dev;
+}
+
+static int cblk_reap(struct blkdev* dev) {
+    (void)dev;
+    return 0;
+}
+
+static void cblk_put(void* page) {
+    if (page && kfree(page))
+        panicf("cblk: kfree of page %p failed", page);
+}
+
+static const struct blkdev_ops cblk_ops = {
+    .add = cblk_add,
+    .kick = cblk_kick,
+    .reap = cblk_reap,
+};
+
+int cblk_create(struct cblk* c, const char* name, struct blkdev* lower) {
+    if (!lower || lower->capacity < CBLK_CLUSTER_SECTORS)
+        return -1;
+
+    *c = (struct cblk){ .lower = lower };
+
+    // Anyone else writing to lower would land on top of our clusters
+    if (blkdev_claim(lower, &c->dev))
+        return -1;
+
+    c->lower_sectors = lower->capacity;
+    if (c->lower_sectors > (PAGE_SIZE / sizeof(void*)) * CBLK_BITS_PER_PAGE)
+        c->lower_sectors = (PAGE_SIZE / sizeof(void*)) * CBLK_BITS_PER_PAGE;
+
+    c->nclusters = c->lower_sectors / CBLK_CLUSTER_SECTORS;
+    if (c->nclusters > CBLK_MAX_CLUSTERS)
+        c->nclusters = CBLK_MAX_CLUSTERS;
+
+    c->map = kalloc_zeroed();
+    c->bitmap = kalloc_zeroed();
+    c->slots = kalloc_zeroed();
+    if (!c->map || !c->bitmap || !c->slots)
+        goto fail;
+
+    uint64_t npages = (c->lower_sectors + CBLK_BITS_PER_PAGE - 1)
+        / CBLK_BITS_PER_PAGE;
+    for (uint64_t i = 0; i < npages; i++) {
+        if (!(c->bitmap[i] = kalloc_zeroed()))
+            goto fail;
+    }
+
+    for (int i = 0; i < CBLK_BATCH; i++) {
+        c->slots[i].stage = kalloc();
+        c->slots[i].work = kalloc();
+        if (!c->slots[i].stage || !c->slots[i].work)
+            goto fail;
+    }
+
+    c->dev = (struct blkdev){
+        .name = name,
+        .ops = &cblk_ops,
+        .capacity = c->nclusters * CBLK_CLUSTER_SECTORS,
+        .priv = c,
+    };
+
+    if (blkdev_register(&c->dev))
+        goto fail;
+
+    return 0;
+
+fail:
+    if (c->slots) {
+        for (int i = 0; i < CBLK_BATCH; i++) {
+            cblk_put(c->slots[i].stage);
+            cblk_put(c->slots[i].work);
+        }
+    }
+    if (c->bitmap) {
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(void*); i++) {
+            cblk_put(c->bitmap[i]);
+        }
+    }
+    cblk_put(c->slots);
+    cblk_put(c->bitmap);
+    cblk_put(c->map);
+
+    blkdev_unclaim(lower);
+
+    return -1;
+}
+
+void init_cblk(void) {
+    struct blkdev* vda = blkdev_find("vda");
+
+    if (!vda) {
+        printk("cblk: no vda, no zvda");
+        return;
+    }
+
+    if (cblk_create(&zvda, "zvda", vda))
+        printk("cblk: couldn't set up zvda");
+}
+
+void cblk_get_stats(struct cblk* c, struct cblk_stats* out) {
+    acquire(&c->lock);
+    *out = c->stats;
+    release(&c->lock);
+}
+
+void cblk_dump_stats(struct cblk* c) {
+    struct cblk_stats st;
+
+    cblk_get_stats(c, &st);
+
+    printk("cblk: %s wrote %lu bytes as %lu (%lu%%), read %lu as %lu, "
+            "clusters %lu lz %lu raw %lu zero, %lu out of room", c->dev.name,
+            st.bytes_written, st.bytes_written_lower,
+            st.bytes_written ? st.bytes_written_lower * 100 / st.bytes_written
+                : 0, st.bytes_read, st.bytes_read_lower, st.lz, st.raw,
+            st.zero, st.nospace);
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <stdint.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "lock.h"
+
+// Unit of compression, in bytes and in sectors
+#define CBLK_CLUSTER PAGE_SIZE
+#define CBLK_CLUSTER_SECTORS (CBLK_CLUSTER / SECTOR_SIZE)
+
+// Clusters handled per round trip to the lower device. Bigger requests
+// are done in batches of this many.
+#define CBLK_BATCH 16
+
+// What a cluster is stored as
+#define CBLK_ZERO 0     // nothing on disk, reads as zeros
+#define CBLK_RAW 1      // didn't compress, a full cluster as is
+#define CBLK_LZ 2       // lz.h block of len bytes
+
+/*
+ * Where a cluster lives on the lower device. Compressed clusters take as
+ * few sectors as they need, anywhere there is room.
+ */
+struct cblk_map {
+    uint32_t sector;
+    uint16_t len;
+    uint8_t nsect;
+    uint8_t kind;
+};
+
+// One page of entries per map page, one page of map pages
+#define CBLK_MAP_PER_PAGE (PAGE_SIZE / sizeof(struct cblk_map))
+#define CBLK_MAX_CLUSTERS ((PAGE_SIZE / sizeof(void*)) * CBLK_MAP_PER_PAGE)
+
+// Sectors of the lower device tracked per bitmap page
+#define CBLK_BITS_PER_PAGE (PAGE_SIZE * 8)
+
+struct cblk_slot;
+
+struct cblk_stats {
+    // Bytes asked for by users, and what that cost on the lower device
+    uint64_t bytes_written;
+    uint64_t bytes_written_lower;
+    uint64_t bytes_read;
+    uint64_t bytes_read_lower;
+    // Clusters written as each kind
+    uint64_t zero;
+    uint64_t raw;
+    uint64_t lz;
+    // Writes that found no room on the lower device
+    uint64_t nospace;
+};
+
+/*
+ * A compressing block device stacked on another one. Data is compressed
+ * per cluster and only the sectors that takes are written. Clusters that
+ * don't shrink by at least a sector are written raw, and clusters of zeros
+ * aren't written at all. Every cluster of a batch is compressed or
+ * decompressed in parallel on the idle harts (see work.h).
+ *
+ * The mapping from clusters to sectors on the lower device lives in
+ * memory only, so this is scratch space that starts out empty on every
+ * boot. Requests are done inside blk_add(), one at a time.
+ *
+ * Never put one over a disk whose contents matter. Clusters go wherever
+ * there is room from sector 0 up, over whatever was there, and nothing
+ * on the disk says where they went.
+ */
+struct cblk {
+    struct blkdev dev;
+    struct blkdev* lower;
+    spinlock lock;
+
+    uint64_t nclusters;
+    // Pages of map entries, allocated on first write
+    struct cblk_map** map;
+
+    // One bit per lower sector, set when in use
+    uint64_t lower_sectors;
+    uint64_t** bitmap;
+    // Allocation carries on from here, so writes land next to each other
+    uint64_t cursor;
+
+    // CBLK_BATCH of them in a page, each with a page of compressed data
+    // and a page to put a whole cluster together in
+    struct cblk_slot* slots;
+
+    struct cblk_stats stats;
+};
+
+/*
+ * Sets up a compressing device over lower, as big as lower (up to
+ * CBLK_MAX_CLUSTERS clusters), and registers it as name. lower is claimed
+ * for good (see blkdev_claim()), so it can't be found by name anymore.
+ * Returns -1 if lower is too small or already claimed, or the block
+ * device table is full. Needs kalloc().
+ */
+int cblk_create(struct cblk* c, const char* name, struct blkdev* lower);
+
+/*
+ * Brings up "zvda" over the virtio disk, if there is one, and takes vda
+ * away from everyone else. Only called in COMPRESS=1 builds, since it
+ * wipes out whatever the disk held. Needs the heap and the block queue.
+ */
+void init_cblk(void);
+
+extern struct cblk zvda;
+
+void cblk_get_stats(struct cblk* c, struct cblk_stats* out);
+
+/*
+ * Prints the counters and how much smaller writes got, one line.
+ */
+void cblk_dump_stats(struct cblk* c);
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+
+// Core local interruptor. Owns the machine timer and software interrupts.
+// See clint@2000000 in resources/qemu.dtc
+#define CLINT_ADDR 0x2000000
+
+#define CLINT_MSIP(hart) ((volatile uint32_t *)(CLINT_ADDR + 4 * (hart)))
+#define CLINT_MTIMECMP(hart) \
+    ((volatile uint64_t *)(CLINT_ADDR + 0x4000 + 8 * (hart)))
+#define CLINT_MTIME ((volatile uint64_t *)(CLINT_ADDR + 0xbff8))
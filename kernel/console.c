@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Console backend selection. printk hands over whole lines through here.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "console.h"
+#include "uart.h"
+
+static void uart_console_write(const char* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uart_putch(buf[i]);
+    }
+}
+
+const struct console_ops uart_console = {
+    .name = "uart",
+    .write = uart_console_write,
+};
+
+static _Atomic(const struct console_ops*) console_cur = &uart_console;
+
+// Set once we panicked, nothing gets to move the console off the UART again
+static atomic_bool console_panicked;
+
+void console_set(const struct console_ops* ops) {
+    if (atomic_load(&console_panicked))
+        return;
+
+    // Nothing written to the old one may end up behind the new one
+    console_flush();
+    atomic_store(&console_cur, ops);
+}
+
+const char* console_name(void) {
+    return atomic_load(&console_cur)->name;
+}
+
+void console_write(const char* buf, size_t len) {
+    atomic_load(&console_cur)->write(buf, len);
+}
+
+void console_flush(void) {
+    const struct console_ops* ops = atomic_load(&console_cur);
+
+    if (ops->flush)
+        ops->flush();
+}
+
+void console_poll(void) {
+    const struct console_ops* ops = atomic_load(&console_cur);
+
+    if (ops->poll)
+        ops->poll();
+}
+
+char console_getch(void) {
+    const struct console_ops* ops = atomic_load(&console_cur);
+    char c = 0;
+
+    if (ops->getch)
+        c = ops->getch();
+
+    return c ? c : uart_getch();
+}
+
+void console_panic(void) {
+    atomic_store(&console_panicked, true);
+    atomic_store(&console_cur, &uart_console);
+}
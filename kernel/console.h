@@ -1,7 +1,39 @@
 #pragma once
+#include <stddef.h>
 
-#define MAX_CONSOLE_SIZE 65536
+/*
+ * Where printk output goes. Only write is required. The UART backend is
+ * used from the first instruction and comes back on panic; anything else
+ * gets installed with console_set() once it's up.
+ */
+struct console_ops {
+    const char* name;
+    void (*write)(const char* buf, size_t len);
+    // Push out everything written so far and wait for it
+    void (*flush)(void);
+    // Pick up finished writes and send whatever was held back meanwhile
+    void (*poll)(void);
+    // Next input character, or 0 if there is none
+    char (*getch)(void);
+};
 
-typedef struct {
-    char console[MAX_CONSOLE_SIZE];
-} Console;
+extern const struct console_ops uart_console;
+
+void console_set(const struct console_ops* ops);
+const char* console_name(void);
+
+void console_write(const char* buf, size_t len);
+void console_flush(void);
+void console_poll(void);
+
+/*
+ * Input from the backend, or the UART if it has none. Both are checked,
+ * QEMU's stdio mux only feeds one of them at a time.
+ */
+char console_getch(void);
+
+/*
+ * Goes back to the UART for good. Whatever the old backend still held is
+ * lost, it might be what broke.
+ */
+void console_panic(void);
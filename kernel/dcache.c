@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Directory entry cache. Names are hashed by (parent inode, name) into
+// RCU protected bucket chains, so lookups never take a lock. Adding,
+// invalidating and evicting serialize on one lock. Entries live in pages
+// carved into fixed slots, and a page goes back to the heap once all of
+// its slots are free again.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dcache.h"
+#include "alloc.h"
+#include "lock.h"
+#include "panic.h"
+#include "riscv.h"
+#include "string.h"
+
+_Static_assert(sizeof(struct dentry) == 128, "dentry should be 128 bytes");
+
+/*
+ * Start of every dcache page. Takes up the first slot, the rest are
+ * dentries.
+ */
+struct dcache_page {
+    // Pages with free slots
+    struct dcache_page* prev;
+    struct dcache_page* next;
+    // Free slots, linked through hash_next
+    struct dentry* free;
+    int nfree;
+};
+
+#define DCACHE_PER_PAGE (PAGE_SIZE / sizeof(struct dentry) - 1)
+
+_Static_assert(sizeof(struct dcache_page) <= sizeof(struct dentry),
+        "dcache_page must fit in a slot");
+
+static struct dentry* dcache_hash[DCACHE_BUCKETS];
+
+static spinlock dcache_lock;
+
+// Most recently used first. Eviction takes from the tail.
+static struct dentry* lru_head;
+static struct dentry* lru_tail;
+
+static struct dcache_page* partial;
+
+static bool dcache_shrinker_registered;
+
+static uint64_t nentries;
+static uint64_t nnegative;
+static uint64_t npages;
+static uint64_t nevictions;
+static uint64_t ninvalidations;
+
+// Lookup side counters, one line per hart so lookups share nothing
+struct dcache_hart_stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t negative_hits;
+    char pad[64 - 3 * sizeof(uint64_t)];
+};
+
+static struct dcache_hart_stats dcache_hart_stats[MAX_HARTS];
+
+// FNV-1a over the name, seeded with the parent
+static uint32_t dcache_hash_name(uint32_t parent, const char* name,
+        size_t len) {
+    uint32_t h = 2166136261u ^ parent;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static inline struct dentry** dcache_bucket(uint32_t hash) {
+    return &dcache_hash[hash & (DCACHE_BUCKETS - 1)];
+}
+
+static inline bool dentry_matches(const struct dentry* d, uint32_t parent,
+        uint32_t hash, const char* name, size_t len) {
+    return d->hash == hash && d->parent == parent && d->len == len
+            && memcmp(d->name, name, len) == 0;
+}
+
+int dcache_lookup(uint32_t parent, const char* name, size_t len,
+        uint32_t* ino) {
+    struct dcache_hart_stats* st = &dcache_hart_stats[this_hart()];
+    int ret = DCACHE_MISS;
+
+    st->lookups++;
+
+    if (len > DCACHE_NAME_MAX)
+        return DCACHE_MISS;
+
+    uint32_t hash = dcache_hash_name(parent, name, len);
+
+    rcu_read_lock();
+
+    for (struct dentry* d = rcu_dereference(*dcache_bucket(hash)); d;
+            d = rcu_dereference(d->hash_next)) {
+        if (!dentry_matches(d, parent, hash, name, len))
+            continue;
+
+        // Only written when it changes, so hot entries stay shared
+        if (!__atomic_load_n(&d->referenced, __ATOMIC_RELAXED))
+            __atomic_store_n(&d->referenced, 1, __ATOMIC_RELAXED);
+
+        uint32_t found = __atomic_load_n(&d->ino, __ATOMIC_RELAXED);
+        if (found) {
+            *ino = found;
+            st->hits++;
+            ret = DCACHE_HIT;
+        } else {
+            st->negative_hits++;
+            ret = DCACHE_NEGATIVE;
+        }
+        break;
+    }
+
+    rcu_read_unlock();
+
+    return ret;
+}
+
+static void lru_unlink(struct dentry* d) {
+    if (d->lru_prev)
+        d->lru_prev->lru_next = d->lru_next;
+    else
+        lru_head = d->lru_next;
+
+    if (d->lru_next)
+        d->lru_next->lru_prev = d->lru_prev;
+    else
+        lru_tail = d->lru_prev;
+}
+
+static void lru_push(struct dentry* d) {
+    d->lru_prev = NULL;
+    d->lru_next = lru_head;
+
+    if (lru_head)
+        lru_head->lru_prev = d;
+    else
+        lru_tail = d;
+
+    lru_head = d;
+}
+
+static void partial_unlink(struct dcache_page* pg) {
+    if (pg->prev)
+        pg->prev->next = pg->next;
+    else
+        partial = pg->next;
+
+    if (pg->next)
+        pg->next->prev = pg->prev;
+}
+
+static void partial_push(struct dcache_page* pg) {
+    pg->prev = NULL;
+    pg->next = partial;
+
+    if (partial)
+        partial->prev = pg;
+
+    partial = pg;
+}
+
+static int dcache_shrink_pressure(int nr);
+
+// Must hold dcache_lock
+static struct dentry* dentry_alloc(void) {
+    if (!dcache_shrinker_registered) {
+        if (alloc_register_shrinker(dcache_shrink_pressure))
+            panicf("dcache: no room for the shrinker");
+        dcache_shrinker_registered = true;
+    }
+
+    if (!partial) {
+        struct dcache_page* pg = kalloc();
+        if (!pg)
+            return NULL;
+
+        struct dentry* slots = (struct dentry*)pg;
+
+        pg->free = NULL;
+        for (size_t i = DCACHE_PER_PAGE; i > 0; i--) {
+            slots[i].hash_next = pg->free;
+            pg->free = &slots[i];
+        }
+        pg->nfree = DCACHE_PER_PAGE;
+
+        partial_push(pg);
+        npages++;
+    }
+
+    struct dcache_page* pg = partial;
+    struct dentry* d = pg->free;
+
+    pg->free = d->hash_next;
+    if (--pg->nfree == 0)
+        partial_unlink(pg);
+
+    return d;
+}
+
+// Runs a grace period after the entry was unhashed
+static void dentry_free_rcu(struct rcu_head* head) {
+    struct dentry* d = (struct dentry*)((char*)head
+            - offsetof(struct dentry, rcu));
+    struct dcache_page* pg = (struct dcache_page*)PAGE_ROUNDDOWN((uint64_t)d);
+    bool empty = false;
+
+    acquire(&dcache_lock);
+
+    if (pg->nfree == 0)
+        partial_push(pg);
+
+    d->hash_next = pg->free;
+    pg->free = d;
+
+    if (++pg->nfree == (int)DCACHE_PER_PAGE) {
+        partial_unlink(pg);
+        npages--;
+        empty = true;
+    }
+
+    release(&dcache_lock);
+
+    if (empty && kfree(pg))
+        panicf("dcache: kfree of page %p failed", pg);
+}
+
+/*
+ * Takes d out of the hash and the LRU and puts it on *dead, linked through
+ * lru_next. The caller hands those to dentry_release() once it dropped the
+ * lock, RCU may run the callback right away.
+ *
+ * Must hold dcache_lock
+ */
+static void dentry_kill(struct dentry* d, struct dentry** dead) {
+    struct dentry** pp = dcache_bucket(d->hash);
+
+    while (*pp != d) {
+        pp = &(*pp)->hash_next;
+    }
+
+    // Readers already on d keep going down the chain through d->hash_next
+    rcu_assign_pointer(*pp, d->hash_next);
+
+    lru_unlink(d);
+
+    nentries--;
+    if (!d->ino)
+        nnegative--;
+
+    d->lru_next = *dead;
+    *dead = d;
+}
+
+static void dentry_release(struct dentry* dead) {
+    while (dead) {
+        struct dentry* next = dead->lru_next;
+        call_rcu(&dead->rcu, dentry_free_rcu);
+        dead = next;
+    }
+}
+
+// Must hold dcache_lock
+static struct dentry* dcache_find_locked(uint32_t parent, uint32_t hash,
+        const char* name, size_t len) {
+    for (struct dentry* d = *dcache_bucket(hash); d; d = d->hash_next) {
+        if (dentry_matches(d, parent, hash, name, len))
+            return d;
+    }
+
+    return NULL;
+}
+
+// Must hold dcache_lock
+static int dcache_shrink_locked(int nr, struct dentry** dead) {
+    int n = 0;
+    // Every entry gets looked at at most twice
+    uint64_t budget = 2 * nentries;
+
+    while (n < nr && lru_tail && budget--) {
+        struct dentry* d = lru_tail;
+
+        if (d->referenced) {
+            d->referenced = 0;
+            lru_unlink(d);
+            lru_push(d);
+            continue;
+        }
+
+        dentry_kill(d, dead);
+        nevictions++;
+        n++;
+    }
+
+    return n;
+}
+
+void dcache_add(uint32_t parent, const char* name, size_t len, uint32_t ino) {
+    if (len > DCACHE_NAME_MAX)
+        return;
+
+    uint32_t hash = dcache_hash_name(parent, name, len);
+    struct dentry* dead = NULL;
+
+    acquire(&dcache_lock);
+
+    struct dentry* d = dcache_find_locked(parent, hash, name, len);
+    if (d) {
+        if (d->ino && !ino)
+            nnegative++;
+        else if (!d->ino && ino)
+            nnegative--;
+
+        __atomic_store_n(&d->ino, ino, __ATOMIC_RELAXED);
+        lru_unlink(d);
+        lru_push(d);
+
+        release(&dcache_lock);
+        return;
+    }
+
+    // Make room rather than grow when full or when the heap runs low
+    if (nentries >= DCACHE_MAX_ENTRIES || mem_free_pages() < DCACHE_LOW_PAGES)
+        dcache_shrink_locked(1, &dead);
+
+    d = dentry_alloc();
+    if (d) {
+        d->parent = parent;
+        d->ino = ino;
+        d->hash = hash;
+        d->referenced = 0;
+        d->len = len;
+        memcpy(d->name, name, len);
+        d->name[len] = '\0';
+
+        lru_push(d);
+
+        struct dentry** bucket = dcache_bucket(hash);
+        d->hash_next = *bucket;
+        // Everything above is visible before d is
+        rcu_assign_pointer(*bucket, d);
+
+        nentries++;
+        if (!ino)
+            nnegative++;
+    }
+
+    release(&dcache_lock);
+
+    dentry_release(dead);
+}
+
+// Must hold dcache_lock
+static void dcache_invalidate_locked(uint32_t parent, const char* name,
+        size_t len, struct dentry** dead) {
+    if (len > DCACHE_NAME_MAX)
+        return;
+
+    uint32_t hash = dcache_hash_name(parent, name, len);
+    struct dentry* d = dcache_find_locked(parent, hash, name, len);
+
+    if (d) {
+        dentry_kill(d, dead);
+        ninvalidations++;
+    }
+}
+
+void dcache_invalidate(uint32_t parent, const char* name, size_t len) {
+    struct dentry* dead = NULL;
+
+    acquire(&dcache_lock);
+    dcache_invalidate_locked(parent, name, len, &dead);
+    release(&dcache_lock);
+
+    dentry_release(dead);
+}
+
+void dcache_rename(uint32_t old_parent, const char* old_name, size_t old_len,
+        uint32_t new_parent, const char* new_name, size_t new_len) {
+    struct dentry* dead = NULL;
+
+    acquire(&dcache_lock);
+    dcache_invalidate_locked(old_parent, old_name, old_len, &dead);
+    dcache_invalidate_locked(new_parent, new_name, new_len, &dead);
+    release(&dcache_lock);
+
+    dentry_release(dead);
+}
+
+int dcache_shrink(int nr) {
+    struct dentry* dead = NULL;
+
+    acquire(&dcache_lock);
+    int n = dcache_shrink_locked(nr, &dead);
+    release(&dcache_lock);
+
+    dentry_release(dead);
+
+    return n;
+}
+
+/*
+ * The allocator's shrinker. It may run inside the kalloc() of a
+ * dentry_alloc() on this very hart, so it gives up rather than wait for
+ * dcache_lock. Pages come back once the grace period is over.
+ */
+static int dcache_shrink_pressure(int nr) {
+    struct dentry* dead = NULL;
+
+    if (!try_acquire(&dcache_lock))
+        return 0;
+
+    int n = dcache_shrink_locked(nr, &dead);
+    release(&dcache_lock);
+
+    dentry_release(dead);
+
+    return n;
+}
+
+void dcache_flush(void) {
+    struct dentry* dead = NULL;
+
+    acquire(&dcache_lock);
+    while (lru_tail) {
+        dentry_kill(lru_tail, &dead);
+        nevictions++;
+    }
+    release(&dcache_lock);
+
+    dentry_release(dead);
+}
+
+void dcache_get_stats(struct dcache_stats* out) {
+    *out = (struct dcache_stats){ 0 };
+
+    for (int hart = 0; hart < MAX_HARTS; hart++) {
+        out->lookups += dcache_hart_stats[hart].lookups;
+        out->hits += dcache_hart_stats[hart].hits;
+        out->negative_hits += dcache_hart_stats[hart].negative_hits;
+    }
+
+    acquire(&dcache_lock);
+    out->entries = nentries;
+    out->negative_entries = nnegative;
+    out->pages = npages;
+    out->evictions = nevictions;
+    out->invalidations = ninvalidations;
+    release(&dcache_lock);
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rcu.h"
+
+// Longest name that gets cached. Longer ones always go to the disk.
+#define DCACHE_NAME_MAX 63
+
+// Hash buckets, power of two
+#define DCACHE_BUCKETS 1024
+
+// Entries kept before the least recently used ones get evicted
+#define DCACHE_MAX_ENTRIES 4096
+
+// The cache stops growing and evicts instead once the heap has fewer free
+// pages than this
+#define DCACHE_LOW_PAGES 256
+
+// dcache_lookup() results
+#define DCACHE_MISS -1
+#define DCACHE_NEGATIVE 0
+#define DCACHE_HIT 1
+
+/*
+ * One cached name in a directory. ino 0 means the name is known not to
+ * exist. Entries are found lock free under RCU and freed a grace period
+ * after they are unhashed.
+ */
+struct dentry {
+    // Bucket chain, followed by readers
+    struct dentry* hash_next;
+    // LRU list, most recent first. Only touched under the cache lock.
+    struct dentry* lru_prev;
+    struct dentry* lru_next;
+    struct rcu_head rcu;
+
+    uint32_t parent;
+    uint32_t ino;
+    uint32_t hash;
+    // Set by lookups, cleared by eviction for a second chance
+    uint8_t referenced;
+    uint8_t len;
+    char name[DCACHE_NAME_MAX + 1];
+};
+
+struct dcache_stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t entries;
+    uint64_t negative_entries;
+    uint64_t pages;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+/*
+ * Looks up name in directory parent without taking any lock. Returns
+ * DCACHE_HIT and sets *ino, DCACHE_NEGATIVE if the name is cached as
+ * missing, or DCACHE_MISS if only the disk knows.
+ *
+ * Must run on an RCU online hart (see rcu.h).
+ */
+int dcache_lookup(uint32_t parent, const char* name, size_t len,
+        uint32_t* ino);
+
+/*
+ * Caches what the disk said about name, ino 0 for not there. Replaces
+ * whatever was cached for it. Names longer than DCACHE_NAME_MAX are not
+ * cached. Entry pages come from kalloc(), which panics rather than fail.
+ *
+ * Past DCACHE_MAX_ENTRIES, or with fewer than DCACHE_LOW_PAGES free pages,
+ * this evicts an entry for every one it adds. The first add also hooks
+ * the cache up to the allocator (see alloc_register_shrinker()), so it
+ * gets shrunk when anyone else runs the heap low too.
+ */
+void dcache_add(uint32_t parent, const char* name, size_t len, uint32_t ino);
+
+/*
+ * Forgets name, for unlink and create. Every change to a directory must
+ * go through here or dcache_rename() before it's visible on disk, or
+ * lookups keep returning the old answer.
+ */
+void dcache_invalidate(uint32_t parent, const char* name, size_t len);
+
+/*
+ * Forgets both names of a rename at once, so no lookup can find the file
+ * under both or neither.
+ */
+void dcache_rename(uint32_t old_parent, const char* old_name, size_t old_len,
+        uint32_t new_parent, const char* new_name, size_t new_len);
+
+/*
+ * Evicts up to nr of the least recently used entries. Entries used since
+ * the last pass get another chance first. Returns how many were evicted.
+ */
+int dcache_shrink(int nr);
+
+/*
+ * Evicts everything, e.g. before the filesystem goes away.
+ */
+void dcache_flush(void);
+
+void dcache_get_stats(struct dcache_stats* out);
@@ -2,6 +2,14 @@
 
 .option norvc
 
+/* Boot stack per hart, keep in sync with .stack in linker.ld */
+.equ KSTACK_SIZE, 8192
+.equ MAX_HARTS, 8
+
+/* Piece of the BSS a hart clears at a time */
+.equ BSS_CHUNK_SHIFT, 12
+.equ BSS_CHUNK, 1 << BSS_CHUNK_SHIFT
+
 .type start, @function
 .global start
 start:
@@ -14,24 +22,84 @@ start:
 	
 	/* Reset satp */
 	csrw satp, zero
+
+	/* Every hart comes through here. a1 holds the device tree. */
+	csrr a0, mhartid
+
+	/* Harts we have no stack for just sleep */
+	li t0, MAX_HARTS
+	bgeu a0, t0, park
 	
-	/* Setup stack */
-	la sp, stack_top
-	
-	/* Clear the BSS section */
+	/* Setup stack, boot_stacks + (hartid + 1) * KSTACK_SIZE */
+	la sp, boot_stacks
+	addi t0, a0, 1
+	li t1, KSTACK_SIZE
+	mul t0, t0, t1
+	add sp, sp, t0
+
+	/*
+	 * Every hart takes BSS_CHUNK sized pieces of the BSS and clears them
+	 * until there are none left, then waits for the others to finish
+	 * theirs. Nobody knows how many harts there are yet, so whoever shows
+	 * up shares the work; a lone hart 0 just does all of it.
+	 */
+	la t2, bss_next
+	la t3, bss_done
 	la t5, bss_start
 	la t6, bss_end
+	li t4, BSS_CHUNK
+	li a2, 1
+
+bss_take:
+	amoadd.d t0, t4, (t2)
+	add t0, t0, t5
+	bgeu t0, t6, bss_wait
+
+	/* The last piece stops at bss_end */
+	add t1, t0, t4
+	bleu t1, t6, bss_clear
+	mv t1, t6
 bss_clear:
-	sd zero, (t5)
-	addi t5, t5, 8
-	bltu t5, t6, bss_clear
-	
+	sd zero, (t0)
+	addi t0, t0, 8
+	bltu t0, t1, bss_clear
+
+	/* Our zeros are visible before the piece counts as done */
+	fence rw, w
+	amoadd.d zero, a2, (t3)
+	j bss_take
+
+bss_wait:
+	/* Pieces in total, (bss_end - bss_start) / BSS_CHUNK rounded up */
+	sub t1, t6, t5
+	li t0, BSS_CHUNK - 1
+	add t1, t1, t0
+	srli t1, t1, BSS_CHUNK_SHIFT
+1:
+	ld t0, (t3)
+	bltu t0, t1, 1b
+	fence r, rw
+
+enter:
 	la t0, kmain
 	csrw mepc, t0
 	
-	/* Jump to kernel! */
+	/* Jump to kernel! kmain(hartid, dtb) */
 	tail kmain
+
+park:
+	wfi
+	j park
 	
 	.cfi_endproc
 
+/* Not in .bss, since they have to be valid before the BSS is cleared */
+.section .data
+.align 3
+/* Offset of the next piece to clear, and pieces cleared so far */
+bss_next:
+	.dword 0
+bss_done:
+	.dword 0
+
 .end
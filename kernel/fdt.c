@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Flattened device tree reader.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fdt.h"
+#include "string.h"
+
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE 2
+#define FDT_PROP 3
+#define FDT_NOP 4
+#define FDT_END 9
+
+#define FDT_ALIGN(x) (((x) + 3) & ~3)
+
+struct fdt_header {
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+// Everything in the tree is big endian
+static inline uint32_t fdt32(const void* p) {
+    const uint8_t* b = p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16)
+        | ((uint32_t)b[2] << 8) | b[3];
+}
+
+#define FDT_HDR(fdt, field) \
+    fdt32(&((const struct fdt_header*)(fdt))->field)
+
+static inline const uint8_t* fdt_struct(const void* fdt) {
+    return (const uint8_t*)fdt + FDT_HDR(fdt, off_dt_struct);
+}
+
+static inline const char* fdt_string(const void* fdt, uint32_t off) {
+    return (const char*)fdt + FDT_HDR(fdt, off_dt_strings) + off;
+}
+
+bool fdt_check(const void* fdt) {
+    return fdt && FDT_HDR(fdt, magic) == FDT_MAGIC;
+}
+
+uint32_t fdt_totalsize(const void* fdt) {
+    return FDT_HDR(fdt, totalsize);
+}
+
+uint64_t fdt_read_cells(const void* p, int cells) {
+    uint64_t v = fdt32(p);
+
+    if (cells == 2)
+        v = (v << 32) | fdt32((const uint8_t*)p + 4);
+
+    return v;
+}
+
+/*
+ * Returns the tag at offset and stores where the next one starts in next.
+ */
+static uint32_t fdt_next_tag(const void* fdt, int offset, int* next) {
+    if (offset < 0 || (uint32_t)offset + 4 > FDT_HDR(fdt, size_dt_struct))
+        return FDT_END;
+
+    const uint8_t* p = fdt_struct(fdt) + offset;
+    uint32_t tag = fdt32(p);
+
+    offset += 4;
+
+    switch (tag) {
+    case FDT_BEGIN_NODE:
+        offset += strlen((const char*)p + 4) + 1;
+        break;
+    case FDT_PROP:
+        // len, nameoff, then the value
+        offset += 8 + fdt32(p + 4);
+        break;
+    default:
+        break;
+    }
+
+    *next = FDT_ALIGN(offset);
+
+    return tag;
+}
+
+/*
+ * Steps to the next node in document order. depth goes up when entering a
+ * child and down when leaving one, and we stop once it drops below zero.
+ */
+static int fdt_next_node(const void* fdt, int offset, int* depth) {
+    int next;
+
+    if (fdt_next_tag(fdt, offset, &next) != FDT_BEGIN_NODE)
+        return -1;
+
+    for (;;) {
+        offset = next;
+
+        switch (fdt_next_tag(fdt, offset, &next)) {
+        case FDT_PROP:
+        case FDT_NOP:
+            break;
+        case FDT_BEGIN_NODE:
+            (*depth)++;
+            return offset;
+        case FDT_END_NODE:
+            if (--(*depth) < 0)
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+}
+
+int fdt_first_subnode(const void* fdt, int node) {
+    int depth = 0;
+    int offset = fdt_next_node(fdt, node, &depth);
+
+    if (offset < 0 || depth != 1)
+        return -1;
+
+    return offset;
+}
+
+int fdt_next_subnode(const void* fdt, int node) {
+    int depth = 1;
+
+    // Skip over our own children
+    do {
+        node = fdt_next_node(fdt, node, &depth);
+        if (node < 0 || depth < 1)
+            return -1;
+    } while (depth > 1);
+
+    return node;
+}
+
+const char* fdt_get_name(const void* fdt, int node) {
+    return (const char*)fdt_struct(fdt) + node + 4;
+}
+
+const void* fdt_getprop(const void* fdt, int node, const char* name,
+        int* len) {
+    int offset;
+
+    if (fdt_next_tag(fdt, node, &offset) != FDT_BEGIN_NODE)
+        return NULL;
+
+    // Properties always come before subnodes
+    for (;;) {
+        int next;
+        uint32_t tag = fdt_next_tag(fdt, offset, &next);
+
+        if (tag == FDT_PROP) {
+            const uint8_t* p = fdt_struct(fdt) + offset;
+
+            if (strcmp(fdt_string(fdt, fdt32(p + 8)), name) == 0) {
+                if (len)
+                    *len = fdt32(p + 4);
+                return p + 12;
+            }
+        } else if (tag != FDT_NOP) {
+            return NULL;
+        }
+
+        offset = next;
+    }
+}
+
+/*
+ * Does a node name match a path component? "cpu" matches "cpu@0", but
+ * "cpu@0" only matches itself.
+ */
+static bool fdt_name_matches(const char* name, const char* comp, size_t len) {
+    if (strncmp(name, comp, len) != 0)
+        return false;
+
+    if (name[len] == '\0')
+        return true;
+
+    if (name[len] != '@')
+        return false;
+
+    for (size_t i = 0; i < len; i++) {
+        if (comp[i] == '@')
+            return false;
+    }
+
+    return true;
+}
+
+int fdt_path_offset(const void* fdt, const char* path) {
+    int node = 0;
+
+    // The root node is the first thing in the structure block, give or
+    // take some NOPs.
+    int next;
+    while (fdt_next_tag(fdt, node, &next) == FDT_NOP) {
+        node = next;
+    }
+
+    if (*path != '/')
+        return -1;
+
+    while (*path != '\0') {
+        while (*path == '/')
+            path++;
+
+        if (*path == '\0')
+            break;
+
+        size_t len = 0;
+        while (path[len] != '\0' && path[len] != '/')
+            len++;
+
+        int child = fdt_first_subnode(fdt, node);
+        while (child >= 0
+                && !fdt_name_matches(fdt_get_name(fdt, child), path, len)) {
+            child = fdt_next_subnode(fdt, child);
+        }
+
+        if (child < 0)
+            return -1;
+
+        node = child;
+        path += len;
+    }
+
+    return node;
+}
+
+int fdt_count_harts(const void* fdt) {
+    if (!fdt_check(fdt))
+        return 1;
+
+    int cpus = fdt_path_offset(fdt, "/cpus");
+    if (cpus < 0)
+        return 1;
+
+    int count = 0;
+
+    for (int node = fdt_first_subnode(fdt, cpus); node >= 0;
+            node = fdt_next_subnode(fdt, node)) {
+        const char* type = fdt_getprop(fdt, node, "device_type", NULL);
+        const char* status = fdt_getprop(fdt, node, "status", NULL);
+
+        if (!type || strcmp(type, "cpu") != 0)
+            continue;
+
+        if (status && strcmp(status, "okay") != 0)
+            continue;
+
+        count++;
+    }
+
+    return count > 0 ? count : 1;
+}
+
+// linux,initrd-* are one or two cells, whatever the root says
+static bool fdt_read_addr_prop(const void* fdt, int node, const char* name,
+        uint64_t* out) {
+    int len;
+    const void* val = fdt_getprop(fdt, node, name, &len);
+
+    if (!val || (len != 4 && len != 8))
+        return false;
+
+    *out = fdt_read_cells(val, len / 4);
+    return true;
+}
+
+int fdt_initrd(const void* fdt, uint64_t* start, uint64_t* end) {
+    if (!fdt_check(fdt))
+        return -1;
+
+    int chosen = fdt_path_offset(fdt, "/chosen");
+    if (chosen < 0)
+        return -1;
+
+    if (!fdt_read_addr_prop(fdt, chosen, "linux,initrd-start", start)
+            || !fdt_read_addr_prop(fdt, chosen, "linux,initrd-end", end)
+            || *end <= *start)
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Flattened device tree reader. Just enough of the libfdt API to find
+// nodes and read their properties. Node handles are offsets into the
+// structure block, negative means not found.
+//
+// See https://devicetree-specification.readthedocs.io/en/stable/flattened-format.html
+
+#define FDT_MAGIC 0xd00dfeed
+
+/*
+ * Checks the header magic. Everything else assumes this passed.
+ */
+bool fdt_check(const void* fdt);
+
+uint32_t fdt_totalsize(const void* fdt);
+
+/*
+ * Finds a node by absolute path, e.g. "/cpus" or "/soc/plic". A component
+ * without a unit address matches any unit address.
+ */
+int fdt_path_offset(const void* fdt, const char* path);
+
+int fdt_first_subnode(const void* fdt, int node);
+int fdt_next_subnode(const void* fdt, int node);
+
+/*
+ * Name of a node including its unit address, e.g. "cpu@0"
+ */
+const char* fdt_get_name(const void* fdt, int node);
+
+/*
+ * Returns a pointer to the raw, big endian value of a property and stores
+ * its length in len (if not NULL). NULL if the node doesn't have it.
+ */
+const void* fdt_getprop(const void* fdt, int node, const char* name,
+        int* len);
+
+/*
+ * Reads a big endian value made of `cells` 32 bit cells (1 or 2).
+ */
+uint64_t fdt_read_cells(const void* p, int cells);
+
+/*
+ * Counts the enabled cpu nodes under /cpus. Returns 1 when the tree is
+ * missing or has no cpus, since we are evidently running on one.
+ */
+int fdt_count_harts(const void* fdt);
+
+/*
+ * Where the bootloader put the initrd, from /chosen. Returns -1 if there
+ * is none.
+ */
+int fdt_initrd(const void* fdt, uint64_t* start, uint64_t* end);
@@ -1,5 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Filesystem path lookup. Every component goes through the dcache first,
+// the disk only sees names the cache has never heard of.
+#include <stddef.h>
+#include <stdint.h>
 
+#include "fs.h"
+#include "dcache.h"
+#include "print.h"
+#include "riscv.h"
+
+// One line per hart, lookups run on all of them at once
+struct fs_hart_stats {
+    struct fs_stats st;
+    char pad[64 - sizeof(struct fs_stats) % 64];
+};
+
+static struct fs_hart_stats fs_hart_stats[MAX_HARTS];
 
 void fsinit(void) {
 
 }
+
+/*
+ * Looks name up in dir's directory blocks. There is no on-disk directory
+ * format yet, so nothing is ever found. Returns the inode or 0.
+ */
+static uint32_t fs_dir_lookup_disk(uint32_t dir, const char* name,
+        size_t len) {
+    (void)dir;
+    (void)name;
+    (void)len;
+
+    return 0;
+}
+
+int fs_lookup(uint32_t dir, const char* name, size_t len, uint32_t* ino) {
+    struct fs_stats* st = &fs_hart_stats[this_hart()].st;
+    uint64_t start = rdtime();
+    // Left alone by a negative hit, which must come out as not found
+    uint32_t found = 0;
+
+    st->lookups++;
+
+    int ret = dcache_lookup(dir, name, len, &found);
+    if (ret != DCACHE_MISS) {
+        st->cached++;
+        st->cached_ticks += rdtime() - start;
+    } else {
+        found = fs_dir_lookup_disk(dir, name, len);
+        dcache_add(dir, name, len, found);
+
+        st->disk++;
+        st->disk_ticks += rdtime() - start;
+    }
+
+    if (!found)
+        return -1;
+
+    *ino = found;
+    return 0;
+}
+
+int fs_namei(const char* path, uint32_t* ino) {
+    uint32_t cur = FS_ROOT_INO;
+
+    while (*path) {
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+
+        size_t len = 0;
+        while (path[len] && path[len] != '/') {
+            len++;
+        }
+
+        if (len > FS_NAME_MAX || fs_lookup(cur, path, len, &cur))
+            return -1;
+
+        path += len;
+    }
+
+    *ino = cur;
+    return 0;
+}
+
+void fs_get_stats(struct fs_stats* out) {
+    *out = (struct fs_stats){ 0 };
+
+    for (int hart = 0; hart < MAX_HARTS; hart++) {
+        struct fs_stats* st = &fs_hart_stats[hart].st;
+
+        out->lookups += st->lookups;
+        out->cached += st->cached;
+        out->cached_ticks += st->cached_ticks;
+        out->disk += st->disk;
+        out->disk_ticks += st->disk_ticks;
+    }
+}
+
+void fs_dump_stats(void) {
+    struct dcache_stats dc;
+    struct fs_stats fs;
+
+    dcache_get_stats(&dc);
+    fs_get_stats(&fs);
+
+    printk("dcache: %lu entries, %lu negative, %lu pages, %lu evicted, "
+            "%lu invalidated", dc.entries, dc.negative_entries, dc.pages,
+            dc.evictions, dc.invalidations);
+
+    if (dc.lookups) {
+        printk("dcache: %lu lookups, %lu%% hit, %lu%% negative hit",
+                dc.lookups, dc.hits * 100 / dc.lookups,
+                dc.negative_hits * 100 / dc.lookups);
+    }
+
+    printk("fs: %lu lookups, %lu from the dcache at %lu ticks, %lu from disk "
+            "at %lu ticks", fs.lookups,
+            fs.cached, fs.cached ? fs.cached_ticks / fs.cached : 0,
+            fs.disk, fs.disk ? fs.disk_ticks / fs.disk : 0);
+}
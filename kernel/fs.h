@@ -1,6 +1,45 @@
-// 
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
 
 #define FS_MAGIC_NUMBER 0x69420 // nice
 
+// Inode every absolute path starts from
+#define FS_ROOT_INO 1
+
+// Longest path component
+#define FS_NAME_MAX 255
+
+struct fs_stats {
+    uint64_t lookups;
+    // Answered by the dcache, and how long those took in total
+    uint64_t cached;
+    uint64_t cached_ticks;
+    // Went to the disk
+    uint64_t disk;
+    uint64_t disk_ticks;
+};
 
 void fsinit(void);
+
+/*
+ * Finds name in directory dir. Returns 0 and sets *ino if it's there, -1
+ * if not. Answers from the dcache when it can and caches what the disk
+ * said when it can't.
+ */
+int fs_lookup(uint32_t dir, const char* name, size_t len, uint32_t* ino);
+
+/*
+ * Resolves a path one component at a time, starting at the root. Empty
+ * components are skipped, so "//a/b/" is "/a/b". Returns 0 and sets *ino,
+ * or -1 if some component doesn't exist.
+ */
+int fs_namei(const char* path, uint32_t* ino);
+
+void fs_get_stats(struct fs_stats* out);
+
+/*
+ * Prints the dcache and lookup counters, with the hit rate and the
+ * average lookup latency in ticks.
+ */
+void fs_dump_stats(void);
@@ -0,0 +1,327 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Host microbenchmarks for the portable kernel modules.
+// Build and run with `make host-bench`. Output uses the same columns as the
+// in-kernel suite, except ticks are nanoseconds.
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "host.h"
+#include "../alloc.h"
+#include "../blkring.h"
+#include "../lock.h"
+#include "../lz.h"
+#include "../panic.h"
+#include "../print.h"
+#include "../ramdisk.h"
+#include "../string.h"
+
+#define BENCH_PAGES 16384
+#define BENCH_ROUNDS 16
+#define BENCH_MEM_TOTAL (256 * 1024 * 1024)
+#define BENCH_LOCK_ITERS 10000000
+#define BENCH_PRINTK_ITERS 200000
+#define BENCH_LOCK_THREADS 4
+#define BENCH_RAM_OPS 200000
+#define BENCH_LZ_ROUNDS 4096
+
+static void* pages[BENCH_PAGES];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char* name, uint64_t iters, uint64_t bytes,
+        uint64_t ns) {
+    printf("bench,%s,%lu,%lu,0,%lu\n", name, (unsigned long)iters,
+            (unsigned long)bytes, (unsigned long)ns);
+}
+
+static void bench_alloc(void) {
+    uint64_t alloc_ns = 0;
+    uint64_t free_ns = 0;
+    uint64_t free_s_ns = 0;
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        uint64_t t = now_ns();
+        for (int i = 0; i < BENCH_PAGES; i++) {
+            pages[i] = kalloc();
+        }
+        alloc_ns += now_ns() - t;
+
+        t = now_ns();
+        for (int i = 0; i < BENCH_PAGES; i++) {
+            if (r % 2 ? kfree_s(pages[i]) : kfree(pages[i]))
+                panicf("kfree failed");
+        }
+        if (r % 2)
+            free_s_ns += now_ns() - t;
+        else
+            free_ns += now_ns() - t;
+    }
+
+    uint64_t n = (uint64_t)BENCH_PAGES * BENCH_ROUNDS;
+    report("kalloc", n, 0, alloc_ns);
+    report("kfree", n / 2, 0, free_ns);
+    report("kfree_s", n / 2, n / 2 * PAGE_SIZE, free_s_ns);
+}
+
+static void bench_zeroed(void) {
+    uint64_t zeroed = 0;
+    int n;
+
+    // Empties the scrub list bench_alloc left behind
+    uint64_t t = now_ns();
+    while ((n = alloc_zero_work(64)) > 0) {
+        zeroed += n;
+    }
+    report("zero_work", zeroed, zeroed * PAGE_SIZE, now_ns() - t);
+
+    // Served from the pool, then with the pool gone, zeroed inline
+    const char* names[] = { "kalloc_zeroed", "kalloc_zeroed_inline" };
+
+    for (int r = 0; r < 2; r++) {
+        t = now_ns();
+        for (int i = 0; i < BENCH_PAGES; i++) {
+            pages[i] = kalloc_zeroed();
+        }
+        report(names[r], BENCH_PAGES, 0, now_ns() - t);
+
+        for (int i = 0; i < BENCH_PAGES; i++) {
+            if (kfree(pages[i]))
+                panicf("kfree failed");
+        }
+    }
+}
+
+static void bench_mem(void) {
+    static const struct {
+        size_t size;
+        const char* set_name;
+        const char* cpy_name;
+    } cases[] = {
+        { 64, "memset_64", "memcpy_64" },
+        { 512, "memset_512", "memcpy_512" },
+        { PAGE_SIZE, "memset_4096", "memcpy_4096" },
+    };
+
+    unsigned char* src = kalloc();
+    unsigned char* dst = kalloc();
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t size = cases[i].size;
+        uint64_t iters = BENCH_MEM_TOTAL / size;
+
+        uint64_t t = now_ns();
+        for (uint64_t j = 0; j < iters; j++) {
+            memset(dst, (int)j, size);
+            __asm__ volatile("" : : "r"(dst) : "memory");
+        }
+        report(cases[i].set_name, iters, iters * size, now_ns() - t);
+
+        t = now_ns();
+        for (uint64_t j = 0; j < iters; j++) {
+            memcpy(dst, src, size);
+            __asm__ volatile("" : : "r"(dst) : "memory");
+        }
+        report(cases[i].cpy_name, iters, iters * size, now_ns() - t);
+    }
+
+    uint64_t t = now_ns();
+    for (uint64_t j = 0; j < BENCH_MEM_TOTAL / PAGE_SIZE; j++) {
+        memset_s(dst, 0, PAGE_SIZE);
+    }
+    report("memset_s_4096", BENCH_MEM_TOTAL / PAGE_SIZE, BENCH_MEM_TOTAL,
+            now_ns() - t);
+
+    if (kfree(src) || kfree(dst))
+        panicf("kfree failed");
+}
+
+static void bench_printk(void) {
+    host_uart_echo = 0;
+
+    uint64_t t = now_ns();
+    for (int i = 0; i < BENCH_PRINTK_ITERS; i++) {
+        printk("bench-printk %d %p %s", i, (void*)pages, "filler");
+    }
+    report("printk", BENCH_PRINTK_ITERS, 0, now_ns() - t);
+}
+
+static spinlock lock;
+
+static void* lock_worker(void* arg) {
+    uint64_t iters = *(uint64_t*)arg;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        acquire(&lock);
+        release(&lock);
+    }
+
+    return NULL;
+}
+
+static void bench_lock(void) {
+    uint64_t iters = BENCH_LOCK_ITERS;
+
+    uint64_t t = now_ns();
+    lock_worker(&iters);
+    report("spinlock", iters, 0, now_ns() - t);
+
+    pthread_t threads[BENCH_LOCK_THREADS];
+    iters = BENCH_LOCK_ITERS / BENCH_LOCK_THREADS;
+
+    t = now_ns();
+    for (int i = 0; i < BENCH_LOCK_THREADS; i++) {
+        pthread_create(&threads[i], NULL, lock_worker, &iters);
+    }
+    for (int i = 0; i < BENCH_LOCK_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report("spinlock_contended", iters * BENCH_LOCK_THREADS, 0,
+            now_ns() - t);
+}
+
+static seqlock seq;
+static volatile uint64_t seq_data[4];
+
+static void* seqlock_worker(void* arg) {
+    uint64_t iters = *(uint64_t*)arg;
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        unsigned s;
+        uint64_t v;
+
+        do {
+            s = seqlock_read_begin(&seq);
+            v = seq_data[i % 4];
+        } while (seqlock_read_retry(&seq, s));
+
+        sum += v;
+    }
+
+    return (void*)(uintptr_t)sum;
+}
+
+/*
+ * Readers only, same total work as spinlock_contended. Nothing is written
+ * to shared memory, so this should scale with the thread count.
+ */
+static void bench_seqlock(void) {
+    pthread_t threads[BENCH_LOCK_THREADS];
+    uint64_t iters = BENCH_LOCK_ITERS / BENCH_LOCK_THREADS;
+
+    uint64_t t = now_ns();
+    for (int i = 0; i < BENCH_LOCK_THREADS; i++) {
+        pthread_create(&threads[i], NULL, seqlock_worker, &iters);
+    }
+    for (int i = 0; i < BENCH_LOCK_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report("seqlock_read_contended", iters * BENCH_LOCK_THREADS, 0,
+            now_ns() - t);
+}
+
+/*
+ * 4 KiB writes through a blk_ring onto the scratch ramdisk, so all that's
+ * measured is the block layer and a memcpy.
+ */
+static void bench_ramdisk(void) {
+    static uint8_t buf[PAGE_SIZE];
+    static struct blk_ring ring;
+    struct blk_cqe cqes[2 * BLK_RING_MAX];
+
+    init_ramdisk(NULL);
+    struct blkdev* dev = blkdev_find("ram0");
+    uint64_t slots = dev->capacity / (PAGE_SIZE / SECTOR_SIZE);
+
+    if (blk_ring_init(&ring, dev, BLK_RING_MAX))
+        panicf("no blk_ring");
+
+    uint64_t queued = 0, done = 0;
+    uint64_t t = now_ns();
+
+    while (done < BENCH_RAM_OPS) {
+        struct blk_sqe* sqe;
+
+        while (queued < BENCH_RAM_OPS && (sqe = blk_ring_get_sqe(&ring))) {
+            *sqe = (struct blk_sqe){
+                .op = BLK_OP_WRITE,
+                .sector = queued % slots * (PAGE_SIZE / SECTOR_SIZE),
+                .buf = buf,
+                .len = PAGE_SIZE,
+                .tag = queued,
+            };
+            queued++;
+        }
+
+        blk_ring_submit(&ring);
+        done += blk_ring_wait(&ring, cqes, 1, 2 * BLK_RING_MAX);
+    }
+
+    report("ram_ring_4096", BENCH_RAM_OPS, (uint64_t)BENCH_RAM_OPS * PAGE_SIZE,
+            now_ns() - t);
+
+    blk_ring_destroy(&ring);
+}
+
+/*
+ * One cluster's worth of log-like text through the codec, the work the
+ * compressing block layer does per 4 KiB.
+ */
+static void bench_lz(void) {
+    static struct lz_state st;
+    static uint8_t src[PAGE_SIZE], out[PAGE_SIZE], back[PAGE_SIZE];
+    size_t n = 0;
+    int len = 0;
+
+    for (unsigned i = 0; n < sizeof(src); i++) {
+        char line[64];
+        int l = snprintf(line, sizeof(line), "hart %u: request %u done\n",
+                i % 4, i);
+
+        for (int j = 0; j < l && n < sizeof(src); j++) {
+            src[n++] = line[j];
+        }
+    }
+
+    uint64_t t = now_ns();
+    for (int i = 0; i < BENCH_LZ_ROUNDS; i++) {
+        len = lz_compress(&st, src, sizeof(src), out, sizeof(out));
+    }
+    report("lz_compress_4096", BENCH_LZ_ROUNDS,
+            (uint64_t)BENCH_LZ_ROUNDS * PAGE_SIZE, now_ns() - t);
+
+    if (len < 0)
+        panicf("lz_compress failed");
+
+    t = now_ns();
+    for (int i = 0; i < BENCH_LZ_ROUNDS; i++) {
+        if (lz_decompress(out, len, back, sizeof(back)) != PAGE_SIZE)
+            panicf("lz_decompress failed");
+    }
+    report("lz_decompress_4096", BENCH_LZ_ROUNDS,
+            (uint64_t)BENCH_LZ_ROUNDS * PAGE_SIZE, now_ns() - t);
+}
+
+int main(void) {
+    host_init_memory();
+
+    printf("bench,name,iterations,bytes,cycles,ns\n");
+
+    bench_alloc();
+    bench_zeroed();
+    bench_mem();
+    bench_printk();
+    bench_lock();
+    bench_seqlock();
+    bench_ramdisk();
+    bench_lz();
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+
+// Hooks into the stubs that stand in for hardware in the host build.
+
+// Size of the static arena standing in for RAM
+#define HOST_HEAP_PAGES 32768
+#define HOST_HEAP_SIZE (HOST_HEAP_PAGES * 4096UL)
+
+extern char host_heap[];
+
+// Hands the whole arena to the allocator, with no device tree
+void host_init_memory(void);
+
+// Captured uart output. Always NUL terminated.
+extern char host_uart_buf[];
+extern size_t host_uart_len;
+
+// When set, uart output also goes to stdout
+extern int host_uart_echo;
+
+void host_uart_reset(void);
+
+// Pretend block device. Requests sit in the queue until a blk_reap()
+// after the blk_kick() that published them, then complete newest first.
+// Reads and writes go to host_disk.
+#define HOST_DISK_SECTORS 256
+
+struct blkdev;
+extern struct blkdev host_blkdev;
+
+extern unsigned char host_disk[];
+// Most requests the queue holds, at most HOST_BLK_QUEUE_MAX
+#define HOST_BLK_QUEUE_MAX 64
+extern int host_blk_depth;
+// Requests touching this sector fail with BLK_ERR_IO, -1 for none
+extern int64_t host_blk_fail_sector;
+extern int host_blk_kicks;
+extern int host_blk_queued;
+
+// When non-NULL, panicf longjmps here instead of aborting
+extern jmp_buf* host_panic_jmp;
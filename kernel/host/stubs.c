@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Stand-ins for the hardware the portable kernel modules touch, so they can
+// be built and run as a normal host program.
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+#include "../alloc.h"
+#include "../block.h"
+#include "../riscv.h"
+#include "../uart.h"
+
+#define HOST_UART_SIZE 8192
+
+// Stands in for RAM. The host build compiles with -D_end=host_heap, so the
+// "kernel image" ends right where the arena starts.
+_Alignas(PAGE_SIZE) char host_heap[HOST_HEAP_SIZE];
+
+char host_uart_buf[HOST_UART_SIZE];
+size_t host_uart_len;
+int host_uart_echo;
+
+jmp_buf* host_panic_jmp;
+
+void host_init_memory(void) {
+    mem_add_region((uint64_t)host_heap, HOST_HEAP_SIZE);
+    init_memory_layout();
+    init_memory_slice(0, 1);
+}
+
+uint64_t rdtime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * TIMEBASE_HZ
+        + (uint64_t)ts.tv_nsec / (1000000000 / TIMEBASE_HZ);
+}
+
+void host_uart_reset(void) {
+    host_uart_len = 0;
+    host_uart_buf[0] = '\0';
+}
+
+void uart_putch(char c) {
+    if (host_uart_echo)
+        putchar(c);
+
+    // Keep the tail if a test prints more than the sink holds
+    if (host_uart_len + 1 >= HOST_UART_SIZE)
+        host_uart_len = 0;
+
+    host_uart_buf[host_uart_len++] = c;
+    host_uart_buf[host_uart_len] = '\0';
+}
+
+void uart_print(const char* str) {
+    while (*str != '\0') {
+        uart_putch(*str);
+        str++;
+    }
+}
+
+char uart_getch(void) {
+    return 0;
+}
+
+unsigned char host_disk[HOST_DISK_SECTORS * SECTOR_SIZE];
+int host_blk_depth = HOST_BLK_QUEUE_MAX;
+int64_t host_blk_fail_sector = -1;
+int host_blk_kicks;
+int host_blk_queued;
+
+static struct blk_req* host_blk_queue[HOST_BLK_QUEUE_MAX];
+// Requests published by the last kick
+static int host_blk_kicked;
+
+static int host_blk_add(struct blkdev* dev, struct blk_req* req) {
+    (void)dev;
+
+    bool sized = req->len > 0 && req->len % SECTOR_SIZE == 0;
+    uint64_t end = req->sector + req->len / SECTOR_SIZE;
+
+    if (req->op != BLK_OP_FLUSH
+            && (!sized || req->op > BLK_OP_DISCARD || end > HOST_DISK_SECTORS)) {
+        req->done(req, BLK_ERR_INVAL);
+        return 0;
+    }
+
+    if (host_blk_queued >= host_blk_depth)
+        return -1;
+
+    host_blk_queue[host_blk_queued++] = req;
+    return 0;
+}
+
+static void host_blk_kick(struct blkdev* dev) {
+    (void)dev;
+
+    host_blk_kicks++;
+    host_blk_kicked = host_blk_queued;
+}
+
+static int host_blk_reap(struct blkdev* dev) {
+    (void)dev;
+
+    int n = host_blk_kicked;
+
+    for (int i = n - 1; i >= 0; i--) {
+        struct blk_req* req = host_blk_queue[i];
+        unsigned char* disk = host_disk + req->sector * SECTOR_SIZE;
+        int64_t first = req->sector;
+        int64_t last = first + req->len / SECTOR_SIZE;
+        int result = BLK_OK;
+
+        if (req->op != BLK_OP_FLUSH && host_blk_fail_sector >= first
+                && host_blk_fail_sector < last)
+            result = BLK_ERR_IO;
+        else if (req->op == BLK_OP_READ)
+            memcpy(req->buf, disk, req->len);
+        else if (req->op == BLK_OP_WRITE)
+            memcpy(disk, req->buf, req->len);
+        else if (req->op == BLK_OP_DISCARD)
+            memset(disk, 0, req->len);
+
+        req->done(req, result);
+    }
+
+    // Whatever was added after the kick stays queued
+    memmove(host_blk_queue, host_blk_queue + n,
+            (host_blk_queued - n) * sizeof(host_blk_queue[0]));
+    host_blk_queued -= n;
+    host_blk_kicked = 0;
+
+    return n;
+}
+
+static const struct blkdev_ops host_blk_ops = {
+    .add = host_blk_add,
+    .kick = host_blk_kick,
+    .reap = host_blk_reap,
+};
+
+struct blkdev host_blkdev = {
+    .name = "host",
+    .ops = &host_blk_ops,
+    .capacity = HOST_DISK_SECTORS,
+};
+
+void panicf(const char* format, ...) {
+    if (host_panic_jmp)
+        longjmp(*host_panic_jmp, 1);
+
+    va_list vargs;
+    va_start(vargs, format);
+    fputs("Panic: ", stderr);
+    vfprintf(stderr, format, vargs);
+    fputc('\n', stderr);
+    va_end(vargs);
+
+    abort();
+}
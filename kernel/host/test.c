@@ -0,0 +1,1368 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Unit tests for the portable kernel modules, run on the host.
+// Build and run with `make host-test`.
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "../alloc.h"
+#include "../blkring.h"
+#include "../cblk.h"
+#include "../console.h"
+#include "../dcache.h"
+#include "../fdt.h"
+#include "../fs.h"
+#include "../lock.h"
+#include "../lz.h"
+#include "../print.h"
+#include "../ramdisk.h"
+#include "../rcu.h"
+#include "../string.h"
+#include "../virtio.h"
+#include "../work.h"
+
+#define LOCK_THREADS 8
+#define HEAP_SLICES 4
+
+// First of four pages the test device tree marks as reserved
+#define HOST_RESERVED_PAGE 100
+#define LOCK_ITERS 200000
+#define SEQLOCK_WRITES 200000
+
+static int failures;
+static int checks;
+
+#define CHECK(cond) do { \
+        checks++; \
+        if (!(cond)) { \
+            failures++; \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                    #cond); \
+        } \
+    } while (0)
+
+#define CHECK_PRINTK(expected, ...) do { \
+        host_uart_reset(); \
+        printk(__VA_ARGS__); \
+        checks++; \
+        if (strcmp(host_uart_buf, expected "\n") != 0) { \
+            failures++; \
+            fprintf(stderr, "%s:%d: printk(%s) gave \"%s\"\n", __FILE__, \
+                    __LINE__, #__VA_ARGS__, host_uart_buf); \
+        } \
+    } while (0)
+
+// Minimal device tree builder, so the reader can be tested without dtc
+struct fdt_builder {
+    uint32_t buf[1024];
+    size_t words;
+    char strings[512];
+    size_t strings_len;
+};
+
+static void fdt_put(struct fdt_builder* b, uint32_t v) {
+    b->buf[b->words++] = __builtin_bswap32(v);
+}
+
+static void fdt_put_bytes(struct fdt_builder* b, const void* data, size_t len) {
+    memcpy(&b->buf[b->words], data, len);
+    memset((char*)&b->buf[b->words] + len, 0, (4 - len % 4) % 4);
+    b->words += (len + 3) / 4;
+}
+
+static void fdt_begin(struct fdt_builder* b, const char* name) {
+    fdt_put(b, 1);
+    fdt_put_bytes(b, name, strlen(name) + 1);
+}
+
+static void fdt_end(struct fdt_builder* b) {
+    fdt_put(b, 2);
+}
+
+static void fdt_prop(struct fdt_builder* b, const char* name, const void* val,
+        size_t len) {
+    size_t off = b->strings_len;
+    memcpy(b->strings + off, name, strlen(name) + 1);
+    b->strings_len += strlen(name) + 1;
+
+    fdt_put(b, 3);
+    fdt_put(b, len);
+    fdt_put(b, off);
+    fdt_put_bytes(b, val, len);
+}
+
+static void fdt_prop_str(struct fdt_builder* b, const char* name,
+        const char* val) {
+    fdt_prop(b, name, val, strlen(val) + 1);
+}
+
+/*
+ * Lays the blob out as header, empty reservation map, structure block and
+ * strings block in out.
+ */
+static void fdt_finish(struct fdt_builder* b, uint32_t* out) {
+    fdt_put(b, 9);
+
+    uint32_t off_rsv = 40;
+    uint32_t off_struct = off_rsv + 16;
+    uint32_t off_strings = off_struct + b->words * 4;
+    uint32_t total = off_strings + b->strings_len;
+    uint32_t header[10] = {
+        FDT_MAGIC, total, off_struct, off_strings, off_rsv, 17, 16, 0,
+        b->strings_len, b->words * 4,
+    };
+
+    memset(out, 0, total);
+    for (int i = 0; i < 10; i++) {
+        out[i] = __builtin_bswap32(header[i]);
+    }
+    memcpy((char*)out + off_struct, b->buf, b->words * 4);
+    memcpy((char*)out + off_strings, b->strings, b->strings_len);
+}
+
+int print_numeric(uint64_t val, char* res, int n);
+int print_hex(uint64_t val, char* res, int n);
+
+static void test_alloc(void) {
+    void* a = kalloc();
+    void* b = kalloc();
+
+    CHECK(a != NULL && b != NULL && a != b);
+    CHECK((uint64_t)a % PAGE_SIZE == 0);
+    CHECK(page_meta(a) != NULL && !(page_meta(a)->flags & PG_FREE));
+
+    // Freed pages are reused first
+    CHECK(kfree(b) == 0);
+    CHECK(kalloc() == b);
+
+    // Bad pointers are rejected without touching the free list
+    CHECK(kfree((char*)a + 1) == -1);
+    CHECK(kfree((void*)((uintptr_t)host_heap - PAGE_SIZE)) == -1);
+    CHECK(kfree((void*)((uintptr_t)host_heap + HOST_HEAP_SIZE)) == -1);
+    CHECK(kfree(host_heap + HOST_RESERVED_PAGE * PAGE_SIZE) == -1);
+    CHECK(kfree_s((char*)a + 8) == -1);
+
+    // kfree_s leaves the zeroing to the background worker
+    memset(a, 0xab, PAGE_SIZE);
+    CHECK(kfree_s(a) == 0);
+    while (alloc_zero_work(64) > 0) {
+    }
+    CHECK(alloc_zero_work(64) == 0);
+    int dirty = 0;
+    for (size_t i = sizeof(void*); i < PAGE_SIZE; i++) {
+        dirty |= ((unsigned char*)a)[i];
+    }
+    CHECK(dirty == 0);
+    CHECK(mem_clean_pages() >= ZERO_POOL_TARGET);
+
+    // Pool pages come out whole, link word included
+    unsigned char* z = kalloc_zeroed();
+    dirty = 0;
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        dirty |= z[i];
+    }
+    CHECK(dirty == 0);
+
+    CHECK(kfree(z) == 0);
+    CHECK(kfree(b) == 0);
+}
+
+// One call site no matter how the caller gets unrolled
+static void* __attribute__((noinline)) alloc_from_here(void) {
+    void* page = kalloc();
+    // Keeps kalloc from becoming a tail call
+    __asm__ volatile("" ::: "memory");
+    return page;
+}
+
+static void test_alloc_stats(void) {
+    struct alloc_stats before, after;
+    void* pages[3];
+
+    alloc_get_stats(&before);
+    alloc_leak_mark();
+
+    for (int i = 0; i < 3; i++) {
+        pages[i] = alloc_from_here();
+    }
+
+    alloc_get_stats(&after);
+    CHECK(after.in_use == before.in_use + 3);
+    CHECK(after.allocs == before.allocs + 3);
+    CHECK(after.peak >= after.in_use);
+
+    // The biggest holder right now is alloc_from_here
+    host_uart_reset();
+    alloc_dump_sites(1);
+    CHECK(strncmp(host_uart_buf, "alloc,0x", 8) == 0);
+    CHECK(strstr(host_uart_buf, ",3,3,3,0\n") != NULL);
+
+    host_uart_reset();
+    CHECK(alloc_leak_check() == 3);
+
+    CHECK(kfree(pages[0]) == 0);
+    CHECK(kfree(pages[0]) == -1);
+    CHECK(kfree_s(pages[0]) == -1);
+
+    alloc_get_stats(&after);
+    CHECK(after.double_frees == before.double_frees + 2);
+    CHECK(after.frees == before.frees + 1);
+
+    CHECK(kfree(pages[1]) == 0);
+    CHECK(kfree_s(pages[2]) == 0);
+    CHECK(alloc_leak_check() == 0);
+
+    alloc_get_stats(&after);
+    CHECK(after.in_use == before.in_use);
+}
+
+// Takes every page there is, returns how many that was
+static size_t alloc_exhaust(void** pages) {
+    // Static so it survives the longjmp out of kalloc
+    static size_t n;
+    jmp_buf jmp;
+
+    n = 0;
+    host_panic_jmp = &jmp;
+    if (setjmp(jmp) == 0) {
+        for (;;) {
+            void* page = kalloc();
+            pages[n++] = page;
+        }
+    }
+    host_panic_jmp = NULL;
+
+    return n;
+}
+
+static void test_alloc_exhaust(void) {
+    static void* pages[HOST_HEAP_PAGES + 1];
+    uint64_t nfree = mem_free_pages();
+
+    // Every page comes out exactly once, then kalloc panics
+    size_t n = alloc_exhaust(pages);
+
+    CHECK(n == nfree);
+    CHECK(mem_free_pages() == 0);
+
+    char* reserved = host_heap + HOST_RESERVED_PAGE * PAGE_SIZE;
+    int bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        bad |= (char*)pages[i] >= reserved
+            && (char*)pages[i] < reserved + 4 * PAGE_SIZE;
+        bad |= (page_meta(pages[i])->flags & PG_RESERVED) != 0;
+    }
+    CHECK(!bad);
+
+    // Half go back dirty, half with kfree_s. Once the dirty ones run out,
+    // kalloc has to zero the others itself.
+    for (size_t i = 0; i < n; i++) {
+        memset(pages[i], 0xab, PAGE_SIZE);
+        CHECK((i % 2 ? kfree_s(pages[i]) : kfree(pages[i])) == 0);
+    }
+    CHECK(mem_free_pages() == nfree);
+
+    CHECK(alloc_exhaust(pages) == n);
+
+    size_t zeroed = 0;
+    bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char* p = pages[i];
+        int ored = 0, anded = 0xff;
+
+        for (size_t j = sizeof(void*); j < PAGE_SIZE; j++) {
+            ored |= p[j];
+            anded &= p[j];
+        }
+
+        zeroed += ored == 0;
+        bad |= ored != 0 && anded != 0xab;
+    }
+    CHECK(!bad);
+    CHECK(zeroed == n / 2);
+
+    for (size_t i = 0; i < n; i++) {
+        CHECK(kfree(pages[i]) == 0);
+    }
+    CHECK(mem_free_pages() == nfree);
+}
+
+static void test_fdt(void) {
+    static struct fdt_builder b;
+    static uint32_t blob[2048];
+    uint32_t reg[4] = {
+        __builtin_bswap32(0), __builtin_bswap32(0x80000000),
+        __builtin_bswap32(0), __builtin_bswap32(0x8000000),
+    };
+
+    fdt_begin(&b, "");
+    fdt_prop_str(&b, "model", "test");
+    fdt_begin(&b, "memory@80000000");
+    fdt_prop_str(&b, "device_type", "memory");
+    fdt_prop(&b, "reg", reg, sizeof(reg));
+    fdt_end(&b);
+    fdt_begin(&b, "cpus");
+    for (int i = 0; i < 3; i++) {
+        char name[8] = "cpu@0";
+        name[4] += i;
+        fdt_begin(&b, name);
+        fdt_prop_str(&b, "device_type", "cpu");
+        fdt_prop_str(&b, "status", i == 2 ? "disabled" : "okay");
+        fdt_begin(&b, "interrupt-controller");
+        fdt_end(&b);
+        fdt_end(&b);
+    }
+    fdt_begin(&b, "cpu-map");
+    fdt_end(&b);
+    fdt_end(&b);
+    fdt_begin(&b, "chosen");
+    uint32_t initrd_start[2] = {
+        __builtin_bswap32(0), __builtin_bswap32(0x88000000),
+    };
+    uint32_t initrd_end = __builtin_bswap32(0x88100000);
+    fdt_prop(&b, "linux,initrd-start", initrd_start, sizeof(initrd_start));
+    fdt_prop(&b, "linux,initrd-end", &initrd_end, sizeof(initrd_end));
+    fdt_end(&b);
+    fdt_end(&b);
+    fdt_finish(&b, blob);
+
+    CHECK(fdt_check(blob));
+    CHECK(!fdt_check(b.buf));
+    CHECK(fdt_count_harts(blob) == 2);
+    CHECK(fdt_count_harts(NULL) == 1);
+
+    int mem = fdt_path_offset(blob, "/memory");
+    CHECK(mem >= 0 && strcmp(fdt_get_name(blob, mem), "memory@80000000") == 0);
+    CHECK(fdt_path_offset(blob, "/memory@80000000") == mem);
+    CHECK(fdt_path_offset(blob, "/memory@90000000") < 0);
+    CHECK(fdt_path_offset(blob, "/cpus/cpu@1") >= 0);
+    CHECK(fdt_path_offset(blob, "/cpus/cpu@1/interrupt-controller") >= 0);
+    CHECK(fdt_path_offset(blob, "/nope") < 0);
+
+    int len;
+    const void* val = fdt_getprop(blob, mem, "reg", &len);
+    CHECK(val && len == 16);
+    CHECK(val && fdt_read_cells(val, 2) == 0x80000000);
+    CHECK(val && fdt_read_cells((const char*)val + 8, 2) == 0x8000000);
+    CHECK(fdt_getprop(blob, mem, "status", NULL) == NULL);
+
+    const char* model = fdt_getprop(blob, fdt_path_offset(blob, "/"), "model",
+            NULL);
+    CHECK(model && strcmp(model, "test") == 0);
+
+    // One cell or two, both are out there
+    uint64_t start, end;
+    CHECK(fdt_initrd(blob, &start, &end) == 0);
+    CHECK(start == 0x88000000 && end == 0x88100000);
+    CHECK(fdt_initrd(NULL, &start, &end) == -1);
+}
+
+static void* heap_slice_worker(void* arg) {
+    init_memory_slice((int)(intptr_t)arg, HEAP_SLICES);
+    return NULL;
+}
+
+/*
+ * Brings the heap up from a device tree describing the arena, in slices
+ * like the boot harts do. The exhaustion test checks every page made it
+ * exactly once.
+ */
+static void test_memory_map(void) {
+    static struct fdt_builder b;
+    static uint32_t blob[2048];
+    uint32_t two = __builtin_bswap32(2);
+    uint64_t base = (uint64_t)host_heap;
+    uint64_t rbase = base + HOST_RESERVED_PAGE * PAGE_SIZE;
+    uint32_t reg[4] = {
+        __builtin_bswap32(base >> 32), __builtin_bswap32(base),
+        __builtin_bswap32(0), __builtin_bswap32(HOST_HEAP_SIZE),
+    };
+    uint32_t rreg[4] = {
+        __builtin_bswap32(rbase >> 32), __builtin_bswap32(rbase),
+        __builtin_bswap32(0), __builtin_bswap32(4 * PAGE_SIZE),
+    };
+
+    fdt_begin(&b, "");
+    fdt_prop(&b, "#address-cells", &two, 4);
+    fdt_prop(&b, "#size-cells", &two, 4);
+    fdt_begin(&b, "memory@0");
+    fdt_prop_str(&b, "device_type", "memory");
+    fdt_prop(&b, "reg", reg, sizeof(reg));
+    fdt_end(&b);
+    fdt_begin(&b, "reserved-memory");
+    fdt_begin(&b, "firmware@0");
+    fdt_prop(&b, "reg", rreg, sizeof(rreg));
+    fdt_end(&b);
+    fdt_end(&b);
+    fdt_end(&b);
+    fdt_finish(&b, blob);
+
+    init_memory_map(blob);
+
+    CHECK(mem_total_pages() == HOST_HEAP_PAGES);
+    CHECK(page_meta(host_heap) != NULL);
+    CHECK(page_meta(host_heap + HOST_HEAP_SIZE) == NULL);
+    CHECK(page_meta((void*)rbase)->flags & PG_RESERVED);
+
+    pthread_t threads[HEAP_SLICES];
+    for (int i = 0; i < HEAP_SLICES; i++) {
+        pthread_create(&threads[i], NULL, heap_slice_worker,
+                (void*)(intptr_t)i);
+    }
+    for (int i = 0; i < HEAP_SLICES; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Everything but the reserved pages and the metadata itself
+    uint64_t meta = (HOST_HEAP_PAGES * sizeof(struct page) + PAGE_SIZE - 1)
+        / PAGE_SIZE;
+    CHECK(mem_free_pages() == HOST_HEAP_PAGES - 4 - meta);
+}
+
+static void test_print(void) {
+    char buf[21];
+
+    CHECK(print_numeric(0, buf, 21) == 1 && buf[0] == '0');
+    CHECK(print_numeric(UINT64_MAX, buf, 21) == 20);
+    CHECK(print_hex(0xbeef, buf, 16) == 4 && buf[0] == 'f' && buf[3] == 'b');
+
+    CHECK_PRINTK("plain", "plain");
+    CHECK_PRINTK("100%", "100%%");
+    CHECK_PRINTK("-42 17", "%d %u", -42, 17u);
+    CHECK_PRINTK("-9000000000 18446744073709551615", "%ld %lu",
+            -9000000000L, 18446744073709551615UL);
+    CHECK_PRINTK("-5x 7y", "%lldx %lluy", -5LL, 7ULL);
+    CHECK_PRINTK("0xdeadbeef", "%p", (void*)0xdeadbeef);
+    CHECK_PRINTK("[str]", "[%s]", "str");
+}
+
+static int console_writes;
+
+static void count_console_write(const char* buf, size_t len) {
+    console_writes++;
+    uart_console.write(buf, len);
+}
+
+static const struct console_ops count_console = {
+    .name = "count",
+    .write = count_console_write,
+};
+
+static void test_console(void) {
+    static char long_str[601];
+
+    console_set(&count_console);
+    CHECK(strcmp(console_name(), "count") == 0);
+
+    // One line is one write
+    console_writes = 0;
+    CHECK_PRINTK("a 1 0x2 b", "a %d %p %s", 1, (void*)2, "b");
+    CHECK(console_writes == 1);
+
+    // Longer ones go out in pieces, in order
+    memset(long_str, 'x', 600);
+    long_str[0] = '<';
+    long_str[599] = '>';
+    console_writes = 0;
+    host_uart_reset();
+    printk("%s", long_str);
+    CHECK(console_writes == 3);
+    CHECK(host_uart_len == 601 && strncmp(host_uart_buf, long_str, 600) == 0);
+
+    // Emergency lines skip the backend and its lock
+    console_writes = 0;
+    host_uart_reset();
+    printk_emergency("trap %d at %p", 3, (void*)0x10);
+    CHECK(console_writes == 0);
+    CHECK(strcmp(host_uart_buf, "trap 3 at 0x10\n") == 0);
+
+    // Once panicked, the UART stays
+    console_panic();
+    CHECK(strcmp(console_name(), "uart") == 0);
+    console_set(&count_console);
+    CHECK(strcmp(console_name(), "uart") == 0);
+}
+
+/*
+ * Plays the device's side of a queue: completes the oldest available chain
+ * and reports len bytes written.
+ */
+static void virtq_complete(struct virtq* vq, uint16_t* seen, uint32_t len) {
+    uint16_t head = vq->avail->ring[*seen % vq->num];
+
+    vq->used->ring[vq->used->idx % vq->num].id = head;
+    vq->used->ring[vq->used->idx % vq->num].len = len;
+    (*seen)++;
+    vq->used->idx++;
+}
+
+static void test_virtq(void) {
+    // No transport behind it, so virtq_kick() must never notify
+    struct virtq* vq = kalloc_zeroed();
+    vq->desc = kalloc_zeroed();
+    vq->avail = kalloc_zeroed();
+    vq->used = kalloc_zeroed();
+    vq->used->flags = VIRTQ_USED_F_NO_NOTIFY;
+    vq->num = 8;
+    vq->nfree = 8;
+    for (int i = 0; i < 7; i++) {
+        vq->desc[i].next = i + 1;
+    }
+
+    int cookies[8];
+    struct virtq_buf bufs[3] = {
+        { &cookies[0], 16, false },
+        { &cookies[1], 512, false },
+        { &cookies[2], 1, true },
+    };
+    uint16_t seen = 0;
+
+    CHECK(virtq_get(vq, NULL) == NULL);
+    CHECK(virtq_add(vq, bufs, 0, &cookies[0]) == -1);
+
+    // A chain takes descriptors in free list order and links them up
+    int head = virtq_add(vq, bufs, 3, &cookies[0]);
+    CHECK(head == 0);
+    CHECK(vq->nfree == 5);
+    CHECK(vq->desc[0].flags == VIRTQ_DESC_F_NEXT && vq->desc[0].next == 1);
+    CHECK(vq->desc[1].len == 512 && vq->desc[1].next == 2);
+    CHECK(vq->desc[2].flags == VIRTQ_DESC_F_WRITE);
+    CHECK(vq->desc[2].addr == (uint64_t)&cookies[2]);
+
+    // Not visible until the kick
+    CHECK(vq->avail->idx == 0);
+    CHECK(virtq_add(vq, bufs, 3, &cookies[1]) == 3);
+    CHECK(virtq_add(vq, bufs, 3, &cookies[2]) == -1);
+    virtq_kick(vq);
+    CHECK(vq->avail->idx == 2);
+
+    // Completions come back in whatever order, and free their chains
+    virtq_complete(vq, &seen, 7);
+    uint32_t len = 0;
+    CHECK(virtq_get(vq, &len) == &cookies[0]);
+    CHECK(len == 7);
+    CHECK(vq->nfree == 5);
+    CHECK(virtq_get(vq, NULL) == NULL);
+
+    // The freed chain is reused first, then the rest of the free list
+    CHECK(virtq_add(vq, bufs, 1, &cookies[3]) == 0);
+    CHECK(virtq_add(vq, bufs, 2, &cookies[4]) == 1);
+    CHECK(virtq_add(vq, bufs, 2, &cookies[5]) == 6);
+    CHECK(vq->nfree == 0);
+
+    virtq_kick(vq);
+    for (int i = 0; i < 4; i++) {
+        virtq_complete(vq, &seen, 0);
+    }
+    CHECK(virtq_get(vq, NULL) == &cookies[1]);
+    CHECK(virtq_get(vq, NULL) == &cookies[3]);
+    CHECK(virtq_get(vq, NULL) == &cookies[4]);
+    CHECK(virtq_get(vq, NULL) == &cookies[5]);
+    CHECK(vq->nfree == 8);
+
+    // Ring indexes keep going past the ring size
+    for (int i = 0; i < 100; i++) {
+        CHECK(virtq_add(vq, bufs, 3, &cookies[i % 8]) >= 0);
+        virtq_kick(vq);
+        virtq_complete(vq, &seen, 0);
+        CHECK(virtq_get(vq, NULL) == &cookies[i % 8]);
+    }
+    CHECK(vq->nfree == 8);
+
+    virtq_intr_off(vq);
+    CHECK(vq->avail->flags == VIRTQ_AVAIL_F_NO_INTERRUPT);
+    CHECK(!virtq_intr_on(vq));
+    CHECK(vq->avail->flags == 0);
+
+    CHECK(kfree(vq->desc) == 0);
+    CHECK(kfree(vq->avail) == 0);
+    CHECK(kfree(vq->used) == 0);
+    CHECK(kfree(vq) == 0);
+}
+
+static struct blk_sqe* ring_sqe(struct blk_ring* ring, int op,
+        uint64_t sector, void* buf, uint32_t len, uint64_t tag) {
+    struct blk_sqe* sqe = blk_ring_get_sqe(ring);
+
+    if (sqe)
+        *sqe = (struct blk_sqe){ .op = op, .sector = sector, .buf = buf,
+            .len = len, .tag = tag };
+
+    return sqe;
+}
+
+// Result of the completion with this tag, 1 if there is none
+static int cqe_result(struct blk_cqe* cqes, int n, uint64_t tag) {
+    for (int i = 0; i < n; i++) {
+        if (cqes[i].tag == tag)
+            return cqes[i].result;
+    }
+
+    return 1;
+}
+
+static void test_blk_ring(void) {
+    static struct blk_ring ring;
+    static unsigned char out[8][SECTOR_SIZE], in[SECTOR_SIZE];
+    struct blk_cqe cqes[2 * BLK_RING_MAX];
+
+    CHECK(blk_ring_init(&ring, &host_blkdev, 0) == -1);
+    CHECK(blk_ring_init(&ring, &host_blkdev, 12) == 0);
+    CHECK(ring.entries == 8);
+
+    // A batch goes out with one notify, completions in any order
+    host_blk_kicks = 0;
+    for (int i = 0; i < 5; i++) {
+        memset(out[i], 'a' + i, SECTOR_SIZE);
+        CHECK(ring_sqe(&ring, BLK_OP_WRITE, i, out[i], SECTOR_SIZE, 100 + i));
+    }
+    CHECK(blk_ring_submit(&ring) == 5);
+    CHECK(host_blk_kicks == 1);
+    CHECK(host_blk_queued == 5);
+
+    CHECK(blk_ring_wait(&ring, cqes, 5, 8) == 5);
+    int bad = 0;
+    for (int i = 0; i < 5; i++) {
+        bad |= cqe_result(cqes, 5, 100 + i) != BLK_OK;
+        bad |= memcmp(host_disk + i * SECTOR_SIZE, out[i], SECTOR_SIZE) != 0;
+    }
+    CHECK(!bad);
+    CHECK(blk_ring_reap(&ring, cqes, 8) == 0);
+
+    // The sqe ring holds entries and no more
+    for (int i = 0; i < 8; i++) {
+        CHECK(ring_sqe(&ring, BLK_OP_FLUSH, 0, NULL, 0, i) != NULL);
+    }
+    CHECK(blk_ring_get_sqe(&ring) == NULL);
+    CHECK(blk_ring_submit(&ring) == 8);
+    CHECK(blk_ring_wait(&ring, cqes, 8, 16) == 8);
+
+    // A read linked behind a write only starts once the write is done
+    memset(out[5], 'z', SECTOR_SIZE);
+    ring_sqe(&ring, BLK_OP_WRITE, 20, out[5], SECTOR_SIZE, 1)->flags =
+        BLK_SQE_LINK;
+    ring_sqe(&ring, BLK_OP_READ, 20, in, SECTOR_SIZE, 2);
+    CHECK(blk_ring_submit(&ring) == 2);
+    CHECK(host_blk_queued == 1);
+    CHECK(blk_ring_reap(&ring, cqes, 8) == 1);
+    CHECK(cqes[0].tag == 1 && cqes[0].result == BLK_OK);
+    CHECK(host_blk_queued == 1);
+    CHECK(blk_ring_wait(&ring, cqes, 1, 8) == 1);
+    CHECK(cqes[0].tag == 2 && cqes[0].result == BLK_OK);
+    CHECK(memcmp(in, out[5], SECTOR_SIZE) == 0);
+
+    // A failure cancels the rest of its chain and nothing else
+    host_blk_fail_sector = 30;
+    ring_sqe(&ring, BLK_OP_WRITE, 30, out[0], SECTOR_SIZE, 1)->flags =
+        BLK_SQE_LINK;
+    ring_sqe(&ring, BLK_OP_WRITE, 31, out[0], SECTOR_SIZE, 2)->flags =
+        BLK_SQE_LINK;
+    ring_sqe(&ring, BLK_OP_DISCARD, 32, NULL, SECTOR_SIZE, 3);
+    ring_sqe(&ring, BLK_OP_WRITE, 33, out[0], SECTOR_SIZE, 4);
+    ring_sqe(&ring, BLK_OP_WRITE, 34, out[0], 100, 5);
+    CHECK(blk_ring_submit(&ring) == 5);
+    CHECK(blk_ring_wait(&ring, cqes, 5, 16) == 5);
+    CHECK(cqe_result(cqes, 5, 1) == BLK_ERR_IO);
+    CHECK(cqe_result(cqes, 5, 2) == BLK_ERR_CANCELED);
+    CHECK(cqe_result(cqes, 5, 3) == BLK_ERR_CANCELED);
+    CHECK(cqe_result(cqes, 5, 4) == BLK_OK);
+    CHECK(cqe_result(cqes, 5, 5) == BLK_ERR_INVAL);
+    host_blk_fail_sector = -1;
+
+    // A short device queue only slows things down
+    host_blk_depth = 2;
+    host_blk_kicks = 0;
+    for (int i = 0; i < 8; i++) {
+        ring_sqe(&ring, BLK_OP_READ, i, out[i], SECTOR_SIZE, i);
+    }
+    CHECK(blk_ring_submit(&ring) == 8);
+    CHECK(host_blk_queued == 2);
+    CHECK(blk_ring_wait(&ring, cqes, 8, 16) == 8);
+    CHECK(host_blk_kicks == 4);
+    host_blk_depth = HOST_BLK_QUEUE_MAX;
+
+    // Unreaped completions hold back new submissions, so none get lost
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 8; i++) {
+            ring_sqe(&ring, BLK_OP_FLUSH, 0, NULL, 0, round * 8 + i);
+        }
+        blk_ring_submit(&ring);
+        blk_reap(&host_blkdev);
+    }
+    CHECK(blk_ring_submit(&ring) == 0);
+    CHECK(blk_ring_reap(&ring, cqes, 2 * BLK_RING_MAX) == 16);
+    CHECK(blk_ring_submit(&ring) == 8);
+    CHECK(blk_ring_wait(&ring, cqes, 8, 16) == 8);
+    CHECK(cqes[0].tag >= 16);
+
+    blk_ring_destroy(&ring);
+}
+
+static void test_ramdisk(void) {
+    static struct ramdisk rd;
+    static struct blk_ring ring;
+    static unsigned char disk[16 * SECTOR_SIZE + 100];
+    static unsigned char out[4][SECTOR_SIZE], in[4 * SECTOR_SIZE];
+    struct blk_cqe cqes[2 * BLK_RING_MAX];
+
+    CHECK(ramdisk_create(&rd, "rdtest", disk, SECTOR_SIZE - 1) == -1);
+    CHECK(ramdisk_create(&rd, "rdtest", disk, sizeof(disk)) == 0);
+    CHECK(rd.dev.capacity == 16);
+    CHECK(blkdev_find("rdtest") == &rd.dev);
+    CHECK(blkdev_find("nope") == NULL);
+
+    CHECK(blk_ring_init(&ring, &rd.dev, 8) == 0);
+
+    for (int i = 0; i < 4; i++) {
+        memset(out[i], 0x10 + i, SECTOR_SIZE);
+        CHECK(ring_sqe(&ring, BLK_OP_WRITE, 4 + i, out[i], SECTOR_SIZE, i));
+    }
+    CHECK(ring_sqe(&ring, BLK_OP_FLUSH, 0, NULL, 0, 4) != NULL);
+    CHECK(blk_ring_submit(&ring) == 5);
+
+    // Done on submit, no kick needed
+    int n = blk_ring_reap(&ring, cqes, 2 * BLK_RING_MAX);
+    CHECK(n == 5);
+    for (int i = 0; i < 5; i++) {
+        CHECK(cqe_result(cqes, n, i) == BLK_OK);
+    }
+    CHECK(disk[5 * SECTOR_SIZE] == 0x11);
+
+    // One read across all four, then a discard of the middle two
+    ring_sqe(&ring, BLK_OP_READ, 4, in, sizeof(in), 10);
+    ring_sqe(&ring, BLK_OP_DISCARD, 5, NULL, 2 * SECTOR_SIZE, 11);
+    blk_ring_submit(&ring);
+    n = blk_ring_wait(&ring, cqes, 2, 2 * BLK_RING_MAX);
+    CHECK(n == 2 && cqe_result(cqes, n, 10) == BLK_OK);
+    CHECK(in[0] == 0x10 && in[3 * SECTOR_SIZE] == 0x13);
+    CHECK(disk[5 * SECTOR_SIZE] == 0 && disk[7 * SECTOR_SIZE - 1] == 0);
+    CHECK(disk[7 * SECTOR_SIZE] == 0x13);
+
+    // Past the end, straddling it and not whole sectors
+    ring_sqe(&ring, BLK_OP_READ, 16, in, SECTOR_SIZE, 20);
+    ring_sqe(&ring, BLK_OP_WRITE, 15, in, 2 * SECTOR_SIZE, 21);
+    ring_sqe(&ring, BLK_OP_WRITE, 0, in, 100, 22);
+    ring_sqe(&ring, BLK_OP_READ, UINT64_MAX, in, SECTOR_SIZE, 23);
+    blk_ring_submit(&ring);
+    n = blk_ring_reap(&ring, cqes, 2 * BLK_RING_MAX);
+    CHECK(n == 4);
+    for (int i = 20; i < 24; i++) {
+        CHECK(cqe_result(cqes, n, i) == BLK_ERR_INVAL);
+    }
+
+    blk_ring_destroy(&ring);
+
+    // No device tree, so the scratch area
+    init_ramdisk(NULL);
+    struct blkdev* ram0 = blkdev_find("ram0");
+    CHECK(ram0 != NULL);
+    CHECK(ram0 && ram0->capacity == RAMDISK_SCRATCH_KB * 2);
+}
+
+static void test_string(void) {
+    static unsigned char src[256 + 16];
+    static unsigned char dst[256 + 16];
+    static unsigned char ref[256 + 16];
+
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (unsigned char)(i * 7 + 3);
+    }
+
+    // Every alignment and length pairing around the word size
+    for (size_t doff = 0; doff < 8; doff++) {
+        for (size_t soff = 0; soff < 8; soff++) {
+            for (size_t len = 0; len <= 256; len += (len < 80 ? 1 : 13)) {
+                for (size_t i = 0; i < sizeof(dst); i++) {
+                    dst[i] = ref[i] = 0x5a;
+                }
+                for (size_t i = 0; i < len; i++) {
+                    ref[doff + i] = src[soff + i];
+                }
+
+                CHECK(memcpy(dst + doff, src + soff, len) == dst + doff);
+                CHECK(memcmp(dst, ref, sizeof(dst)) == 0);
+
+                for (size_t i = 0; i < len; i++) {
+                    ref[doff + i] = 0xc3;
+                }
+                CHECK(memset(dst + doff, 0xc3, len) == dst + doff);
+                CHECK(memcmp(dst, ref, sizeof(dst)) == 0);
+            }
+        }
+    }
+
+    CHECK(strlen("") == 0 && strlen("four") == 4);
+    CHECK(strcmp("abc", "abc") == 0);
+    CHECK(strcmp("abc", "abd") < 0 && strcmp("b", "abc") > 0);
+    CHECK(strcmp("ab", "abc") < 0);
+    CHECK(strncmp("cpu@0", "cpu", 3) == 0 && strncmp("cpu", "cpux", 4) < 0);
+
+    memset_s(dst, 0, sizeof(dst));
+    int dirty = 0;
+    for (size_t i = 0; i < sizeof(dst); i++) {
+        dirty |= dst[i];
+    }
+    CHECK(dirty == 0);
+}
+
+static spinlock stress_lock;
+static uint64_t stress_counter;
+
+static void* lock_worker(void* arg) {
+    (void)arg;
+
+    for (int i = 0; i < LOCK_ITERS; i++) {
+        acquire(&stress_lock);
+        // Non-atomic on purpose, the lock is all that keeps this exact
+        uint64_t v = stress_counter;
+        __asm__ volatile("" ::: "memory");
+        stress_counter = v + 1;
+        release(&stress_lock);
+    }
+
+    return NULL;
+}
+
+static void test_lock(void) {
+    pthread_t threads[LOCK_THREADS];
+
+    for (int i = 0; i < LOCK_THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, lock_worker, NULL) == 0);
+    }
+    for (int i = 0; i < LOCK_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(stress_counter == (uint64_t)LOCK_THREADS * LOCK_ITERS);
+    CHECK(!atomic_load(&stress_lock.locked));
+
+    CHECK(try_acquire(&stress_lock));
+    CHECK(!try_acquire(&stress_lock));
+    release(&stress_lock);
+    CHECK(try_acquire(&stress_lock));
+    release(&stress_lock);
+}
+
+static seqlock stress_seq;
+static volatile uint64_t stress_a, stress_b;
+static atomic_bool stress_seq_stop;
+
+static void* seqlock_writer(void* arg) {
+    (void)arg;
+
+    for (uint64_t i = 1; i <= SEQLOCK_WRITES; i++) {
+        seqlock_write_begin(&stress_seq);
+        stress_a = i;
+        stress_b = ~i;
+        seqlock_write_end(&stress_seq);
+    }
+
+    atomic_store(&stress_seq_stop, true);
+    return NULL;
+}
+
+static void* seqlock_reader(void* arg) {
+    uint64_t* torn = arg;
+    uint64_t last = 0;
+
+    while (!atomic_load(&stress_seq_stop)) {
+        unsigned seq;
+        uint64_t a, b;
+
+        do {
+            seq = seqlock_read_begin(&stress_seq);
+            a = stress_a;
+            b = stress_b;
+        } while (seqlock_read_retry(&stress_seq, seq));
+
+        // Half of one update and half of another, or going backwards
+        if (b != ~a || a < last)
+            (*torn)++;
+        last = a;
+    }
+
+    return NULL;
+}
+
+static void test_seqlock(void) {
+    pthread_t writer, readers[LOCK_THREADS - 1];
+    uint64_t torn[LOCK_THREADS - 1] = { 0 };
+
+    stress_b = ~0ULL;
+
+    for (int i = 0; i < LOCK_THREADS - 1; i++) {
+        CHECK(pthread_create(&readers[i], NULL, seqlock_reader,
+                    &torn[i]) == 0);
+    }
+    CHECK(pthread_create(&writer, NULL, seqlock_writer, NULL) == 0);
+
+    pthread_join(writer, NULL);
+    for (int i = 0; i < LOCK_THREADS - 1; i++) {
+        pthread_join(readers[i], NULL);
+        CHECK(torn[i] == 0);
+    }
+
+    CHECK(atomic_load(&stress_seq.seq) == 2 * SEQLOCK_WRITES);
+    CHECK(!atomic_load(&stress_seq.lock.locked));
+}
+
+static int rcu_order[8];
+static int rcu_ran;
+
+struct rcu_test_obj {
+    int id;
+    struct rcu_head rcu;
+};
+
+static void rcu_test_cb(struct rcu_head* head) {
+    struct rcu_test_obj* obj = (struct rcu_test_obj*)((char*)head
+            - offsetof(struct rcu_test_obj, rcu));
+    rcu_order[rcu_ran++] = obj->id;
+}
+
+/*
+ * The host build is a single hart, so this covers the bookkeeping: who
+ * waits for what, callback order and kfree_rcu.
+ */
+static void test_rcu(void) {
+    struct rcu_test_obj objs[4];
+    struct rcu_stats st;
+
+    for (int i = 0; i < 4; i++) {
+        objs[i].id = i;
+    }
+
+    // Nobody is online yet, so nobody can be reading
+    call_rcu(&objs[0].rcu, rcu_test_cb);
+    CHECK(rcu_ran == 1);
+
+    rcu_online();
+
+    for (int i = 1; i < 4; i++) {
+        call_rcu(&objs[i].rcu, rcu_test_cb);
+    }
+    CHECK(rcu_ran == 1);
+
+    rcu_get_stats(&st);
+    CHECK(st.pending == 3);
+    CHECK(st.online == 1);
+
+    rcu_quiescent();
+    CHECK(rcu_ran == 4);
+    for (int i = 0; i < 4; i++) {
+        CHECK(rcu_order[i] == i);
+    }
+
+    // Only waits on ourselves
+    uint64_t gp = st.gp;
+    synchronize_rcu();
+    rcu_get_stats(&st);
+    CHECK(st.gp == gp + 1);
+
+    struct alloc_stats before, after;
+    struct rcu_test_obj* page = kalloc();
+    CHECK(page != NULL);
+
+    alloc_get_stats(&before);
+    kfree_rcu(page, rcu);
+    alloc_get_stats(&after);
+    CHECK(after.in_use == before.in_use);
+
+    rcu_quiescent();
+    alloc_get_stats(&after);
+    CHECK(after.in_use == before.in_use - 1);
+
+    rcu_get_stats(&st);
+    CHECK(st.pending == 0);
+    CHECK(st.done == 5);
+}
+
+#define DCACHE_NAME(s) (s), strlen(s)
+
+static void test_dcache(void) {
+    struct dcache_stats st, st0;
+    struct alloc_stats before, after;
+    uint32_t ino = 0;
+    char name[16];
+
+    rcu_online();
+    alloc_get_stats(&before);
+    dcache_get_stats(&st0);
+
+    dcache_add(1, DCACHE_NAME("etc"), 2);
+    dcache_add(2, DCACHE_NAME("nope"), 0);
+
+    CHECK(dcache_lookup(1, DCACHE_NAME("etc"), &ino) == DCACHE_HIT);
+    CHECK(ino == 2);
+    CHECK(dcache_lookup(1, DCACHE_NAME("et"), &ino) == DCACHE_MISS);
+    CHECK(dcache_lookup(1, DCACHE_NAME("etcc"), &ino) == DCACHE_MISS);
+    CHECK(dcache_lookup(3, DCACHE_NAME("etc"), &ino) == DCACHE_MISS);
+    CHECK(dcache_lookup(2, DCACHE_NAME("nope"), &ino) == DCACHE_NEGATIVE);
+
+    dcache_get_stats(&st);
+    CHECK(st.entries == 2);
+    CHECK(st.negative_entries == 1);
+    CHECK(st.lookups - st0.lookups == 5);
+    CHECK(st.hits - st0.hits == 1);
+    CHECK(st.negative_hits - st0.negative_hits == 1);
+
+    // Created since
+    dcache_add(2, DCACHE_NAME("nope"), 7);
+    CHECK(dcache_lookup(2, DCACHE_NAME("nope"), &ino) == DCACHE_HIT);
+    CHECK(ino == 7);
+    dcache_get_stats(&st);
+    CHECK(st.entries == 2);
+    CHECK(st.negative_entries == 0);
+
+    // Unlinked
+    dcache_invalidate(2, DCACHE_NAME("nope"));
+    CHECK(dcache_lookup(2, DCACHE_NAME("nope"), &ino) == DCACHE_MISS);
+
+    // Renamed over a name cached as missing
+    dcache_add(2, DCACHE_NAME("a"), 5);
+    dcache_add(3, DCACHE_NAME("b"), 0);
+    dcache_rename(2, DCACHE_NAME("a"), 3, DCACHE_NAME("b"));
+    CHECK(dcache_lookup(2, DCACHE_NAME("a"), &ino) == DCACHE_MISS);
+    CHECK(dcache_lookup(3, DCACHE_NAME("b"), &ino) == DCACHE_MISS);
+
+    dcache_get_stats(&st);
+    CHECK(st.invalidations - st0.invalidations == 3);
+
+    // Too long to cache
+    char long_name[DCACHE_NAME_MAX + 2];
+    memset(long_name, 'x', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    dcache_add(1, DCACHE_NAME(long_name), 9);
+    CHECK(dcache_lookup(1, DCACHE_NAME(long_name), &ino) == DCACHE_MISS);
+
+    // Fill it up. The oldest entry was used, so the next oldest goes.
+    dcache_flush();
+    for (int i = 0; i < DCACHE_MAX_ENTRIES; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        dcache_add(10, DCACHE_NAME(name), i + 100);
+    }
+    CHECK(dcache_lookup(10, DCACHE_NAME("n0"), &ino) == DCACHE_HIT);
+
+    dcache_get_stats(&st0);
+    dcache_add(10, DCACHE_NAME("extra"), 1);
+    dcache_get_stats(&st);
+
+    CHECK(st.entries == DCACHE_MAX_ENTRIES);
+    CHECK(st.evictions - st0.evictions == 1);
+    CHECK(dcache_lookup(10, DCACHE_NAME("n0"), &ino) == DCACHE_HIT);
+    CHECK(ino == 100);
+    CHECK(dcache_lookup(10, DCACHE_NAME("n1"), &ino) == DCACHE_MISS);
+    CHECK(dcache_lookup(10, DCACHE_NAME("n2"), &ino) == DCACHE_HIT);
+    CHECK(dcache_lookup(10, DCACHE_NAME("extra"), &ino) == DCACHE_HIT);
+
+    CHECK(dcache_shrink(16) == 16);
+
+    // The allocator can shrink it too, once it has been added to
+    dcache_get_stats(&st0);
+    CHECK(alloc_shrink(16) == 16);
+    dcache_get_stats(&st);
+    CHECK(st.evictions - st0.evictions == 16);
+
+    // Every page goes back once the grace period is over
+    dcache_flush();
+    rcu_quiescent();
+    dcache_get_stats(&st);
+    alloc_get_stats(&after);
+    CHECK(st.entries == 0);
+    CHECK(st.pages == 0);
+    CHECK(after.in_use == before.in_use);
+}
+
+static void test_fs(void) {
+    struct fs_stats before, after;
+    uint32_t ino = 0;
+
+    dcache_flush();
+    dcache_add(FS_ROOT_INO, DCACHE_NAME("a"), 5);
+    dcache_add(5, DCACHE_NAME("b"), 6);
+
+    CHECK(fs_namei("//a/b/", &ino) == 0 && ino == 6);
+    CHECK(fs_namei("/", &ino) == 0 && ino == FS_ROOT_INO);
+
+    // Not on disk, so the first walk caches it as missing and the second
+    // one has to fail from the cache as well
+    fs_get_stats(&before);
+    CHECK(fs_namei("/a/gone", &ino) == -1);
+    CHECK(fs_namei("/a/gone", &ino) == -1);
+    CHECK(fs_namei("/a/gone/b", &ino) == -1);
+    fs_get_stats(&after);
+    CHECK(after.disk - before.disk == 1);
+    CHECK(after.cached - before.cached == 5);
+
+    uint32_t found = 0;
+    CHECK(dcache_lookup(5, DCACHE_NAME("gone"), &found) == DCACHE_NEGATIVE);
+
+    dcache_flush();
+    rcu_quiescent();
+}
+
+// Log lines, compressible the way real data is rather than all one byte
+static void fill_text(uint8_t* buf, size_t len, uint32_t seed) {
+    size_t n = 0;
+
+    for (uint32_t i = seed; n < len; i++) {
+        char line[64];
+        int l = snprintf(line, sizeof(line),
+                "hart %u: request %u done in %u ticks\n", i % 4, i,
+                i * 37 % 1000);
+
+        for (int j = 0; j < l && n < len; j++) {
+            buf[n++] = line[j];
+        }
+    }
+}
+
+static void fill_random(uint8_t* buf, size_t len, uint64_t seed) {
+    uint64_t x = seed | 1;
+
+    for (size_t i = 0; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = x;
+    }
+}
+
+static void test_lz(void) {
+    static struct lz_state st;
+    static uint8_t src[LZ_MAX_INPUT + 1], out[LZ_MAX_INPUT + 1024];
+    static uint8_t back[LZ_MAX_INPUT];
+    int n;
+
+    // Empty, tiny and too big
+    CHECK((n = lz_compress(&st, src, 0, out, sizeof(out))) > 0);
+    CHECK(lz_decompress(out, n, back, sizeof(back)) == 0);
+    memcpy(src, "abc", 3);
+    CHECK((n = lz_compress(&st, src, 3, out, sizeof(out))) > 0);
+    CHECK(lz_decompress(out, n, back, sizeof(back)) == 3);
+    CHECK(memcmp(back, "abc", 3) == 0);
+    CHECK(lz_compress(&st, src, LZ_MAX_INPUT + 1, out, sizeof(out)) == -1);
+
+    fill_text(src, LZ_MAX_INPUT, 0);
+    n = lz_compress(&st, src, LZ_MAX_INPUT, out, sizeof(out));
+    CHECK(n > 0 && n < LZ_MAX_INPUT / 3);
+    CHECK(lz_decompress(out, n, back, sizeof(back)) == LZ_MAX_INPUT);
+    CHECK(memcmp(back, src, LZ_MAX_INPUT) == 0);
+
+    // Not enough room is an error, not a truncated block
+    CHECK(lz_compress(&st, src, LZ_MAX_INPUT, out, n - 1) == -1);
+    CHECK(lz_decompress(out, n, back, LZ_MAX_INPUT - 1) == -1);
+
+    // Broken input is refused wherever it's cut off
+    for (int cut = 0; cut < n; cut += n / 64 + 1) {
+        CHECK(lz_decompress(out, cut, back, sizeof(back)) != LZ_MAX_INPUT);
+    }
+
+    memset(src, 0, 4096);
+    n = lz_compress(&st, src, 4096, out, sizeof(out));
+    CHECK(n > 0 && n < 64);
+    memset(back, 0xff, 4096);
+    CHECK(lz_decompress(out, n, back, sizeof(back)) == 4096);
+    CHECK(back[0] == 0 && back[4095] == 0);
+
+    // Random data grows a little, and doesn't fit back into its own size
+    fill_random(src, 4096, 1);
+    n = lz_compress(&st, src, 4096, out, sizeof(out));
+    CHECK(n > 4096);
+    CHECK(lz_decompress(out, n, back, sizeof(back)) == 4096);
+    CHECK(memcmp(back, src, 4096) == 0);
+    CHECK(lz_compress(&st, src, 4096, out, 4096) == -1);
+
+    // A match reaching back before the start of the output
+    const uint8_t bad[] = { 0x14, 'a', 0x10, 0x00 };
+    CHECK(lz_decompress(bad, sizeof(bad), back, sizeof(back)) == -1);
+}
+
+static void work_count(void* arg, int i) {
+    atomic_fetch_add((atomic_int*)arg + i, 1);
+}
+
+static void test_work(void) {
+    static atomic_int hits[64];
+
+    work_parallel(work_count, hits, 64);
+    work_parallel(work_count, hits, 1);
+    work_parallel(work_count, hits, 0);
+
+    int ok = 1;
+    for (int i = 0; i < 64; i++) {
+        ok &= atomic_load(&hits[i]) == (i == 0 ? 2 : 1);
+    }
+    CHECK(ok);
+    CHECK(work_poll() == 0);
+}
+
+static void blk_sync_done(struct blk_req* req, int result) {
+    *(int*)req->priv = result;
+}
+
+// For devices that finish everything inside blk_add()
+static int blk_sync(struct blkdev* dev, int op, uint64_t sector, void* buf,
+        uint32_t len) {
+    int result = 1;
+    struct blk_req req = {
+        .op = op,
+        .sector = sector,
+        .buf = buf,
+        .len = len,
+        .done = blk_sync_done,
+        .priv = &result,
+    };
+
+    if (blk_add(dev, &req))
+        return -1;
+
+    return result;
+}
+
+static void test_cblk(void) {
+    static struct ramdisk rd;
+    static struct cblk c, c2;
+    static uint8_t disk[512 * SECTOR_SIZE];
+    static uint8_t buf[16 * CBLK_CLUSTER], back[16 * CBLK_CLUSTER];
+    static uint8_t text[16 * CBLK_CLUSTER];
+    struct cblk_stats st;
+    struct alloc_stats before, after;
+
+    alloc_get_stats(&before);
+
+    CHECK(ramdisk_create(&rd, "zlower", disk, sizeof(disk)) == 0);
+    CHECK(cblk_create(&c, "ztest", NULL) == -1);
+    CHECK(cblk_create(&c, "ztest", &rd.dev) == 0);
+    CHECK(blkdev_find("ztest") == &c.dev);
+
+    // The lower device belongs to ztest now
+    CHECK(rd.dev.holder == &c.dev);
+    CHECK(blkdev_find("zlower") == NULL);
+    CHECK(cblk_create(&c2, "ztest2", &rd.dev) == -1);
+    CHECK(blkdev_find("ztest2") == NULL);
+    CHECK(c.dev.capacity == 512);
+
+    struct blkdev* dev = &c.dev;
+
+    // Never written reads as zeros, without touching the lower device
+    memset(back, 0xff, CBLK_CLUSTER);
+    CHECK(blk_sync(dev, BLK_OP_READ, 0, back, CBLK_CLUSTER) == BLK_OK);
+    CHECK(back[0] == 0 && back[CBLK_CLUSTER - 1] == 0);
+
+    // A full batch of text in one request
+    fill_text(text, sizeof(text), 0);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 0, text, sizeof(text)) == BLK_OK);
+    memset(back, 0, sizeof(back));
+    CHECK(blk_sync(dev, BLK_OP_READ, 0, back, sizeof(back)) == BLK_OK);
+    CHECK(memcmp(back, text, sizeof(text)) == 0);
+
+    cblk_get_stats(&c, &st);
+    CHECK(st.lz == 16 && st.raw == 0 && st.zero == 0);
+    CHECK(st.bytes_written == sizeof(text));
+    CHECK(st.bytes_written_lower < sizeof(text) / 2);
+    CHECK(st.bytes_read_lower == st.bytes_written_lower);
+
+    // Random data doesn't shrink and is kept as is
+    fill_random(buf, CBLK_CLUSTER, 7);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 16 * 8, buf, CBLK_CLUSTER) == BLK_OK);
+    CHECK(blk_sync(dev, BLK_OP_READ, 16 * 8, back, CBLK_CLUSTER) == BLK_OK);
+    CHECK(memcmp(back, buf, CBLK_CLUSTER) == 0);
+
+    // Zeros take no room at all
+    uint64_t lower = st.bytes_written_lower;
+    memset(buf, 0, CBLK_CLUSTER);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 17 * 8, buf, CBLK_CLUSTER) == BLK_OK);
+    cblk_get_stats(&c, &st);
+    CHECK(st.raw == 1 && st.zero == 1);
+    CHECK(st.bytes_written_lower == lower + CBLK_CLUSTER);
+
+    // One sector in the middle of a compressed cluster, then reads that
+    // don't line up with clusters
+    memset(buf, 0xab, SECTOR_SIZE);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 3, buf, SECTOR_SIZE) == BLK_OK);
+    memset(text + 3 * SECTOR_SIZE, 0xab, SECTOR_SIZE);
+    CHECK(blk_sync(dev, BLK_OP_READ, 2, back, 2 * SECTOR_SIZE) == BLK_OK);
+    CHECK(memcmp(back, text + 2 * SECTOR_SIZE, 2 * SECTOR_SIZE) == 0);
+    CHECK(blk_sync(dev, BLK_OP_READ, 6, back, 11 * SECTOR_SIZE) == BLK_OK);
+    CHECK(memcmp(back, text + 6 * SECTOR_SIZE, 11 * SECTOR_SIZE) == 0);
+
+    // Discards read back as zeros, partial ones only where asked
+    CHECK(blk_sync(dev, BLK_OP_DISCARD, 4, NULL, 8 * SECTOR_SIZE) == BLK_OK);
+    CHECK(blk_sync(dev, BLK_OP_READ, 0, back, 2 * CBLK_CLUSTER) == BLK_OK);
+    memset(text + 4 * SECTOR_SIZE, 0, 8 * SECTOR_SIZE);
+    CHECK(memcmp(back, text, 2 * CBLK_CLUSTER) == 0);
+
+    // Same checks as the ramdisk
+    CHECK(blk_sync(dev, BLK_OP_READ, 512, back, SECTOR_SIZE)
+            == BLK_ERR_INVAL);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 511, back, 2 * SECTOR_SIZE)
+            == BLK_ERR_INVAL);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 0, back, 100) == BLK_ERR_INVAL);
+    CHECK(blk_sync(dev, BLK_OP_FLUSH, 0, NULL, 0) == BLK_OK);
+
+    // Empty it, fill 48 clusters with noise and the rest with text. New
+    // copies go down before old ones are freed, so noise over the text
+    // finds no room and must leave the text alone.
+    CHECK(blk_sync(dev, BLK_OP_DISCARD, 0, NULL, 512 * SECTOR_SIZE)
+            == BLK_OK);
+    for (int i = 0; i < 3; i++) {
+        fill_random(buf, sizeof(buf), 100 + i);
+        CHECK(blk_sync(dev, BLK_OP_WRITE, i * 128, buf, sizeof(buf))
+                == BLK_OK);
+    }
+    fill_text(text, sizeof(text), 5000);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 384, text, sizeof(text)) == BLK_OK);
+
+    fill_random(buf, sizeof(buf), 200);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 384, buf, sizeof(buf))
+            == BLK_ERR_IO);
+    cblk_get_stats(&c, &st);
+    CHECK(st.nospace == 1);
+    CHECK(blk_sync(dev, BLK_OP_READ, 384, back, sizeof(back)) == BLK_OK);
+    CHECK(memcmp(back, text, sizeof(text)) == 0);
+
+    // With the noise gone there's room again
+    CHECK(blk_sync(dev, BLK_OP_DISCARD, 0, NULL, 384 * SECTOR_SIZE)
+            == BLK_OK);
+    CHECK(blk_sync(dev, BLK_OP_WRITE, 384, buf, sizeof(buf)) == BLK_OK);
+    CHECK(blk_sync(dev, BLK_OP_READ, 384, back, sizeof(back)) == BLK_OK);
+    CHECK(memcmp(back, buf, sizeof(buf)) == 0);
+
+    // Map pages only come with writes
+    alloc_get_stats(&after);
+    CHECK(after.in_use - before.in_use == 3 + 1 + 2 * CBLK_BATCH + 1);
+}
+
+int main(void) {
+    test_memory_map();
+
+    test_alloc();
+    test_alloc_stats();
+    test_alloc_exhaust();
+    test_fdt();
+    test_print();
+    test_console();
+    test_string();
+    test_lock();
+    test_seqlock();
+    test_rcu();
+    test_dcache();
+    test_fs();
+    test_virtq();
+    test_blk_ring();
+    test_ramdisk();
+    test_lz();
+    test_work();
+    test_cblk();
+
+    printf("host-test: %d/%d checks passed\n", checks - failures, checks);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
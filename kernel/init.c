@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Dependency ordered init calls, shared out across harts.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "init.h"
+#include "print.h"
+#include "riscv.h"
+
+static bool init_deps_done(struct initcall* calls, uint32_t deps) {
+    for (int i = 0; deps; i++, deps >>= 1) {
+        if ((deps & 1) && atomic_load(&calls[i].state) != INIT_DONE)
+            return false;
+    }
+
+    return true;
+}
+
+void init_run(struct initcall* calls, int n, int hart) {
+    for (;;) {
+        bool all_done = true;
+
+        for (int i = 0; i < n; i++) {
+            struct initcall* c = &calls[i];
+            int state = atomic_load(&c->state);
+
+            if (state != INIT_DONE)
+                all_done = false;
+
+            if (state != INIT_PENDING)
+                continue;
+
+            if (c->hart != INIT_ANY_HART && c->hart != hart)
+                continue;
+
+            if (!init_deps_done(calls, c->deps))
+                continue;
+
+            // Someone else may be eyeing the same call
+            if (!atomic_compare_exchange_strong(&c->state, &state,
+                        INIT_RUNNING))
+                continue;
+
+            c->ran_on = hart;
+            c->start = rdtime();
+            c->fn(c->arg);
+            c->end = rdtime();
+
+            atomic_store(&c->state, INIT_DONE);
+        }
+
+        if (all_done)
+            return;
+
+        __asm__ volatile ("nop");
+    }
+}
+
+void init_report(struct initcall* calls, int n) {
+    for (int i = 0; i < n; i++) {
+        struct initcall* c = &calls[i];
+
+        printk("init,%s,%d,%lu,%lu", c->name, c->ran_on, c->start, c->end);
+    }
+}
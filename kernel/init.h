@@ -0,0 +1,47 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Tiny dependency ordered init framework. Every hart runs init_run() on the
+// same table and grabs whatever call is ready, so independent work overlaps.
+
+#define INIT_ANY_HART -1
+
+// Runtime state of an initcall
+#define INIT_PENDING 0
+#define INIT_RUNNING 1
+#define INIT_DONE 2
+
+// Most calls in one table, deps is a bitmask of indices
+#define INIT_MAX_CALLS 32
+
+#define INIT_DEP(i) (1U << (i))
+
+struct initcall {
+    const char* name;
+    void (*fn)(int arg);
+    int arg;
+    // Only this hart may run it, or INIT_ANY_HART
+    int hart;
+    // Calls in the same table that must be done first
+    uint32_t deps;
+
+    // Filled in by init_run()
+    atomic_int state;
+    int ran_on;
+    uint64_t start;
+    uint64_t end;
+};
+
+/*
+ * Runs the table on the calling hart together with every other hart that
+ * calls it. Returns once every call in the table is done.
+ */
+void init_run(struct initcall* calls, int n, int hart);
+
+/*
+ * Prints when and where every call ran, one per line:
+ *
+ *     init,<name>,<hart>,<start ticks>,<end ticks>
+ */
+void init_report(struct initcall* calls, int n);
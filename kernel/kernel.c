@@ -1,11 +1,28 @@
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stddef.h>
 
 #include "uart.h"
 #include "block.h"
+#include "cblk.h"
+#include "console.h"
+#include "net.h"
+#include "plic.h"
 #include "print.h"
 #include "alloc.h"
 #include "panic.h"
+#include "bench.h"
+#include "power.h"
+#include "monitor.h"
+#include "prof.h"
+#include "ramdisk.h"
+#include "rcu.h"
+#include "trap.h"
+#include "fdt.h"
+#include "init.h"
+#include "riscv.h"
+#include "vconsole.h"
+#include "work.h"
 
 // Printed twice
 // Once before init and once after
@@ -16,15 +33,235 @@ void print_notice() {
     printk("This software comes with ABSOLUTELY NO WARRANTY.");
 }
 
-void kmain(void) {
-    print_notice();
+static const char* heap_slice_names[MAX_HARTS] = {
+    "heap0", "heap1", "heap2", "heap3", "heap4", "heap5", "heap6", "heap7",
+};
+
+// Boot work, filled in by the boot hart. See boot_table().
+static struct initcall boot_calls[MAX_HARTS + 7];
+static int boot_ncalls;
+static int boot_nharts;
+static void* boot_dtb;
 
-    printk("kmain: initializing kernel heap");
-    init_memory();
-    printk("kmain: finished initializing kernel heap");
+// Secondary harts wait on this before touching boot_calls
+static atomic_bool boot_calls_ready;
+
+static void boot_memory_map(int arg) {
+    (void)arg;
+    init_memory_map(boot_dtb);
+}
 
+static void boot_heap_slice(int slice) {
+    init_memory_slice(slice, boot_nharts);
+}
+
+static void boot_probe_block(int arg) {
+    (void)arg;
+    probe_block();
+}
+
+static void boot_init_block(int arg) {
+    (void)arg;
     init_block();
+}
+
+#ifdef COMPRESS
+static void boot_init_cblk(int arg) {
+    (void)arg;
+    init_cblk();
+}
+#endif
+
+static void boot_init_ramdisk(int arg) {
+    (void)arg;
+    init_ramdisk(boot_dtb);
+}
+
+static void boot_init_net(int arg) {
+    (void)arg;
+    init_net();
+}
+
+static void boot_init_console(int arg) {
+    (void)arg;
+    init_vconsole();
+}
+
+/*
+ * Once the memory map is known, every hart puts its own slice of the heap
+ * on the free list. Probing the block device and setting up the ramdisk
+ * don't need memory, so whoever is free does them alongside. The block
+ * queue, the network device and the virtio console only need some memory,
+ * so they wait for the first slice. With COMPRESS, the compressing layer
+ * goes on top of the block queue.
+ */
+static void boot_table(void) {
+    int n = 0;
+
+    int memmap = n;
+    boot_calls[n++] = (struct initcall){
+        .name = "memmap",
+        .fn = boot_memory_map,
+        .hart = 0,
+    };
+
+    int heap0 = n;
+    for (int hart = 0; hart < boot_nharts; hart++) {
+        boot_calls[n++] = (struct initcall){
+            .name = heap_slice_names[hart],
+            .fn = boot_heap_slice,
+            .arg = hart,
+            .hart = hart,
+            .deps = INIT_DEP(memmap),
+        };
+    }
+
+    int probe = n;
+    boot_calls[n++] = (struct initcall){
+        .name = "block_probe",
+        .fn = boot_probe_block,
+        .hart = INIT_ANY_HART,
+    };
+
+    int queue = n;
+    boot_calls[n++] = (struct initcall){
+        .name = "block_queue",
+        .fn = boot_init_block,
+        .hart = INIT_ANY_HART,
+        .deps = INIT_DEP(heap0) | INIT_DEP(probe),
+    };
+
+#ifdef COMPRESS
+    boot_calls[n++] = (struct initcall){
+        .name = "compress",
+        .fn = boot_init_cblk,
+        .hart = INIT_ANY_HART,
+        .deps = INIT_DEP(queue),
+    };
+#else
+    (void)queue;
+#endif
+
+    boot_calls[n++] = (struct initcall){
+        .name = "ramdisk",
+        .fn = boot_init_ramdisk,
+        .hart = INIT_ANY_HART,
+    };
+
+    boot_calls[n++] = (struct initcall){
+        .name = "net",
+        .fn = boot_init_net,
+        .hart = INIT_ANY_HART,
+        .deps = INIT_DEP(heap0),
+    };
+
+    boot_calls[n++] = (struct initcall){
+        .name = "console",
+        .fn = boot_init_console,
+        .hart = INIT_ANY_HART,
+        .deps = INIT_DEP(heap0),
+    };
+
+    boot_ncalls = n;
+}
+
+// Pages zeroed per trip through an idle loop. Small enough that whoever
+// polls next to it doesn't notice.
+#define IDLE_ZERO_BATCH 8
+
+// Spin lengths (in nops) between idle trips that found nothing to do.
+// Doubles while the hart stays idle so it stops hammering shared cache
+// lines, capped so new work, a profiler toggle or a grace period waiting
+// on this hart's quiescent state is still picked up within a few
+// microseconds.
+#define IDLE_BACKOFF_MIN 16
+#define IDLE_BACKOFF_MAX 4096
+
+/*
+ * Where a hart goes once boot work is done. Nothing schedules onto
+ * secondary harts yet, so they help with parallel work (see work.h) and
+ * keep the pre-zeroed page pool topped up.
+ * There is no interrupt to wake them when pages are freed, so this polls
+ * rather than sleeping in wfi, backing off while there's nothing to do.
+ * Every trip around is a quiescent state.
+ */
+static void hart_idle(void) {
+    int backoff = IDLE_BACKOFF_MIN;
+
+    rcu_online();
+
+    while (1) {
+        rcu_quiescent();
+        prof_poll();
+#ifdef BENCH
+        bench_secondary();
+#endif
+        int did = work_poll();
+        did += alloc_zero_work(IDLE_ZERO_BATCH);
+
+        if (did) {
+            backoff = IDLE_BACKOFF_MIN;
+            continue;
+        }
+
+        for (int i = 0; i < backoff; i++)
+            __asm__ volatile ("nop");
+        if (backoff < IDLE_BACKOFF_MAX)
+            backoff *= 2;
+    }
+}
+
+void kmain(uint64_t hart, void* dtb) {
+    trap_init();
+
+    if (hart != 0) {
+        while (!atomic_load(&boot_calls_ready)) {
+            __asm__ volatile ("nop");
+        }
+
+        // Harts the device tree doesn't know about stay out of the way
+        if (hart < (uint64_t)boot_nharts)
+            init_run(boot_calls, boot_ncalls, hart);
+
+        hart_idle();
+    }
+
+    print_notice();
+
+    boot_dtb = dtb;
+    boot_nharts = fdt_count_harts(dtb);
+    if (boot_nharts > MAX_HARTS)
+        boot_nharts = MAX_HARTS;
+
+    printk("kmain: %d harts, initializing kernel heap", boot_nharts);
+
+    boot_table();
+    atomic_store(&boot_calls_ready, true);
+
+    init_run(boot_calls, boot_ncalls, hart);
+    init_report(boot_calls, boot_ncalls);
+
+    // Device interrupts all go to this hart
+    plic_init_hart();
+    intr_on();
+
+    rcu_online();
+
+    printk("kmain: ready after %lu ticks", rdtime());
+
+    // Whatever boot held onto is expected, anything past here shows up in
+    // the leak check.
+    alloc_leak_mark();
+
+#ifdef PROFILE
+    // Catch the rest of boot
+    prof_start_all();
+#endif
 
+#ifdef BENCH
+    run_benchmarks();
+    power_off(0);
+#endif
 
     volatile uint8_t* str = kalloc();
 
@@ -46,6 +283,12 @@ void kmain(void) {
     print_notice();
     printk("Hello world!");
 	while(1) {
-        uart_debug();
+        rcu_quiescent();
+        monitor_poll();
+        net_poll(NET_POLL_BUDGET);
+        console_poll();
+        // Whatever the secondary harts haven't gotten to, or all of it
+        // with CPUS=1
+        alloc_zero_work(1);
 	}
 }
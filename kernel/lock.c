@@ -1,13 +1,41 @@
 #include "lock.h"
 
 void acquire(spinlock* lock) {
-    while (atomic_load(&lock->locked)) {
-        __asm__ volatile ("nop");
+    // Spin on a plain load so waiters don't keep bouncing the line around,
+    // then try to grab it with a single atomic swap.
+    while (atomic_exchange_explicit(&lock->locked, true,
+                memory_order_acquire)) {
+        while (atomic_load_explicit(&lock->locked, memory_order_relaxed)) {
+            __asm__ volatile ("nop");
+        }
     }
+}
 
-    atomic_store(&lock->locked, true);
+bool try_acquire(spinlock* lock) {
+    // Plain load first, a failed swap would still take the line away
+    return !atomic_load_explicit(&lock->locked, memory_order_relaxed)
+        && !atomic_exchange_explicit(&lock->locked, true,
+                memory_order_acquire);
 }
 
 void release(spinlock* lock) {
-    atomic_store(&lock->locked, true);
+    atomic_store_explicit(&lock->locked, false, memory_order_release);
+}
+
+void seqlock_write_begin(seqlock* sl) {
+    acquire(&sl->lock);
+
+    atomic_store_explicit(&sl->seq,
+            atomic_load_explicit(&sl->seq, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+    // Readers must see the odd seq before any of the new data
+    atomic_thread_fence(memory_order_release);
+}
+
+void seqlock_write_end(seqlock* sl) {
+    atomic_store_explicit(&sl->seq,
+            atomic_load_explicit(&sl->seq, memory_order_relaxed) + 1,
+            memory_order_release);
+
+    release(&sl->lock);
 }
@@ -9,3 +9,45 @@ typedef struct {
 
 void acquire(spinlock* lock);
 void release(spinlock* lock);
+
+// Takes the lock if it's free and returns whether it did, never spins
+bool try_acquire(spinlock* lock);
+
+/*
+ * Sequence lock, for small data that is read far more often than it is
+ * written. Writers serialize on the spinlock and bump seq before and after
+ * the update, so it is odd while one is in progress. Readers never write
+ * anything shared: they copy the data out and start over if seq moved.
+ *
+ *     unsigned seq;
+ *     do {
+ *         seq = seqlock_read_begin(&sl);
+ *         copy = data;
+ *     } while (seqlock_read_retry(&sl, seq));
+ *
+ * Don't follow pointers read inside the loop before the retry check, they
+ * may be half updated. Use RCU (rcu.h) for that.
+ */
+typedef struct {
+    atomic_uint seq;
+    spinlock lock;
+} seqlock;
+
+static inline unsigned seqlock_read_begin(seqlock* sl) {
+    unsigned seq;
+
+    while ((seq = atomic_load_explicit(&sl->seq, memory_order_acquire)) & 1) {
+        __asm__ volatile ("nop");
+    }
+
+    return seq;
+}
+
+static inline bool seqlock_read_retry(seqlock* sl, unsigned seq) {
+    // Keeps the reads of the data from moving past the second load of seq
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&sl->seq, memory_order_relaxed) != seq;
+}
+
+void seqlock_write_begin(seqlock* sl);
+void seqlock_write_end(seqlock* sl);
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// LZ4 block format compressor and decompressor. See lz.h.
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lz.h"
+#include "string.h"
+
+#define LZ_MIN_MATCH 4
+// The format wants the last 5 bytes as literals, and no match starting in
+// the last 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the 255, 255, ..., rest tail of a length that didn't fit its nibble
+static inline int lz_put_len(uint8_t* dst, size_t* op, size_t cap,
+        size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*op >= cap)
+            return -1;
+        dst[(*op)++] = 255;
+    }
+
+    if (*op >= cap)
+        return -1;
+    dst[(*op)++] = len;
+
+    return 0;
+}
+
+// One sequence, mlen 0 for the final literals-only one
+static int lz_put_seq(uint8_t* dst, size_t* op, size_t cap,
+        const uint8_t* lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+    if (*op >= cap)
+        return -1;
+    dst[(*op)++] = (nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15);
+
+    if (nlit >= 15 && lz_put_len(dst, op, cap, nlit - 15))
+        return -1;
+
+    if (nlit > cap - *op)
+        return -1;
+    memcpy(dst + *op, lit, nlit);
+    *op += nlit;
+
+    if (!mlen)
+        return 0;
+
+    if (cap - *op < 2)
+        return -1;
+    dst[(*op)++] = offset;
+    dst[(*op)++] = offset >> 8;
+
+    if (mcode >= 15 && lz_put_len(dst, op, cap, mcode - 15))
+        return -1;
+
+    return 0;
+}
+
+int lz_compress(struct lz_state* st, const void* src, size_t len, void* dst,
+        size_t cap) {
+    const uint8_t* in = src;
+    uint8_t* out = dst;
+    size_t ip = 0, anchor = 0, op = 0;
+
+    if (len > LZ_MAX_INPUT)
+        return -1;
+
+    memset(st->table, 0, sizeof(st->table));
+
+    if (len > LZ_MFLIMIT) {
+        size_t limit = len - LZ_MFLIMIT;
+
+        while (ip < limit) {
+            uint32_t h = lz_hash(lz_read32(in + ip));
+            size_t ref = st->table[h];
+
+            st->table[h] = ip;
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET
+                    || lz_read32(in + ref) != lz_read32(in + ip)) {
+                ip++;
+                continue;
+            }
+
+            size_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < len - LZ_LAST_LITERALS
+                    && in[ref + mlen] == in[ip + mlen]) {
+                mlen++;
+            }
+
+            if (lz_put_seq(out, &op, cap, in + anchor, ip - anchor, ip - ref,
+                        mlen))
+                return -1;
+
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    if (lz_put_seq(out, &op, cap, in + anchor, len - anchor, 0, 0))
+        return -1;
+
+    return op;
+}
+
+// Reads the 255, 255, ..., rest tail of a length. Returns -1 past the end.
+static inline int lz_get_len(const uint8_t* src, size_t* ip, size_t len,
+        size_t* out) {
+    uint8_t b;
+
+    do {
+        if (*ip >= len)
+            return -1;
+        b = src[(*ip)++];
+        *out += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+int lz_decompress(const void* src, size_t len, void* dst, size_t cap) {
+    const uint8_t* in = src;
+    uint8_t* out = dst;
+    size_t ip = 0, op = 0;
+
+    while (ip < len) {
+        uint8_t token = in[ip++];
+        size_t nlit = token >> 4;
+
+        if (nlit == 15 && lz_get_len(in, &ip, len, &nlit))
+            return -1;
+
+        if (nlit > len - ip || nlit > cap - op)
+            return -1;
+        memcpy(out + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        // The last sequence has no match
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return -1;
+        size_t offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+
+        if (offset == 0 || offset > op)
+            return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz_get_len(in, &ip, len, &mlen))
+            return -1;
+        mlen += LZ_MIN_MATCH;
+
+        if (mlen > cap - op)
+            return -1;
+
+        uint8_t* from = out + op - offset;
+        if (offset >= mlen) {
+            memcpy(out + op, from, mlen);
+        } else {
+            // Overlaps what it's writing, e.g. a run of one byte
+            for (size_t i = 0; i < mlen; i++) {
+                out[op + i] = from[i];
+            }
+        }
+        op += mlen;
+    }
+
+    return op;
+}
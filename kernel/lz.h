@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fast LZ77 codec using the LZ4 block format: a token with literal and
+ * match lengths, the literals, then a 16 bit little endian match offset.
+ * Greedy, one hash probe per position, so it's cheap rather than tight.
+ *
+ * See https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ */
+
+// Biggest input lz_compress() takes, so positions fit in the hash table
+#define LZ_MAX_INPUT 65536
+
+#define LZ_HASH_BITS 12
+
+// Scratch space for lz_compress(), one per concurrent caller
+struct lz_state {
+    uint16_t table[1 << LZ_HASH_BITS];
+};
+
+/*
+ * Compresses len bytes of src into at most cap bytes of dst. Returns the
+ * compressed size, or -1 if it doesn't fit in cap or len is too big.
+ */
+int lz_compress(struct lz_state* st, const void* src, size_t len, void* dst,
+        size_t cap);
+
+/*
+ * Decompresses len bytes of src into at most cap bytes of dst. Returns
+ * the decompressed size, or -1 if src is malformed or wouldn't fit. Never
+ * reads or writes out of bounds, whatever src holds.
+ */
+int lz_decompress(const void* src, size_t len, void* dst, size_t cap);
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Single key console commands for poking at a running kernel.
+#include <stddef.h>
+#include <stdint.h>
+
+#include "monitor.h"
+#include "alloc.h"
+#include "console.h"
+#include "fs.h"
+#include "net.h"
+#include "print.h"
+#include "prof.h"
+#include "rcu.h"
+#include "riscv.h"
+#include "trap.h"
+#include "uart.h"
+
+struct monitor_cmd {
+    char key;
+    const char* help;
+    void (*fn)(void);
+};
+
+static void monitor_help(void);
+
+static void monitor_prof_toggle(void) {
+    if (prof_running())
+        prof_stop_all();
+    else
+        prof_start_all();
+}
+
+/*
+ * Pages in use and alloc/free rates since the last time this ran, then the
+ * biggest holders.
+ */
+static void monitor_alloc_stats(void) {
+    static struct alloc_stats last;
+    static uint64_t last_time;
+
+    struct alloc_stats now;
+    uint64_t time = rdtime();
+    uint64_t ms = (time - last_time) / (TIMEBASE_HZ / 1000);
+
+    alloc_get_stats(&now);
+
+    printk("alloc: %lu of %lu pages in use, %lu at peak, %lu free", now.in_use,
+            mem_total_pages(), now.peak, mem_free_pages());
+
+    if (ms > 0) {
+        printk("alloc: %lu allocs/s, %lu frees/s over the last %lu ms",
+                (now.allocs - last.allocs) * 1000 / ms,
+                (now.frees - last.frees) * 1000 / ms, ms);
+    }
+
+    printk("alloc: %lu pages pre-zeroed, %lu zeroed in the background, "
+            "%lu inline", mem_clean_pages(), now.zeroed_background,
+            now.zeroed_inline);
+
+    if (now.double_frees)
+        printk("alloc: %lu double frees caught", now.double_frees);
+
+    struct rcu_stats rcu;
+    rcu_get_stats(&rcu);
+    printk("rcu: grace period %lu on %lu harts, %lu callbacks pending, "
+            "%lu run", rcu.gp, rcu.online, rcu.pending, rcu.done);
+
+    alloc_dump_sites(10);
+
+    last = now;
+    last_time = time;
+}
+
+static void monitor_leak_check(void) {
+    printk("alloc: %lu pages held since the mark", alloc_leak_check());
+}
+
+static const struct monitor_cmd monitor_cmds[] = {
+    { 'm', "memory usage and top allocation sites", monitor_alloc_stats },
+    { 'l', "report allocations held since boot finished", monitor_leak_check },
+    { 'p', "start/stop the profiler on every hart", monitor_prof_toggle },
+    { 'P', "dump profiler samples", prof_dump },
+    { 't', "dump trap entry latency", trap_dump_stats },
+    { 'n', "network counters", net_dump_stats },
+    { 'd', "dcache hit rate and path lookup latency", fs_dump_stats },
+    { '?', "list commands", monitor_help },
+};
+
+#define NUM_MONITOR_CMDS (sizeof(monitor_cmds) / sizeof(monitor_cmds[0]))
+
+static void monitor_help(void) {
+    for (size_t i = 0; i < NUM_MONITOR_CMDS; i++) {
+        printk("monitor: %s - %s", (char[]){ monitor_cmds[i].key, '\0' },
+                monitor_cmds[i].help);
+    }
+}
+
+void monitor_poll(void) {
+    char c = console_getch();
+
+    if (c == 0)
+        return;
+
+    for (size_t i = 0; i < NUM_MONITOR_CMDS; i++) {
+        if (monitor_cmds[i].key == c) {
+            monitor_cmds[i].fn();
+            return;
+        }
+    }
+
+    printk("monitor: unknown key, ? for help");
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+/*
+ * Polls the console for a key and runs the matching monitor command.
+ * Press ? for a list.
+ */
+void monitor_poll(void);
@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// virtio network device driver.
+// See https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf#5.1
+//
+// Receive buffers come from a fixed pool and are handed to the rx handler
+// where the device left them. Sends chain a shared header descriptor
+// straight onto the caller's frame, nothing is copied either way.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+#include "alloc.h"
+#include "lock.h"
+#include "panic.h"
+#include "plic.h"
+#include "print.h"
+
+#include "virtio.h"
+
+// Queue indexes
+#define NET_RX_QUEUE 0
+#define NET_TX_QUEUE 1
+
+// Net feature bits
+#define VIRTIO_NET_F_MAC 5
+
+#define NET_QUEUE_SIZE 256
+
+// Receive buffers, two to a page. Fits a header and a full frame.
+#define NET_RX_BUFS 128
+#define NET_BUF_SIZE 2048
+
+// With VIRTIO_F_VERSION_1, num_buffers is always there
+struct virtio_net_hdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;
+};
+
+struct virtio_net_config {
+    volatile uint8_t mac[6];
+    volatile uint16_t status;
+    volatile uint16_t max_virtqueue_pairs;
+    volatile uint16_t mtu;
+};
+
+// No offloads, so every send can point at the same all zero header
+static const struct virtio_net_hdr net_tx_hdr;
+
+static struct {
+    struct virtio_dev dev;
+    struct virtq* rx;
+    struct virtq* tx;
+    bool present;
+    uint8_t mac[6];
+
+    // rx_lock covers the receive queue and the rx side of stats, tx_lock the
+    // rest. The rx handler may send.
+    spinlock rx_lock;
+    spinlock tx_lock;
+
+    // Set by the interrupt, cleared when polling catches up
+    atomic_bool scheduled;
+
+    struct net_handlers handlers;
+    struct net_stats stats;
+} net;
+
+static void net_post_rx(uint8_t* buf) {
+    struct virtq_buf vb = { buf, NET_BUF_SIZE, true };
+
+    if (virtq_add(net.rx, &vb, 1, buf) < 0)
+        panicf("net: receive ring full");
+}
+
+/*
+ * Runs on hart 0 from the trap path, possibly on top of net_poll(), so it
+ * only flips flags.
+ */
+static void net_interrupt(int irq, void* arg) {
+    (void)irq;
+    (void)arg;
+
+    virtio_intr_ack(&net.dev);
+    virtq_intr_off(net.rx);
+    net.stats.interrupts++;
+    atomic_store(&net.scheduled, true);
+}
+
+void init_net(void) {
+    if (virtio_find(VIRTIO_ID_NET, &net.dev)) {
+        printk("net: no network device");
+        return;
+    }
+
+    if (virtio_setup(&net.dev, 1ULL << VIRTIO_NET_F_MAC)) {
+        printk("net: feature negotiation failed");
+        return;
+    }
+
+    net.rx = virtq_create(&net.dev, NET_RX_QUEUE, NET_QUEUE_SIZE);
+    net.tx = virtq_create(&net.dev, NET_TX_QUEUE, NET_QUEUE_SIZE);
+
+    if (!net.rx || !net.tx)
+        panicf("net: no queues");
+
+    // Finished sends are picked up whenever we come by, never worth an
+    // interrupt
+    virtq_intr_off(net.tx);
+
+    for (int i = 0; i < NET_RX_BUFS && net.rx->nfree >= 2; i += 2) {
+        uint8_t* page = kalloc();
+
+        net_post_rx(page);
+        net_post_rx(page + NET_BUF_SIZE);
+    }
+
+    volatile struct virtio_net_config* config = virtio_config(&net.dev);
+
+    if (virtio_has_feature(&net.dev, VIRTIO_NET_F_MAC)) {
+        for (int i = 0; i < 6; i++) {
+            net.mac[i] = config->mac[i];
+        }
+    } else {
+        // Locally administered, in case the device won't say
+        net.mac[0] = 0x02;
+        net.mac[5] = 0x01;
+    }
+
+    // Start out polling, the first net_poll() switches to interrupts
+    atomic_store(&net.scheduled, true);
+    plic_register(net.dev.irq, 0, net_interrupt, NULL);
+
+    virtio_driver_ok(&net.dev);
+    virtq_kick(net.rx);
+
+    net.present = true;
+
+    printk("net: mac %p, %u receive buffers", (void*)(
+            (uint64_t)net.mac[0] << 40 | (uint64_t)net.mac[1] << 32 |
+            (uint64_t)net.mac[2] << 24 | (uint64_t)net.mac[3] << 16 |
+            (uint64_t)net.mac[4] << 8 | net.mac[5]),
+            net.rx->num - net.rx->nfree);
+}
+
+bool net_present(void) {
+    return net.present;
+}
+
+const uint8_t* net_mac(void) {
+    return net.mac;
+}
+
+void net_set_handlers(const struct net_handlers* handlers) {
+    acquire(&net.rx_lock);
+    acquire(&net.tx_lock);
+    net.handlers = *handlers;
+    release(&net.tx_lock);
+    release(&net.rx_lock);
+}
+
+// Must hold tx_lock
+static void net_reap_tx(void) {
+    const void* frame;
+
+    while ((frame = virtq_get(net.tx, NULL))) {
+        if (net.handlers.tx_done)
+            net.handlers.tx_done(frame);
+    }
+}
+
+int net_xmit(const void* frame, uint32_t len) {
+    if (!net.present || len > NET_MTU)
+        return -1;
+
+    struct virtq_buf bufs[2] = {
+        { (void*)&net_tx_hdr, sizeof(net_tx_hdr), false },
+        { (void*)frame, len, false },
+    };
+
+    acquire(&net.tx_lock);
+
+    if (net.tx->nfree < 2)
+        net_reap_tx();
+
+    int head = virtq_add(net.tx, bufs, 2, (void*)frame);
+
+    if (head < 0) {
+        net.stats.tx_full++;
+    } else {
+        net.stats.tx_packets++;
+        net.stats.tx_bytes += len;
+    }
+
+    release(&net.tx_lock);
+
+    return head < 0 ? -1 : 0;
+}
+
+void net_xmit_flush(void) {
+    if (!net.present)
+        return;
+
+    acquire(&net.tx_lock);
+    virtq_kick(net.tx);
+    release(&net.tx_lock);
+}
+
+int net_tx_inflight(void) {
+    if (!net.present)
+        return 0;
+
+    acquire(&net.tx_lock);
+    net_reap_tx();
+    int inflight = net.tx->num - net.tx->nfree;
+    release(&net.tx_lock);
+
+    return inflight;
+}
+
+int net_poll(int budget) {
+    if (!net.present)
+        return 0;
+
+    acquire(&net.tx_lock);
+    net_reap_tx();
+    release(&net.tx_lock);
+
+    if (!atomic_load(&net.scheduled))
+        return 0;
+
+    acquire(&net.rx_lock);
+    net.stats.polls++;
+
+    int done = 0;
+    uint8_t* buf;
+    uint32_t len;
+
+    while (done < budget && (buf = virtq_get(net.rx, &len))) {
+        if (len > sizeof(struct virtio_net_hdr)) {
+            len -= sizeof(struct virtio_net_hdr);
+            net.stats.rx_packets++;
+            net.stats.rx_bytes += len;
+
+            if (net.handlers.rx)
+                net.handlers.rx(buf + sizeof(struct virtio_net_hdr), len);
+        }
+
+        net_post_rx(buf);
+        done++;
+    }
+
+    // All the buffers we took go back with one notify
+    if (done)
+        virtq_kick(net.rx);
+
+    if (done < budget) {
+        // Caught up. Unschedule first, so an interrupt that lands from here
+        // on schedules us again, then look once more for anything that came
+        // in before interrupts were back on.
+        atomic_store(&net.scheduled, false);
+
+        if (virtq_intr_on(net.rx)) {
+            virtq_intr_off(net.rx);
+            atomic_store(&net.scheduled, true);
+        } else {
+            net.stats.irq_mode++;
+        }
+    }
+
+    release(&net.rx_lock);
+
+    return done;
+}
+
+void net_get_stats(struct net_stats* out) {
+    acquire(&net.rx_lock);
+    acquire(&net.tx_lock);
+    *out = net.stats;
+    release(&net.tx_lock);
+    release(&net.rx_lock);
+}
+
+void net_dump_stats(void) {
+    struct net_stats s;
+
+    if (!net.present) {
+        printk("net: no network device");
+        return;
+    }
+
+    net_get_stats(&s);
+
+    printk("net: rx %lu packets %lu bytes, tx %lu packets %lu bytes, "
+            "%lu ring full", s.rx_packets, s.rx_bytes, s.tx_packets,
+            s.tx_bytes, s.tx_full);
+    printk("net: %lu interrupts, %lu polls, %lu switches back to interrupts",
+            s.interrupts, s.polls, s.irq_mode);
+}
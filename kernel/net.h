@@ -0,0 +1,68 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Largest frame we send or take, without the FCS
+#define NET_MTU 1514
+
+// Most frames net_poll() takes per call before giving the rest of the
+// kernel a turn
+#define NET_POLL_BUDGET 64
+
+struct net_stats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    // net_xmit() calls turned away with the ring full
+    uint64_t tx_full;
+    uint64_t interrupts;
+    uint64_t polls;
+    // Times the receive side went back to waiting for interrupts
+    uint64_t irq_mode;
+};
+
+struct net_handlers {
+    // A received frame. Points into the receive buffer, which goes back to
+    // the device once this returns.
+    void (*rx)(const uint8_t* frame, uint32_t len);
+    // The device is done with a frame given to net_xmit(). Runs with the
+    // send side locked, so it can't send.
+    void (*tx_done)(const void* frame);
+};
+
+/*
+ * Finds the virtio network device, fills its receive ring and routes its
+ * interrupt to hart 0. Needs kalloc() and plic_init_hart() on hart 0.
+ */
+void init_net(void);
+
+bool net_present(void);
+const uint8_t* net_mac(void);
+
+void net_set_handlers(const struct net_handlers* handlers);
+
+/*
+ * Queues a frame for sending. The device reads it in place, so it has to
+ * stay put until tx_done. Returns -1 if the ring is full. Nothing goes out
+ * before net_xmit_flush(), so a batch costs one notify.
+ */
+int net_xmit(const void* frame, uint32_t len);
+void net_xmit_flush(void);
+
+// Frames queued and not yet handed back through tx_done
+int net_tx_inflight(void);
+
+/*
+ * Hands up to budget received frames to the rx handler and reaps finished
+ * sends. Returns how many frames it received.
+ *
+ * Receiving is NAPI style: an interrupt turns the device's receive
+ * interrupts off and schedules polling. Polling goes on for as long as it
+ * keeps using the whole budget, and turns interrupts back on once it
+ * catches up. A call with nothing scheduled only reaps sends.
+ */
+int net_poll(int budget);
+
+void net_get_stats(struct net_stats* out);
+void net_dump_stats(void);
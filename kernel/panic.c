@@ -1,17 +1,31 @@
 #include <stdarg.h>
 
+#include "panic.h"
 #include "print.h"
+#include "console.h"
+#include "riscv.h"
 
 /*
  * Panic with formatting. Behaves like all -f c functions
  */
 void panicf(const char* format, ...) {
     va_list vargs;
-    va_start(vargs, format);
 
-    printk("Panic: %s\n", format, vargs);
+    // Nothing gets to interrupt us and run on top of whatever broke
+    intr_off();
+
+    // Whatever broke might be the console backend
+    console_panic();
 
+    va_start(vargs, format);
+    // We may have panicked with print_lock held, or in a trap on top of
+    // someone holding it
+    printk_emergency("Panic on hart %lu:", r_mhartid());
+    vprintk_emergency(format, vargs);
     va_end(vargs);
 
-    __asm__ volatile("wfi");
+    // With MIE clear, wfi may still wake up on a pending interrupt
+    while (1) {
+        __asm__ volatile("wfi");
+    }
 }
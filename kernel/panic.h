@@ -1,3 +1,7 @@
 #pragma once
 
-void panicf(const char* format, ...);
+/*
+ * Prints the message and stops the calling hart for good, with interrupts
+ * off. Never returns.
+ */
+__attribute__((noreturn)) void panicf(const char* format, ...);
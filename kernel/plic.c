@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// PLIC driver. Every source gets the same priority, the threshold is 0, and
+// each source goes to exactly one hart.
+#include <stddef.h>
+#include <stdint.h>
+
+#include "plic.h"
+#include "print.h"
+#include "riscv.h"
+
+struct plic_irq {
+    plic_handler fn;
+    void* arg;
+};
+
+static struct plic_irq plic_irqs[PLIC_NUM_IRQS];
+
+void plic_init_hart(void) {
+    *PLIC_THRESHOLD(PLIC_CONTEXT(r_mhartid())) = 0;
+    csr_set(mie, MIE_MEIE);
+}
+
+void plic_register(int irq, uint64_t hart, plic_handler fn, void* arg) {
+    if (irq <= 0 || irq >= PLIC_NUM_IRQS)
+        return;
+
+    plic_irqs[irq] = (struct plic_irq){ fn, arg };
+
+    *PLIC_PRIORITY(irq) = 1;
+    *PLIC_ENABLE(PLIC_CONTEXT(hart), irq) |= 1U << (irq % 32);
+}
+
+void plic_dispatch(void) {
+    int ctx = PLIC_CONTEXT(r_mhartid());
+    uint32_t irq;
+
+    while ((irq = *PLIC_CLAIM(ctx)) != 0) {
+        struct plic_irq* pi = irq < PLIC_NUM_IRQS ? &plic_irqs[irq] : NULL;
+
+        if (pi && pi->fn) {
+            pi->fn(irq, pi->arg);
+        } else {
+            // Nobody asked for it, keep it from coming back
+            *PLIC_ENABLE(ctx, irq) &= ~(1U << (irq % 32));
+            // Runs in the trap handler, so no print_lock
+            printk_emergency("plic: irq %u with no handler, disabled", irq);
+        }
+
+        *PLIC_CLAIM(ctx) = irq;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+// Platform level interrupt controller. Routes device interrupts to harts.
+// See plic@c000000 in resources/qemu.dtc
+#define PLIC_ADDR 0xc000000UL
+
+// riscv,ndev in the device tree, source 0 means "none"
+#define PLIC_NUM_IRQS 96
+
+// Each hart has an M-mode and an S-mode context, M-mode comes first
+#define PLIC_CONTEXT(hart) (2 * (hart))
+
+#define PLIC_PRIORITY(irq) ((volatile uint32_t *)(PLIC_ADDR + 4 * (irq)))
+#define PLIC_ENABLE(ctx, irq) ((volatile uint32_t *) \
+    (PLIC_ADDR + 0x2000 + 0x80 * (ctx) + 4 * ((irq) / 32)))
+#define PLIC_THRESHOLD(ctx) \
+    ((volatile uint32_t *)(PLIC_ADDR + 0x200000 + 0x1000 * (ctx)))
+#define PLIC_CLAIM(ctx) \
+    ((volatile uint32_t *)(PLIC_ADDR + 0x200004 + 0x1000 * (ctx)))
+
+typedef void (*plic_handler)(int irq, void* arg);
+
+/*
+ * Lets every priority through on the calling hart and turns on external
+ * interrupts in mie. mstatus.MIE is left alone.
+ */
+void plic_init_hart(void);
+
+/*
+ * Routes irq to hart and calls fn(irq, arg) for it from the trap path.
+ * fn runs with interrupts off and must not take locks the interrupted code
+ * might hold.
+ */
+void plic_register(int irq, uint64_t hart, plic_handler fn, void* arg);
+
+/*
+ * Claims and handles everything pending for the calling hart. Called by
+ * trap_external().
+ */
+void plic_dispatch(void);
@@ -0,0 +1,9 @@
+#pragma once
+
+/*
+ * Stops the machine through the sifive,test0 finisher device.
+ *
+ * A code of 0 exits QEMU successfully, anything else makes QEMU exit with
+ * that code. Never returns.
+ */
+void power_off(int code) __attribute__((noreturn));
@@ -5,7 +5,59 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
-#include "uart.h"
+#include "console.h"
+#include "lock.h"
+
+// Keeps lines from different harts from getting mixed together
+static spinlock print_lock;
+
+// Most of a line handed to the console at once. Longer lines go out in
+// pieces.
+#define PRINT_LINE_SIZE 256
+
+/*
+ * A line is formatted without print_lock. The lock is only taken once the
+ * first piece goes out, and held until the whole line is out. Emergency
+ * lines never take it and go straight to the UART.
+ */
+struct print_line {
+    char buf[PRINT_LINE_SIZE];
+    size_t len;
+    bool locked;
+    bool emergency;
+};
+
+static void line_flush(struct print_line* line) {
+    if (line->emergency) {
+        uart_console.write(line->buf, line->len);
+        line->len = 0;
+        return;
+    }
+
+    if (!line->locked) {
+        acquire(&print_lock);
+        line->locked = true;
+    }
+
+    if (line->len)
+        console_write(line->buf, line->len);
+
+    line->len = 0;
+}
+
+static inline void line_putch(struct print_line* line, char c) {
+    if (line->len == PRINT_LINE_SIZE)
+        line_flush(line);
+
+    line->buf[line->len++] = c;
+}
+
+static void line_print(struct print_line* line, const char* str) {
+    while (*str != '\0') {
+        line_putch(line, *str);
+        str++;
+    }
+}
 
 /*
  * @brief Convert a numeric type to base 10 string (incl. sign)
@@ -75,13 +127,11 @@ int print_hex(uint64_t val, char* res, int n) {
 }
 
 
-void printk(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-
+static void print_format(struct print_line* line, const char* format,
+        va_list args) {
     for (int i = 0; format[i] != '\0'; i++) {
         if (format[i] != '%') {
-            uart_putch(format[i]);
+            line_putch(line, format[i]);
             continue;
         }
 
@@ -92,7 +142,7 @@ void printk(const char* format, ...) {
         }
 
         if (format[i] == '%') {
-            uart_putch('%');
+            line_putch(line, '%');
             continue;
         }
         
@@ -106,18 +156,16 @@ void printk(const char* format, ...) {
             char result[21];
 
             if (val < 0) {
-                uart_putch('-');
+                line_putch(line, '-');
                 val = -val;
             }
             
             int j = print_numeric(val, result, 21);
             
             for (j--; j >= 0; j--) {
-                uart_putch(result[j]);
+                line_putch(line, result[j]);
             }
 
-            i++;
-
             continue;
         }
 
@@ -129,18 +177,16 @@ void printk(const char* format, ...) {
             char result[21];
 
             if (val < 0) {
-                uart_putch('-');
+                line_putch(line, '-');
                 val = -val;
             }
             
             int j = print_numeric(val, result, 21);
             
             for (j--; j >= 0; j--) {
-                uart_putch(result[j]);
+                line_putch(line, result[j]);
             }
 
-            i++;
-
             continue;
         }
 
@@ -150,14 +196,14 @@ void printk(const char* format, ...) {
             char result[21];
 
             if (val < 0) {
-                uart_putch('-');
+                line_putch(line, '-');
                 val = -val;
             }
             
             int j = print_numeric(val, result, 21);
             
             for (j--; j >= 0; j--) {
-                uart_putch(result[j]);
+                line_putch(line, result[j]);
             }
 
             continue;
@@ -175,7 +221,7 @@ void printk(const char* format, ...) {
             int j = print_numeric(val, result, 21);
             
             for (j--; j >= 0; j--) {
-                uart_putch(result[j]);
+                line_putch(line, result[j]);
             }
 
             continue;
@@ -191,7 +237,7 @@ void printk(const char* format, ...) {
             int j = print_numeric(val, result, 21);
             
             for (j--; j >= 0; j--) {
-                uart_putch(result[j]);
+                line_putch(line, result[j]);
             }
 
             continue;
@@ -205,7 +251,7 @@ void printk(const char* format, ...) {
             int j = print_numeric(val, result, 21);
             
             for (j--; j >= 0; j--) {
-                uart_putch(result[j]);
+                line_putch(line, result[j]);
             }
 
             continue;
@@ -221,25 +267,60 @@ void printk(const char* format, ...) {
             int j = print_hex(val, result, 16);
 
             // print hex prefix
-            uart_print("0x");
+            line_print(line, "0x");
 
             for (j--; j >= 0; j--) {
-                uart_putch(result[j]);
+                line_putch(line, result[j]);
             }
 
             continue;
         }
 
         if (format[i] == 's') {
-            uart_print(va_arg(args, const char*));
+            line_print(line, va_arg(args, const char*));
 
             continue;
         }
 
     }
 
+    // this is logging, newlines are default
+    line_putch(line, '\n');
+    line_flush(line);
+}
+
+void vprintk(const char* format, va_list args) {
+    struct print_line line;
+    line.len = 0;
+    line.locked = false;
+    line.emergency = false;
+
+    print_format(&line, format, args);
+
+    release(&print_lock);
+}
+
+void vprintk_emergency(const char* format, va_list args) {
+    struct print_line line;
+    line.len = 0;
+    line.locked = false;
+    line.emergency = true;
+
+    print_format(&line, format, args);
+}
+
+void printk(const char* format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    vprintk(format, args);
     va_end(args);
+}
 
-    // this is logging, newlines are default
-    uart_putch('\n');
+void printk_emergency(const char* format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    vprintk_emergency(format, args);
+    va_end(args);
 }
@@ -1,2 +1,14 @@
+#pragma once
+#include <stdarg.h>
 
 void printk(const char* format, ...);
+void vprintk(const char* format, va_list args);
+
+/*
+ * Like printk, but takes no lock and writes straight to the UART. For
+ * trap handlers and panics, where the interrupted code on this hart may
+ * hold print_lock or a console backend's lock. Lines can get mixed up
+ * with what other harts print at the same time.
+ */
+void printk_emergency(const char* format, ...);
+void vprintk_emergency(const char* format, va_list args);
@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Sampling profiler. A timer or counter overflow interrupt records the
+// interrupted pc and a short frame pointer backtrace into a per-hart buffer.
+// The timer and counters are per hart, so every hart arms its own.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "prof.h"
+#include "alloc.h"
+#include "clint.h"
+#include "panic.h"
+#include "print.h"
+#include "riscv.h"
+
+// Return addresses kept per sample, on top of the pc
+#define PROF_DEPTH 6
+
+// Pages of samples per hart
+#define PROF_PAGES 16
+
+struct prof_sample {
+    uint64_t pc;
+    uint64_t weight;
+    uint64_t bt[PROF_DEPTH];
+};
+
+#define PROF_PER_PAGE (PAGE_SIZE / sizeof(struct prof_sample))
+#define PROF_MAX_SAMPLES (PROF_PAGES * PROF_PER_PAGE)
+
+struct prof_hart {
+    // Buffer is split over pages, since kalloc can't hand out more than one
+    // contiguous page.
+    struct prof_sample* pages[PROF_PAGES];
+    uint32_t count;
+    uint32_t dropped;
+    uint64_t last;
+    bool running;
+};
+
+static struct prof_hart prof_harts[MAX_HARTS];
+
+// Bumped by prof_start_all() and prof_stop_all(), odd while every hart
+// should be sampling. Each hart acts on it once per change.
+static atomic_uint prof_gen;
+static unsigned prof_seen[MAX_HARTS];
+
+static struct prof_config prof_config = {
+    .source = PROF_SRC_TIMER,
+    .event = PROF_EVENT_CYCLES,
+    // 1 kHz
+    .period = TIMEBASE_HZ / 1000,
+};
+
+void prof_configure(const struct prof_config* config) {
+    prof_config = *config;
+}
+
+/*
+ * Walks saved frame pointers. With -fno-omit-frame-pointer every frame
+ * keeps ra at fp - 8 and the caller's fp at fp - 16.
+ */
+static int prof_backtrace(uint64_t fp, uint64_t* bt, int max) {
+    int n = 0;
+
+    while (n < max) {
+        if (fp % 8 != 0 || fp < (uint64_t)KERNEL_BASE + 16
+                || fp > (uint64_t)_end)
+            break;
+
+        uint64_t ra = ((uint64_t*)fp)[-1];
+        uint64_t next = ((uint64_t*)fp)[-2];
+
+        if (ra == 0)
+            break;
+
+        bt[n++] = ra;
+
+        // Stacks grow down, so callers always sit higher up
+        if (next <= fp)
+            break;
+
+        fp = next;
+    }
+
+    return n;
+}
+
+static void prof_record(struct prof_hart* ph, uint64_t epc, uint64_t fp,
+        uint64_t weight) {
+    if (ph->count >= PROF_MAX_SAMPLES) {
+        ph->dropped++;
+        return;
+    }
+
+    struct prof_sample* s =
+        &ph->pages[ph->count / PROF_PER_PAGE][ph->count % PROF_PER_PAGE];
+
+    s->pc = epc;
+    s->weight = weight;
+
+    int n = prof_backtrace(fp, s->bt, PROF_DEPTH);
+    for (; n < PROF_DEPTH; n++) {
+        s->bt[n] = 0;
+    }
+
+    ph->count++;
+}
+
+static void prof_counter_setup(uint64_t start, bool overflow_irq) {
+    uint64_t event = prof_config.event;
+
+    // Setting OF up front keeps the counter from raising an interrupt
+    if (!overflow_irq)
+        event |= MHPMEVENT_OF;
+
+    csr_clear(CSR_MCOUNTINHIBIT, 1UL << 3);
+    csr_write(CSR_MHPMEVENT3, event);
+    csr_write(CSR_MHPMCOUNTER3, start);
+}
+
+void prof_start(void) {
+    uint64_t hart = r_mhartid();
+    struct prof_hart* ph = &prof_harts[hart];
+
+    if (ph->running)
+        return;
+
+    for (int i = 0; i < PROF_PAGES; i++) {
+        if (!ph->pages[i])
+            ph->pages[i] = kalloc();
+    }
+
+    ph->count = 0;
+    ph->dropped = 0;
+    ph->running = true;
+
+    if (prof_config.source == PROF_SRC_OVERFLOW) {
+        prof_counter_setup(-prof_config.period, true);
+        csr_set(mie, MIE_LCOFIE);
+    } else {
+        prof_counter_setup(0, false);
+        ph->last = 0;
+        *CLINT_MTIMECMP(hart) = *CLINT_MTIME + prof_config.period;
+        csr_set(mie, MIE_MTIE);
+    }
+
+    intr_on();
+
+    printk("prof: started on hart %lu", hart);
+}
+
+void prof_stop(void) {
+    uint64_t hart = r_mhartid();
+    struct prof_hart* ph = &prof_harts[hart];
+
+    csr_clear(mie, MIE_MTIE | MIE_LCOFIE);
+    *CLINT_MTIMECMP(hart) = UINT64_MAX;
+    ph->running = false;
+
+    printk("prof: stopped on hart %lu, %u samples, %u dropped", hart,
+            ph->count, ph->dropped);
+}
+
+void prof_poll(void) {
+    unsigned gen = atomic_load_explicit(&prof_gen, memory_order_acquire);
+    unsigned* seen = &prof_seen[r_mhartid()];
+
+    if (gen == *seen)
+        return;
+
+    *seen = gen;
+
+    if (gen & 1)
+        prof_start();
+    else
+        prof_stop();
+}
+
+void prof_start_all(void) {
+    unsigned gen = atomic_load(&prof_gen);
+
+    if (!(gen & 1))
+        atomic_store_explicit(&prof_gen, gen + 1, memory_order_release);
+
+    prof_poll();
+}
+
+void prof_stop_all(void) {
+    unsigned gen = atomic_load(&prof_gen);
+
+    if (gen & 1)
+        atomic_store_explicit(&prof_gen, gen + 1, memory_order_release);
+
+    prof_poll();
+}
+
+bool prof_running(void) {
+    return prof_harts[r_mhartid()].running;
+}
+
+void prof_dump(void) {
+    for (int hart = 0; hart < MAX_HARTS; hart++) {
+        struct prof_hart* ph = &prof_harts[hart];
+
+        if (!ph->pages[0])
+            continue;
+
+        if (ph->running)
+            printk("prof: hart %d still running, dump may be torn", hart);
+
+        printk("prof: hart %d, %u samples, %u dropped", hart, ph->count,
+                ph->dropped);
+
+        for (uint32_t i = 0; i < ph->count; i++) {
+            struct prof_sample* s =
+                &ph->pages[i / PROF_PER_PAGE][i % PROF_PER_PAGE];
+
+            printk("prof,%d,%lu,%p,%p,%p,%p,%p,%p,%p", hart, s->weight,
+                    (void*)s->pc, (void*)s->bt[0], (void*)s->bt[1],
+                    (void*)s->bt[2], (void*)s->bt[3], (void*)s->bt[4],
+                    (void*)s->bt[5]);
+        }
+    }
+}
+
+void prof_timer_interrupt(uint64_t epc, uint64_t fp) {
+    uint64_t hart = r_mhartid();
+    struct prof_hart* ph = &prof_harts[hart];
+
+    if (!ph->running) {
+        csr_clear(mie, MIE_MTIE);
+        return;
+    }
+
+    *CLINT_MTIMECMP(hart) = *CLINT_MTIME + prof_config.period;
+
+    uint64_t now = csr_read(CSR_MHPMCOUNTER3);
+    uint64_t weight = now - ph->last;
+    ph->last = now;
+
+    prof_record(ph, epc, fp, weight);
+}
+
+void prof_overflow_interrupt(uint64_t epc, uint64_t fp) {
+    struct prof_hart* ph = &prof_harts[r_mhartid()];
+
+    // Rearm. Rewriting the event clears OF.
+    prof_counter_setup(-prof_config.period, true);
+    csr_clear(mip, MIE_LCOFIE);
+
+    if (!ph->running) {
+        csr_clear(mie, MIE_LCOFIE);
+        return;
+    }
+
+    prof_record(ph, epc, fp, prof_config.period);
+}
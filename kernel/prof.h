@@ -0,0 +1,69 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// What triggers a sample
+#define PROF_SRC_TIMER 0     // every `period` timer ticks
+#define PROF_SRC_OVERFLOW 1  // every `period` events (needs Sscofpmf)
+
+// Raw mhpmevent codes. QEMU advertises these in the pmu node of
+// resources/qemu.dtc. There are no cache events on QEMU, so the TLB miss
+// events are the closest it gets. Real hardware uses its own codes, pass
+// them straight through.
+#define PROF_EVENT_CYCLES 0x01
+#define PROF_EVENT_INSTRET 0x02
+#define PROF_EVENT_DTLB_READ_MISS 0x10019
+#define PROF_EVENT_DTLB_WRITE_MISS 0x1001b
+#define PROF_EVENT_ITLB_MISS 0x10021
+
+struct prof_config {
+    int source;
+    // Counted by mhpmcounter3. Every sample is weighted by how many of
+    // these happened since the last one.
+    uint64_t event;
+    uint64_t period;
+};
+
+/*
+ * Changes the sample source, event and period. Takes effect on the next
+ * prof_start().
+ */
+void prof_configure(const struct prof_config* config);
+
+/*
+ * Starts sampling on the calling hart. Allocates its sample buffer on first
+ * use, so the heap must be up.
+ */
+void prof_start(void);
+
+/*
+ * Stops sampling on the calling hart. Samples are kept until the next
+ * prof_start().
+ */
+void prof_stop(void);
+
+/*
+ * Starts or stops sampling on every hart. The calling hart switches right
+ * away, the others once they next get around to prof_poll().
+ */
+void prof_start_all(void);
+void prof_stop_all(void);
+
+// Called from the idle loop, follows prof_start_all() and prof_stop_all()
+void prof_poll(void);
+
+bool prof_running(void);
+
+/*
+ * Prints every recorded sample over the console, one per line:
+ *
+ *     prof,<hart>,<weight>,<pc>,<return address>,...
+ *
+ * Backtraces are padded with 0x0. tools/profsym.py turns these into folded
+ * stacks.
+ */
+void prof_dump(void);
+
+// Called from the trap handlers with the interrupted pc and frame pointer
+void prof_timer_interrupt(uint64_t epc, uint64_t fp);
+void prof_overflow_interrupt(uint64_t epc, uint64_t fp);
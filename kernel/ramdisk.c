@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// RAM backed block device. Takes the same requests as virtio-blk, but a
+// request costs a memcpy and nothing else, which makes it a fast scratch
+// disk and shows what the block layer itself costs.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ramdisk.h"
+#include "alloc.h"
+#include "fdt.h"
+#include "print.h"
+#include "string.h"
+
+static uint8_t ramdisk_scratch[RAMDISK_SCRATCH_KB * 1024]
+    __attribute__((aligned(PAGE_SIZE)));
+
+static struct ramdisk ram0;
+
+static int ramdisk_add(struct blkdev* dev, struct blk_req* req) {
+    struct ramdisk* rd = dev->priv;
+    uint64_t count = req->len / SECTOR_SIZE;
+    bool sized = req->len > 0 && req->len % SECTOR_SIZE == 0;
+    bool inside = req->sector < dev->capacity
+        && count <= dev->capacity - req->sector;
+
+    if (req->op != BLK_OP_FLUSH
+            && (!sized || !inside || req->op > BLK_OP_DISCARD)) {
+        req->done(req, BLK_ERR_INVAL);
+        return 0;
+    }
+
+    uint8_t* p = rd->base + req->sector * SECTOR_SIZE;
+
+    switch (req->op) {
+    case BLK_OP_READ:
+        memcpy(req->buf, p, req->len);
+        break;
+    case BLK_OP_WRITE:
+        memcpy(p, req->buf, req->len);
+        break;
+    case BLK_OP_DISCARD:
+        // Reads back as zeros, like a thin provisioned disk
+        memset(p, 0, req->len);
+        break;
+    case BLK_OP_FLUSH:
+        // Nothing is ever cached
+        break;
+    }
+
+    req->done(req, BLK_OK);
+    return 0;
+}
+
+static void ramdisk_kick(struct blkdev* dev) {
+    (void)dev;
+}
+
+static int ramdisk_reap(struct blkdev* dev) {
+    (void)dev;
+    return 0;
+}
+
+static const struct blkdev_ops ramdisk_ops = {
+    .add = ramdisk_add,
+    .kick = ramdisk_kick,
+    .reap = ramdisk_reap,
+};
+
+int ramdisk_create(struct ramdisk* rd, const char* name, void* base,
+        uint64_t size) {
+    uint64_t sectors = size / SECTOR_SIZE;
+
+    if (sectors == 0)
+        return -1;
+
+    *rd = (struct ramdisk){
+        .dev = {
+            .name = name,
+            .ops = &ramdisk_ops,
+            .capacity = sectors,
+            .priv = rd,
+        },
+        .base = base,
+    };
+
+    return blkdev_register(&rd->dev);
+}
+
+void init_ramdisk(const void* dtb) {
+    uint64_t start, end;
+    int ret;
+
+    if (fdt_initrd(dtb, &start, &end) == 0) {
+        ret = ramdisk_create(&ram0, "ram0", (void*)start, end - start);
+        printk("ramdisk: ram0 is the initrd at %p, %lu sectors", (void*)start,
+                ram0.dev.capacity);
+    } else {
+        ret = ramdisk_create(&ram0, "ram0", ramdisk_scratch,
+                sizeof(ramdisk_scratch));
+        printk("ramdisk: ram0 is %lu sectors of scratch", ram0.dev.capacity);
+    }
+
+    if (ret)
+        printk("ramdisk: couldn't register ram0");
+}
+
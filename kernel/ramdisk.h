@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+
+#include "block.h"
+
+// Size of the scratch ramdisk in the kernel image, used when there is no
+// initrd. Set RAMDISK_KB at build time to change it.
+#ifndef RAMDISK_SCRATCH_KB
+#define RAMDISK_SCRATCH_KB 1024
+#endif
+
+/*
+ * A block device in plain memory. Requests are done inside blk_add(), so
+ * blk_kick() and blk_reap() have nothing left to do. Requests can come
+ * from any number of harts at once; writes to the same sectors race like
+ * they would on a real disk.
+ */
+struct ramdisk {
+    struct blkdev dev;
+    uint8_t* base;
+};
+
+/*
+ * Sets up a ramdisk over size bytes at base, rounded down to whole
+ * sectors, and registers it as name. Returns -1 if that leaves nothing or
+ * there's no room for another block device.
+ */
+int ramdisk_create(struct ramdisk* rd, const char* name, void* base,
+        uint64_t size);
+
+/*
+ * Brings up "ram0" over the initrd QEMU loaded (`make qemu INITRD=file`)
+ * if the device tree has one, or over the scratch area in the kernel image
+ * otherwise. Doesn't need the heap.
+ */
+void init_ramdisk(const void* dtb);
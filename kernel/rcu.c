@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Quiescent state based RCU. A global grace period counter goes up every
+// time something needs to wait, and every hart copies it into its own
+// slot whenever it passes a quiescent state. A grace period is over once
+// every online hart has copied it.
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "alloc.h"
+#include "lock.h"
+#include "panic.h"
+#include "rcu.h"
+#include "riscv.h"
+
+// One cache line per hart, only its own hart ever writes it
+struct rcu_hart {
+    _Atomic uint64_t seen;
+    char pad[64 - sizeof(uint64_t)];
+};
+
+static struct rcu_hart rcu_harts[MAX_HARTS];
+
+static _Atomic uint64_t rcu_gp;
+static atomic_uint rcu_online_mask;
+
+// Callbacks waiting for their grace period, oldest first
+static spinlock rcu_lock;
+static struct rcu_head* rcu_head;
+static struct rcu_head** rcu_tail = &rcu_head;
+static atomic_ulong rcu_pending;
+// gp of the oldest callback, UINT64_MAX when there are none. Lets idle
+// harts check for work without the lock.
+static _Atomic uint64_t rcu_next_gp = UINT64_MAX;
+static atomic_ulong rcu_done;
+
+// Newest grace period every online hart has been through
+static uint64_t rcu_completed(void) {
+    uint64_t done = atomic_load(&rcu_gp);
+    unsigned mask = atomic_load(&rcu_online_mask);
+
+    for (int hart = 0; hart < MAX_HARTS; hart++) {
+        if (!(mask & 1U << hart))
+            continue;
+
+        uint64_t seen = atomic_load_explicit(&rcu_harts[hart].seen,
+                memory_order_acquire);
+        if (seen < done)
+            done = seen;
+    }
+
+    return done;
+}
+
+static void rcu_run_callbacks(void) {
+    uint64_t done = rcu_completed();
+
+    if (atomic_load(&rcu_next_gp) > done)
+        return;
+
+    acquire(&rcu_lock);
+
+    struct rcu_head* ready = rcu_head;
+    struct rcu_head** end = &ready;
+    int n = 0;
+
+    // gp only goes up along the list
+    while (*end && (*end)->gp <= done) {
+        end = &(*end)->next;
+        n++;
+    }
+
+    rcu_head = *end;
+    if (rcu_head) {
+        atomic_store(&rcu_next_gp, rcu_head->gp);
+    } else {
+        rcu_tail = &rcu_head;
+        atomic_store(&rcu_next_gp, UINT64_MAX);
+    }
+    *end = NULL;
+
+    release(&rcu_lock);
+
+    atomic_fetch_sub(&rcu_pending, n);
+
+    while (ready) {
+        struct rcu_head* next = ready->next;
+        ready->fn(ready);
+        ready = next;
+    }
+
+    atomic_fetch_add(&rcu_done, n);
+}
+
+void rcu_online(void) {
+    int hart = this_hart();
+
+    atomic_store(&rcu_harts[hart].seen, atomic_load(&rcu_gp));
+    atomic_fetch_or(&rcu_online_mask, 1U << hart);
+}
+
+void rcu_quiescent(void) {
+    struct rcu_hart* rh = &rcu_harts[this_hart()];
+
+    // Every read before this point is done before anyone sees us move on
+    atomic_thread_fence(memory_order_seq_cst);
+
+    uint64_t gp = atomic_load_explicit(&rcu_gp, memory_order_acquire);
+    if (atomic_load_explicit(&rh->seen, memory_order_relaxed) != gp)
+        atomic_store_explicit(&rh->seen, gp, memory_order_release);
+
+    /*
+     * And no read after it can be satisfied before seen is out. Otherwise
+     * a pointer load from the next read side section could still return
+     * what was unlinked before gp, after we already reported gp. Pairs
+     * with the full barrier of the rcu_gp increment in synchronize_rcu()
+     * and call_rcu(): either the updater sees our new seen, or we see its
+     * unlink.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&rcu_next_gp, memory_order_relaxed) <= gp)
+        rcu_run_callbacks();
+}
+
+static bool rcu_is_online(void) {
+    return atomic_load(&rcu_online_mask) & 1U << this_hart();
+}
+
+void synchronize_rcu(void) {
+    // Whatever was unlinked before this has to be out of sight afterwards.
+    // The seq_cst increment is the full barrier rcu_quiescent()'s fences
+    // pair with.
+    uint64_t gp = atomic_fetch_add(&rcu_gp, 1) + 1;
+    bool online = rcu_is_online();
+
+    while (rcu_completed() < gp) {
+        if (online)
+            rcu_quiescent();
+        __asm__ volatile ("nop");
+    }
+
+    if (online)
+        rcu_quiescent();
+}
+
+void call_rcu(struct rcu_head* head, void (*fn)(struct rcu_head* head)) {
+    head->fn = fn;
+    head->next = NULL;
+
+    acquire(&rcu_lock);
+
+    // Taken under the lock so the list stays sorted by gp
+    head->gp = atomic_fetch_add(&rcu_gp, 1) + 1;
+    if (!rcu_head)
+        atomic_store(&rcu_next_gp, head->gp);
+    *rcu_tail = head;
+    rcu_tail = &head->next;
+
+    release(&rcu_lock);
+
+    atomic_fetch_add(&rcu_pending, 1);
+
+    // Nobody online to wait for, e.g. early boot
+    if (!atomic_load(&rcu_online_mask))
+        rcu_run_callbacks();
+}
+
+static void kfree_rcu_cb(struct rcu_head* head) {
+    if (kfree((void*)PAGE_ROUNDDOWN((uint64_t)head)))
+        panicf("rcu: kfree of %p failed", head);
+}
+
+void kfree_rcu_page(struct rcu_head* head) {
+    call_rcu(head, kfree_rcu_cb);
+}
+
+void rcu_get_stats(struct rcu_stats* out) {
+    out->gp = atomic_load(&rcu_gp);
+    out->pending = atomic_load(&rcu_pending);
+    out->done = atomic_load(&rcu_done);
+    out->online = __builtin_popcount(atomic_load(&rcu_online_mask));
+}
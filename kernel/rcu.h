@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Quiescent state based RCU. Readers take no locks and write nothing
+ * shared; a hart is known to be out of every read section whenever it
+ * calls rcu_quiescent(), which the idle loops and the main loop do. Memory
+ * a reader might still see is freed once every online hart has been
+ * through a quiescent state since it was unlinked.
+ *
+ * Read sections must not span a call to rcu_quiescent() or anything that
+ * waits for a grace period, and only run on online harts.
+ */
+
+#define rcu_read_lock() __asm__ volatile ("" ::: "memory")
+#define rcu_read_unlock() __asm__ volatile ("" ::: "memory")
+
+// Publishes p after everything written to what it points to
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+struct rcu_head {
+    struct rcu_head* next;
+    void (*fn)(struct rcu_head* head);
+    // Grace period that has to end before fn runs
+    uint64_t gp;
+};
+
+struct rcu_stats {
+    uint64_t gp;
+    uint64_t pending;
+    uint64_t done;
+    uint64_t online;
+};
+
+/*
+ * The calling hart starts reporting quiescent states, and grace periods
+ * wait for it from now on. Nothing on it may have been reading before.
+ */
+void rcu_online(void);
+
+/*
+ * Reports that the calling hart holds no RCU protected pointers, and runs
+ * the callbacks whose grace period has ended. Cheap when nothing is
+ * pending.
+ */
+void rcu_quiescent(void);
+
+/*
+ * Waits until every online hart has been through a quiescent state. Can
+ * take as long as the slowest hart's trip around its loop.
+ */
+void synchronize_rcu(void);
+
+/*
+ * Runs fn(head) on some hart after a grace period. Callbacks run in the
+ * order they were queued and outside of any lock.
+ */
+void call_rcu(struct rcu_head* head, void (*fn)(struct rcu_head* head));
+
+/*
+ * Frees the page holding head after a grace period, for structures that
+ * take up a page of their own with a struct rcu_head somewhere inside.
+ */
+void kfree_rcu_page(struct rcu_head* head);
+#define kfree_rcu(ptr, field) kfree_rcu_page(&(ptr)->field)
+
+void rcu_get_stats(struct rcu_stats* out);
@@ -0,0 +1,111 @@
+#pragma once
+#include <stdint.h>
+
+// Most harts we will ever bring up. QEMU's virt board tops out at 8 per
+// socket.
+#define MAX_HARTS 8
+
+// QEMU's virt board ticks mtime at 10 MHz. See timebase-frequency in
+// resources/qemu.dtc.
+#define TIMEBASE_HZ 10000000
+
+/*
+ * Reads the cycle counter. On QEMU this is not cycle accurate, but it is
+ * monotonic and good enough for comparing two builds against each other.
+ */
+static inline uint64_t rdcycle(void) {
+    uint64_t x;
+    __asm__ volatile("rdcycle %0" : "=r"(x));
+    return x;
+}
+
+/*
+ * Reads the real time counter. Ticks at TIMEBASE_HZ.
+ */
+#ifdef __riscv
+static inline uint64_t rdtime(void) {
+    uint64_t x;
+    __asm__ volatile("rdtime %0" : "=r"(x));
+    return x;
+}
+#else
+// The host build's clock, in the same ticks (see host/stubs.c)
+uint64_t rdtime(void);
+#endif
+
+static inline uint64_t rdinstret(void) {
+    uint64_t x;
+    __asm__ volatile("rdinstret %0" : "=r"(x));
+    return x;
+}
+
+#define __stringify_1(x) #x
+#define __stringify(x) __stringify_1(x)
+
+// CSR access by name or number, e.g. csr_read(mepc) or
+// csr_write(CSR_MHPMEVENT3, x)
+#define csr_read(csr) ({ \
+        uint64_t __v; \
+        __asm__ volatile("csrr %0, " __stringify(csr) : "=r"(__v)); \
+        __v; \
+    })
+
+#define csr_write(csr, val) \
+    __asm__ volatile("csrw " __stringify(csr) ", %0" \
+            :: "r"((uint64_t)(val)))
+
+#define csr_set(csr, bits) \
+    __asm__ volatile("csrs " __stringify(csr) ", %0" \
+            :: "r"((uint64_t)(bits)))
+
+#define csr_clear(csr, bits) \
+    __asm__ volatile("csrc " __stringify(csr) ", %0" \
+            :: "r"((uint64_t)(bits)))
+
+// mstatus
+#define MSTATUS_MIE (1UL << 3)
+
+// mie / mip
+#define MIE_MSIE (1UL << 3)
+#define MIE_MTIE (1UL << 7)
+#define MIE_MEIE (1UL << 11)
+#define MIE_LCOFIE (1UL << 13)
+
+// mcause
+#define MCAUSE_INTERRUPT (1UL << 63)
+#define IRQ_M_SOFT 3
+#define IRQ_M_TIMER 7
+#define IRQ_M_EXT 11
+#define IRQ_LCOF 13
+
+// Hardware performance monitor CSRs, by number since older assemblers
+// don't know all of their names
+#define CSR_MCOUNTINHIBIT 0x320
+#define CSR_MHPMEVENT3 0x323
+#define CSR_MHPMCOUNTER3 0xb03
+
+// Sscofpmf bits in mhpmevent
+#define MHPMEVENT_OF (1UL << 63)
+#define MHPMEVENT_MINH (1UL << 62)
+
+static inline uint64_t r_mhartid(void) {
+    return csr_read(mhartid);
+}
+
+// For code that also goes into the host build, which runs everything as
+// hart 0
+static inline int this_hart(void) {
+#ifdef __riscv
+    return r_mhartid();
+#else
+    return 0;
+#endif
+}
+
+static inline void intr_on(void) {
+    csr_set(mstatus, MSTATUS_MIE);
+}
+
+static inline void intr_off(void) {
+    csr_clear(mstatus, MSTATUS_MIE);
+}
@@ -1,4 +1,12 @@
 #include <stdlib.h>
+#include <stdint.h>
+
+// Lets us access any buffer a word at a time without upsetting the
+// aliasing rules.
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_MASK (WORD_SIZE - 1)
 
 void* memset_s(void* dest, int val, size_t count) {
     volatile unsigned char* ptr = (volatile unsigned char*)dest;
@@ -8,3 +16,116 @@ void* memset_s(void* dest, int val, size_t count) {
     return dest;
 }
 
+void* memset(void* dest, int val, size_t count) {
+    unsigned char* ptr = (unsigned char*)dest;
+    word_t word = (unsigned char)val * 0x0101010101010101ULL;
+
+    while (count > 0 && ((uintptr_t)ptr & WORD_MASK)) {
+        *ptr++ = val;
+        count--;
+    }
+
+    word_t* wptr = (word_t*)ptr;
+
+    // Unrolled so most of the time goes into stores, not the loop
+    for (; count >= 8 * WORD_SIZE; count -= 8 * WORD_SIZE) {
+        wptr[0] = word;
+        wptr[1] = word;
+        wptr[2] = word;
+        wptr[3] = word;
+        wptr[4] = word;
+        wptr[5] = word;
+        wptr[6] = word;
+        wptr[7] = word;
+        wptr += 8;
+    }
+
+    for (; count >= WORD_SIZE; count -= WORD_SIZE) {
+        *wptr++ = word;
+    }
+
+    ptr = (unsigned char*)wptr;
+
+    while (count-- > 0) {
+        *ptr++ = val;
+    }
+
+    return dest;
+}
+
+void* memcpy(void* dest, const void* src, size_t count) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+
+    // Only go word-wise when both sides can be aligned at the same time
+    if ((((uintptr_t)d ^ (uintptr_t)s) & WORD_MASK) == 0) {
+        while (count > 0 && ((uintptr_t)d & WORD_MASK)) {
+            *d++ = *s++;
+            count--;
+        }
+
+        word_t* wd = (word_t*)d;
+        const word_t* ws = (const word_t*)s;
+
+        for (; count >= 8 * WORD_SIZE; count -= 8 * WORD_SIZE) {
+            wd[0] = ws[0];
+            wd[1] = ws[1];
+            wd[2] = ws[2];
+            wd[3] = ws[3];
+            wd[4] = ws[4];
+            wd[5] = ws[5];
+            wd[6] = ws[6];
+            wd[7] = ws[7];
+            wd += 8;
+            ws += 8;
+        }
+
+        for (; count >= WORD_SIZE; count -= WORD_SIZE) {
+            *wd++ = *ws++;
+        }
+
+        d = (unsigned char*)wd;
+        s = (const unsigned char*)ws;
+    }
+
+    while (count-- > 0) {
+        *d++ = *s++;
+    }
+
+    return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t count) {
+    const unsigned char* x = a;
+    const unsigned char* y = b;
+
+    for (; count > 0; count--, x++, y++) {
+        if (*x != *y)
+            return *x - *y;
+    }
+    return 0;
+}
+
+size_t strlen(const char* str) {
+    const char* end = str;
+    while (*end != '\0') {
+        end++;
+    }
+    return end - str;
+}
+
+int strcmp(const char* a, const char* b) {
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+int strncmp(const char* a, const char* b, size_t n) {
+    for (; n > 0; n--, a++, b++) {
+        if (*a != *b || *a == '\0')
+            return (unsigned char)*a - (unsigned char)*b;
+    }
+    return 0;
+}
@@ -12,3 +12,52 @@
  * @param count Number of bytes to write
  */
 void* memset_s(void* dest, int val, size_t count);
+
+/**
+ * @brief Fills memory with a byte value
+ *
+ * Writes a word at a time once dest is aligned. Use memset_s for secrets.
+ *
+ * @param dest Destination to write to
+ * @param val Value to write
+ * @param count Number of bytes to write
+ */
+void* memset(void* dest, int val, size_t count);
+
+/**
+ * @brief Copies non-overlapping memory
+ *
+ * Copies a word at a time when dest and src share the same alignment,
+ * otherwise falls back to bytes.
+ *
+ * @param dest Destination to write to
+ * @param src Source to read from
+ * @param count Number of bytes to copy
+ */
+void* memcpy(void* dest, const void* src, size_t count);
+
+/**
+ * @brief Compares count bytes
+ *
+ * @return <0, 0 or >0 like the standard memcmp
+ */
+int memcmp(const void* a, const void* b, size_t count);
+
+/**
+ * @brief Length of a NUL terminated string
+ */
+size_t strlen(const char* str);
+
+/**
+ * @brief Compares two NUL terminated strings
+ *
+ * @return <0, 0 or >0 like the standard strcmp
+ */
+int strcmp(const char* a, const char* b);
+
+/**
+ * @brief Compares at most n characters of two strings
+ *
+ * @return <0, 0 or >0 like the standard strncmp
+ */
+int strncmp(const char* a, const char* b, size_t n);
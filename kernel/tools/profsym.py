@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+"""Turns `prof,...` lines from a console log into folded stacks, ready for
+flamegraph.pl or speedscope.
+
+Usage: tools/profsym.py [-e kernel.elf] [--hart N] [--merge-harts] log.txt
+
+Every stack starts with a hartN frame, so each hart gets its own tower in
+the flame graph. --merge-harts leaves that out and adds them all up.
+
+Symbolizes with addr2line. Set ADDR2LINE to use something other than
+riscv64-unknown-elf-addr2line (llvm-addr2line works too).
+"""
+
+import argparse
+import collections
+import os
+import subprocess
+import sys
+
+
+def parse(path, hart):
+    samples = []
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith("prof,"):
+                continue
+            fields = line.split(",")
+            if len(fields) < 4:
+                continue
+            if hart is not None and int(fields[1]) != hart:
+                continue
+            weight = int(fields[2])
+            pcs = [int(x, 16) for x in fields[3:] if int(x, 16) != 0]
+            # Nothing left to attribute it to
+            if not pcs:
+                continue
+            samples.append((int(fields[1]), weight, pcs))
+    return samples
+
+
+def symbolize(elf, addrs):
+    addr2line = os.environ.get("ADDR2LINE", "riscv64-unknown-elf-addr2line")
+    if not addrs:
+        return {}
+
+    # Return addresses point past the call, so look up the call itself
+    query = "\n".join(hex(a) for a in addrs) + "\n"
+    out = subprocess.run([addr2line, "-f", "-e", elf], input=query,
+                         capture_output=True, text=True, check=True).stdout
+    lines = out.splitlines()
+
+    names = {}
+    for i, addr in enumerate(addrs):
+        name = lines[2 * i] if 2 * i < len(lines) else "??"
+        names[addr] = hex(addr) if name == "??" else name
+    return names
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-e", "--elf", default="kernel.elf")
+    parser.add_argument("--hart", type=int, default=None,
+                        help="only keep samples from this hart")
+    parser.add_argument("--merge-harts", action="store_true",
+                        help="don't split stacks by hart")
+    parser.add_argument("log")
+    args = parser.parse_args()
+
+    samples = parse(args.log, args.hart)
+    if not samples:
+        sys.exit("profsym: no prof, lines in " + args.log)
+
+    # The first entry is the interrupted pc, the rest are return addresses
+    lookup = set()
+    for _, _, pcs in samples:
+        lookup.add(pcs[0])
+        lookup.update(pc - 1 for pc in pcs[1:])
+    names = symbolize(args.elf, sorted(lookup))
+
+    folded = collections.Counter()
+    for hart, weight, pcs in samples:
+        frames = [names[pcs[0]]] + [names[pc - 1] for pc in pcs[1:]]
+        if not args.merge_harts:
+            frames.append("hart%d" % hart)
+        folded[";".join(reversed(frames))] += weight
+
+    for stack, weight in folded.most_common():
+        print(stack, weight)
+
+
+if __name__ == "__main__":
+    main()
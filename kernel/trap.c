@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Machine mode trap handling. See trap.s for the entry paths.
+#include <stdint.h>
+
+#include "trap.h"
+#include "clint.h"
+#include "panic.h"
+#include "plic.h"
+#include "print.h"
+#include "prof.h"
+#include "riscv.h"
+
+#define MTVEC_VECTORED 1
+
+extern char trap_vectors[];
+
+static struct trap_stats trap_stats[MAX_HARTS][TRAP_VECTORS];
+
+void trap_init(void) {
+    csr_write(mtvec, (uint64_t)trap_vectors | MTVEC_VECTORED);
+}
+
+/*
+ * Records how long the entry stub took. Must be the first thing every
+ * handler does, so it measures entry and not the handler.
+ */
+static inline struct trap_stats* trap_account(int vector, uint64_t stamp) {
+    uint64_t cycles = rdcycle() - stamp;
+    struct trap_stats* ts = &trap_stats[r_mhartid()][vector];
+
+    if (ts->count == 0 || cycles < ts->min)
+        ts->min = cycles;
+    if (cycles > ts->max)
+        ts->max = cycles;
+
+    ts->total += cycles;
+    ts->count++;
+
+    return ts;
+}
+
+void trap_get_stats(int hart, int vector, struct trap_stats* out) {
+    *out = trap_stats[hart][vector];
+}
+
+void trap_dump_stats(void) {
+    for (int hart = 0; hart < MAX_HARTS; hart++) {
+        for (int vec = 0; vec < TRAP_VECTORS; vec++) {
+            struct trap_stats* ts = &trap_stats[hart][vec];
+
+            if (ts->count == 0)
+                continue;
+
+            printk("trap,%d,%d,%lu,%lu,%lu,%lu,%lu", hart, vec, ts->count,
+                    ts->min, ts->total / ts->count, ts->max,
+                    ts->late / ts->count);
+        }
+    }
+}
+
+void trap_soft(uint64_t stamp, uint64_t fp) {
+    (void)fp;
+    trap_account(IRQ_M_SOFT, stamp);
+
+    // Nothing sends IPIs for real work yet, just acknowledge it
+    *CLINT_MSIP(r_mhartid()) = 0;
+}
+
+void trap_timer(uint64_t stamp, uint64_t fp) {
+    struct trap_stats* ts = trap_account(IRQ_M_TIMER, stamp);
+    uint64_t hart = r_mhartid();
+
+    ts->late += *CLINT_MTIME - *CLINT_MTIMECMP(hart);
+
+    prof_timer_interrupt(csr_read(mepc), fp);
+}
+
+void trap_external(uint64_t stamp, uint64_t fp) {
+    (void)fp;
+    trap_account(IRQ_M_EXT, stamp);
+
+    plic_dispatch();
+}
+
+void trap_lcof(uint64_t stamp, uint64_t fp) {
+    trap_account(IRQ_LCOF, stamp);
+    prof_overflow_interrupt(csr_read(mepc), fp);
+}
+
+void trap_spurious(uint64_t stamp, uint64_t fp) {
+    (void)stamp;
+    (void)fp;
+
+    uint64_t irq = csr_read(mcause) & ~MCAUSE_INTERRUPT;
+
+    csr_clear(mie, 1UL << irq);
+    // Whatever we interrupted may hold print_lock
+    printk_emergency("trap: unexpected interrupt %lu, disabled", irq);
+}
+
+void trap_handler(struct trap_frame* frame) {
+    uint64_t cause = csr_read(mcause);
+    uint64_t epc = csr_read(mepc);
+
+    printk_emergency("trap: exception %lu at %p, mtval %p, ra %p, sp %p",
+            cause, (void*)epc, (void*)csr_read(mtval),
+            (void*)frame->regs[TRAP_RA], (void*)frame->regs[TRAP_SP]);
+    panicf("Unhandled exception");
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+
+// Register state saved by the exception path in trap.s. regs[n] holds xn,
+// regs[0] is unused. Interrupts don't build one of these.
+struct trap_frame {
+    uint64_t regs[32];
+};
+
+#define TRAP_RA 1
+#define TRAP_SP 2
+#define TRAP_FP 8
+
+// One slot per mcause interrupt code we have an entry for, plus slot 0 for
+// exceptions.
+#define TRAP_VECTORS 14
+
+struct trap_stats {
+    uint64_t count;
+    // Cycles from the first instruction of the entry stub to the C handler
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    // Timer only: mtime ticks between the deadline and the handler
+    uint64_t late;
+};
+
+/*
+ * Points mtvec at trap_vectors in vectored mode on the calling hart.
+ * Interrupts stay off until someone enables them.
+ */
+void trap_init(void);
+
+/*
+ * Copies the entry latency stats of one vector on one hart.
+ */
+void trap_get_stats(int hart, int vector, struct trap_stats* out);
+
+/*
+ * Prints entry latency for every vector that has fired, one per line:
+ *
+ *     trap,<hart>,<vector>,<count>,<min>,<avg>,<max>,<avg late ticks>
+ */
+void trap_dump_stats(void);
+
+void trap_handler(struct trap_frame* frame);
+void trap_soft(uint64_t stamp, uint64_t fp);
+void trap_timer(uint64_t stamp, uint64_t fp);
+void trap_external(uint64_t stamp, uint64_t fp);
+void trap_lcof(uint64_t stamp, uint64_t fp);
+void trap_spurious(uint64_t stamp, uint64_t fp);
@@ -0,0 +1,171 @@
+/*
+ * Machine mode trap entry.
+ *
+ * mtvec runs in vectored mode: exceptions land on trap_vectors and
+ * interrupt n lands on trap_vectors + 4 * n.
+ *
+ * Interrupts take a fast path that only saves the caller-saved registers,
+ * everything else is preserved by the C handler per the calling convention.
+ * Exceptions save the full register file into a struct trap_frame, since
+ * whoever handles them may want to look at or change any of it.
+ */
+.section .text
+
+.option norvc
+
+/*
+ * Fast interrupt entry. The very first thing it does after freeing t0 is
+ * read the cycle counter, so the handler can tell how long entry took.
+ *
+ * Calls handler(entry cycles, interrupted fp).
+ */
+.macro FAST_ENTRY name, handler
+\name:
+	addi sp, sp, -128
+	sd t0, 0(sp)
+	rdcycle t0
+	sd ra, 8(sp)
+	sd t1, 16(sp)
+	sd t2, 24(sp)
+	sd t3, 32(sp)
+	sd t4, 40(sp)
+	sd t5, 48(sp)
+	sd t6, 56(sp)
+	sd a0, 64(sp)
+	sd a1, 72(sp)
+	sd a2, 80(sp)
+	sd a3, 88(sp)
+	sd a4, 96(sp)
+	sd a5, 104(sp)
+	sd a6, 112(sp)
+	sd a7, 120(sp)
+
+	mv a0, t0
+	mv a1, s0
+	call \handler
+
+	ld t0, 0(sp)
+	ld ra, 8(sp)
+	ld t1, 16(sp)
+	ld t2, 24(sp)
+	ld t3, 32(sp)
+	ld t4, 40(sp)
+	ld t5, 48(sp)
+	ld t6, 56(sp)
+	ld a0, 64(sp)
+	ld a1, 72(sp)
+	ld a2, 80(sp)
+	ld a3, 88(sp)
+	ld a4, 96(sp)
+	ld a5, 104(sp)
+	ld a6, 112(sp)
+	ld a7, 120(sp)
+	addi sp, sp, 128
+	mret
+.endm
+
+/* Vectored mode needs every entry to be exactly one 4 byte instruction */
+.align 6
+.global trap_vectors
+trap_vectors:
+	j trap_exception	/* 0: exceptions */
+	j trap_spurious_entry	/* 1: S software */
+	j trap_spurious_entry	/* 2 */
+	j trap_soft_entry	/* 3: M software */
+	j trap_spurious_entry	/* 4 */
+	j trap_spurious_entry	/* 5: S timer */
+	j trap_spurious_entry	/* 6 */
+	j trap_timer_entry	/* 7: M timer */
+	j trap_spurious_entry	/* 8 */
+	j trap_spurious_entry	/* 9: S external */
+	j trap_spurious_entry	/* 10 */
+	j trap_external_entry	/* 11: M external */
+	j trap_spurious_entry	/* 12 */
+	j trap_lcof_entry	/* 13: counter overflow */
+
+FAST_ENTRY trap_soft_entry, trap_soft
+FAST_ENTRY trap_timer_entry, trap_timer
+FAST_ENTRY trap_external_entry, trap_external
+FAST_ENTRY trap_lcof_entry, trap_lcof
+FAST_ENTRY trap_spurious_entry, trap_spurious
+
+/*
+ * Full save, for exceptions. Builds a struct trap_frame and calls
+ * trap_handler(frame).
+ */
+trap_exception:
+	addi sp, sp, -256
+
+	sd x1, 8(sp)
+	sd x3, 24(sp)
+	sd x4, 32(sp)
+	sd x5, 40(sp)
+	sd x6, 48(sp)
+	sd x7, 56(sp)
+	sd x8, 64(sp)
+	sd x9, 72(sp)
+	sd x10, 80(sp)
+	sd x11, 88(sp)
+	sd x12, 96(sp)
+	sd x13, 104(sp)
+	sd x14, 112(sp)
+	sd x15, 120(sp)
+	sd x16, 128(sp)
+	sd x17, 136(sp)
+	sd x18, 144(sp)
+	sd x19, 152(sp)
+	sd x20, 160(sp)
+	sd x21, 168(sp)
+	sd x22, 176(sp)
+	sd x23, 184(sp)
+	sd x24, 192(sp)
+	sd x25, 200(sp)
+	sd x26, 208(sp)
+	sd x27, 216(sp)
+	sd x28, 224(sp)
+	sd x29, 232(sp)
+	sd x30, 240(sp)
+	sd x31, 248(sp)
+
+	/* Original sp, for backtraces and debugging */
+	addi t0, sp, 256
+	sd t0, 16(sp)
+
+	mv a0, sp
+	call trap_handler
+
+	ld x1, 8(sp)
+	ld x3, 24(sp)
+	ld x4, 32(sp)
+	ld x5, 40(sp)
+	ld x6, 48(sp)
+	ld x7, 56(sp)
+	ld x8, 64(sp)
+	ld x9, 72(sp)
+	ld x10, 80(sp)
+	ld x11, 88(sp)
+	ld x12, 96(sp)
+	ld x13, 104(sp)
+	ld x14, 112(sp)
+	ld x15, 120(sp)
+	ld x16, 128(sp)
+	ld x17, 136(sp)
+	ld x18, 144(sp)
+	ld x19, 152(sp)
+	ld x20, 160(sp)
+	ld x21, 168(sp)
+	ld x22, 176(sp)
+	ld x23, 184(sp)
+	ld x24, 192(sp)
+	ld x25, 200(sp)
+	ld x26, 208(sp)
+	ld x27, 216(sp)
+	ld x28, 224(sp)
+	ld x29, 232(sp)
+	ld x30, 240(sp)
+	ld x31, 248(sp)
+
+	addi sp, sp, 256
+	mret
+
+.end
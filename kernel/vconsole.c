@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// virtio console driver, a printk backend that doesn't trap per byte.
+// See https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf#5.3
+//
+// Output is copied into page sized buffers. A buffer goes to the device as
+// soon as the device is idle, otherwise it keeps filling up until the one
+// in flight comes back. So output that trickles in goes out right away and
+// a flood goes out a page at a time.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vconsole.h"
+#include "alloc.h"
+#include "console.h"
+#include "lock.h"
+#include "print.h"
+#include "string.h"
+
+#include "virtio.h"
+
+// Queue indexes, port 0 only
+#define VCON_RX_QUEUE 0
+#define VCON_TX_QUEUE 1
+
+#define VCON_QUEUE_SIZE 16
+
+// Output pages, one being filled and the rest in flight
+#define VCON_TX_BUFS 8
+
+// Input buffers, all in one page. Typing is slow.
+#define VCON_RX_BUFS 16
+#define VCON_RX_SIZE 64
+
+static struct {
+    struct virtio_dev dev;
+    struct virtq* rx;
+    struct virtq* tx;
+    spinlock lock;
+
+    // Pages not in flight, cur among them once it has something in it
+    char* free[VCON_TX_BUFS];
+    int nfree;
+    char* cur;
+    uint32_t cur_len;
+    int inflight;
+
+    // Input buffer being read from
+    char* rx_cur;
+    uint32_t rx_len;
+    uint32_t rx_pos;
+} vcon;
+
+// All of these must hold vcon.lock
+
+static void vcon_reap(void) {
+    char* page;
+
+    while ((page = virtq_get(vcon.tx, NULL))) {
+        vcon.free[vcon.nfree++] = page;
+        vcon.inflight--;
+    }
+}
+
+static void vcon_submit(void) {
+    struct virtq_buf vb = { vcon.cur, vcon.cur_len, false };
+
+    // There are more descriptors than pages, so this can't fail
+    virtq_add(vcon.tx, &vb, 1, vcon.cur);
+    virtq_kick(vcon.tx);
+
+    vcon.inflight++;
+    vcon.cur = NULL;
+    vcon.cur_len = 0;
+}
+
+static void vcon_write(const char* buf, size_t len) {
+    acquire(&vcon.lock);
+    vcon_reap();
+
+    while (len > 0) {
+        if (!vcon.cur) {
+            // Everything is in flight, wait for the device to catch up
+            while (vcon.nfree == 0) {
+                vcon_reap();
+            }
+
+            vcon.cur = vcon.free[--vcon.nfree];
+        }
+
+        size_t n = PAGE_SIZE - vcon.cur_len;
+        if (n > len)
+            n = len;
+
+        memcpy(vcon.cur + vcon.cur_len, buf, n);
+        vcon.cur_len += n;
+        buf += n;
+        len -= n;
+
+        if (vcon.cur_len == PAGE_SIZE)
+            vcon_submit();
+    }
+
+    if (vcon.cur && vcon.inflight == 0)
+        vcon_submit();
+
+    release(&vcon.lock);
+}
+
+static void vcon_poll(void) {
+    acquire(&vcon.lock);
+    vcon_reap();
+
+    if (vcon.cur && vcon.inflight == 0)
+        vcon_submit();
+
+    release(&vcon.lock);
+}
+
+static void vcon_flush(void) {
+    acquire(&vcon.lock);
+
+    if (vcon.cur)
+        vcon_submit();
+
+    while (vcon.inflight > 0) {
+        vcon_reap();
+    }
+
+    release(&vcon.lock);
+}
+
+static char vcon_getch(void) {
+    char c = 0;
+
+    acquire(&vcon.lock);
+
+    if (!vcon.rx_cur) {
+        vcon.rx_cur = virtq_get(vcon.rx, &vcon.rx_len);
+        vcon.rx_pos = 0;
+    }
+
+    if (vcon.rx_cur) {
+        if (vcon.rx_pos < vcon.rx_len)
+            c = vcon.rx_cur[vcon.rx_pos++];
+
+        // Used up, back to the device
+        if (vcon.rx_pos >= vcon.rx_len) {
+            struct virtq_buf vb = { vcon.rx_cur, VCON_RX_SIZE, true };
+
+            virtq_add(vcon.rx, &vb, 1, vcon.rx_cur);
+            virtq_kick(vcon.rx);
+            vcon.rx_cur = NULL;
+        }
+    }
+
+    release(&vcon.lock);
+
+    return c;
+}
+
+static const struct console_ops vcon_ops = {
+    .name = "virtio",
+    .write = vcon_write,
+    .flush = vcon_flush,
+    .poll = vcon_poll,
+    .getch = vcon_getch,
+};
+
+void init_vconsole(void) {
+    if (virtio_find(VIRTIO_ID_CONSOLE, &vcon.dev)) {
+        printk("vconsole: no virtio console, staying on the uart");
+        return;
+    }
+
+    // Just port 0, no size or multiport
+    if (virtio_setup(&vcon.dev, 0)) {
+        printk("vconsole: feature negotiation failed");
+        return;
+    }
+
+    vcon.rx = virtq_create(&vcon.dev, VCON_RX_QUEUE, VCON_QUEUE_SIZE);
+    vcon.tx = virtq_create(&vcon.dev, VCON_TX_QUEUE, VCON_QUEUE_SIZE);
+
+    if (!vcon.rx || !vcon.tx || vcon.tx->num < VCON_TX_BUFS) {
+        printk("vconsole: no usable queues");
+        return;
+    }
+
+    // Polled from the main loop, interrupts would only get in the way
+    virtq_intr_off(vcon.rx);
+    virtq_intr_off(vcon.tx);
+
+    for (int i = 0; i < VCON_TX_BUFS; i++) {
+        vcon.free[vcon.nfree++] = kalloc();
+    }
+
+    char* rx_page = kalloc();
+    for (int i = 0; i < VCON_RX_BUFS && vcon.rx->nfree > 0; i++) {
+        char* buf = rx_page + i * VCON_RX_SIZE;
+        struct virtq_buf vb = { buf, VCON_RX_SIZE, true };
+
+        virtq_add(vcon.rx, &vb, 1, buf);
+    }
+
+    virtio_driver_ok(&vcon.dev);
+    virtq_kick(vcon.rx);
+
+    printk("vconsole: switching printk to the virtio console");
+    console_set(&vcon_ops);
+    printk("vconsole: printk on the virtio console");
+}
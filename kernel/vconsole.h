@@ -0,0 +1,7 @@
+#pragma once
+
+/*
+ * Finds a virtio console and makes it the printk backend. Stays on the
+ * UART if there is none. Needs kalloc().
+ */
+void init_vconsole(void);
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Transport and virtqueue code shared by the virtio drivers.
+// See https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "alloc.h"
+#include "print.h"
+
+#include "virtio.h"
+
+_Static_assert(sizeof(struct virtq) <= PAGE_SIZE, "virtq must fit a page");
+
+int virtio_find(uint32_t device_id, struct virtio_dev* dev) {
+    for (int slot = 0; slot < VIRTIO_MMIO_SLOTS; slot++) {
+        struct virtio_dev d = {
+            .base = VIRTIO_MMIO_BASE + (uint64_t)slot * VIRTIO_MMIO_STRIDE,
+            .irq = VIRTIO_MMIO_IRQ(slot),
+        };
+
+        if (*VIRTIO_REG(&d, VIRTIO_MAGIC_OFFSET) != VIRTIO_MAGIC)
+            continue;
+
+        // Legacy transports are left alone, the Makefile turns them off
+        if (*VIRTIO_REG(&d, VIRTIO_VERSION_OFFSET) != VIRTIO_VERSION)
+            continue;
+
+        d.device_id = *VIRTIO_REG(&d, VIRTIO_DEVICE_ID_OFFSET);
+
+        // Blank device id means an empty slot
+        if (d.device_id != device_id)
+            continue;
+
+        printk("virtio: device %u at %p, irq %d", device_id, (void*)d.base,
+                d.irq);
+        *dev = d;
+        return 0;
+    }
+
+    return -1;
+}
+
+int virtio_setup(struct virtio_dev* dev, uint64_t wanted) {
+    volatile uint32_t* status = VIRTIO_REG(dev, VIRTIO_STATUS_OFFSET);
+
+    // According to docs, we must reset by sending a 0
+    // to the status register.
+    *status = 0;
+    virtio_wmb();
+    *status |= VIRTIO_STATUS_ACKNOWLEDGE;
+    virtio_wmb();
+    *status |= VIRTIO_STATUS_DRIVER;
+
+    // Features come 32 bits at a time
+    uint64_t offered = 0;
+    for (uint32_t sel = 0; sel < 2; sel++) {
+        *VIRTIO_REG(dev, VIRTIO_DEVICE_FEATURES_SEL_OFFSET) = sel;
+        virtio_mb();
+        offered |= (uint64_t)*VIRTIO_REG(dev, VIRTIO_DEVICE_FEATURES_OFFSET)
+            << (32 * sel);
+    }
+
+    wanted |= 1ULL << VIRTIO_F_VERSION_1;
+    dev->features = offered & wanted;
+
+    if (!virtio_has_feature(dev, VIRTIO_F_VERSION_1)) {
+        printk("virtio: device %u doesn't do virtio 1.0", dev->device_id);
+        *status |= VIRTIO_STATUS_FAILED;
+        return -1;
+    }
+
+    for (uint32_t sel = 0; sel < 2; sel++) {
+        *VIRTIO_REG(dev, VIRTIO_DRIVER_FEATURES_SEL_OFFSET) = sel;
+        virtio_mb();
+        *VIRTIO_REG(dev, VIRTIO_DRIVER_FEATURES_OFFSET) =
+            (uint32_t)(dev->features >> (32 * sel));
+    }
+
+    virtio_wmb();
+    *status |= VIRTIO_STATUS_FEATURES_OK;
+    virtio_mb();
+
+    // Check if still OK
+    if (!(*status & VIRTIO_STATUS_FEATURES_OK)) {
+        printk("virtio: device %u refused features %p", dev->device_id,
+                (void*)dev->features);
+        *status |= VIRTIO_STATUS_FAILED;
+        return -1;
+    }
+
+    return 0;
+}
+
+void virtio_driver_ok(struct virtio_dev* dev) {
+    virtio_wmb();
+    *VIRTIO_REG(dev, VIRTIO_STATUS_OFFSET) |= VIRTIO_STATUS_DRIVER_OK;
+}
+
+uint32_t virtio_intr_ack(struct virtio_dev* dev) {
+    uint32_t status = *VIRTIO_REG(dev, VIRTIO_INTERRUPT_STATUS_OFFSET);
+    *VIRTIO_REG(dev, VIRTIO_INTERRUPT_ACK_OFFSET) = status;
+    return status;
+}
+
+struct virtq* virtq_create(struct virtio_dev* dev, uint16_t index,
+        unsigned int num) {
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_SEL_OFFSET) = index;
+    virtio_mb();
+
+    if (*VIRTIO_REG(dev, VIRTIO_QUEUE_READY_OFFSET) != 0) {
+        printk("virtio: queue %u already in use", index);
+        return NULL;
+    }
+
+    uint32_t num_max = *VIRTIO_REG(dev, VIRTIO_QUEUE_NUM_MAX_OFFSET);
+
+    if (num_max < 1) {
+        printk("virtio: queue %u doesn't exist", index);
+        return NULL;
+    }
+
+    if (num > num_max)
+        num = num_max;
+    if (num > VIRTQ_MAX_SIZE)
+        num = VIRTQ_MAX_SIZE;
+
+    // Ring indexes wrap at 2^16, so the size has to divide that
+    while (num & (num - 1))
+        num &= num - 1;
+
+    // The device has to see zeros in all three or it'll read garbage
+    struct virtq* vq = kalloc_zeroed();
+    vq->desc = kalloc_zeroed();
+    vq->avail = kalloc_zeroed();
+    vq->used = kalloc_zeroed();
+
+    vq->num = num;
+    vq->dev = dev;
+    vq->index = index;
+    vq->nfree = num;
+
+    for (unsigned int i = 0; i + 1 < num; i++) {
+        vq->desc[i].next = i + 1;
+    }
+
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_NUM_OFFSET) = num;
+
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_DESC_LOW) = (uint64_t)vq->desc;
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_DESC_HIGH) = (uint64_t)vq->desc >> 32;
+
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_DRIVER_LOW) = (uint64_t)vq->avail;
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_DRIVER_HIGH) = (uint64_t)vq->avail >> 32;
+
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_DEVICE_LOW) = (uint64_t)vq->used;
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_DEVICE_HIGH) = (uint64_t)vq->used >> 32;
+
+    virtio_wmb();
+    *VIRTIO_REG(dev, VIRTIO_QUEUE_READY_OFFSET) = 0x01;
+
+    printk("virtio: device %u queue %u, %u descriptors", dev->device_id,
+            index, num);
+
+    return vq;
+}
+
+int virtq_add(struct virtq* vq, const struct virtq_buf* bufs, int n,
+        void* cookie) {
+    if (n < 1 || n > vq->nfree)
+        return -1;
+
+    uint16_t head = vq->free_head;
+    uint16_t i = head;
+
+    for (int k = 0; k < n; k++) {
+        struct virtq_desc* d = &vq->desc[i];
+
+        d->addr = (uint64_t)bufs[k].addr;
+        d->len = bufs[k].len;
+        d->flags = (bufs[k].write ? VIRTQ_DESC_F_WRITE : 0)
+            | (k + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+
+        // Free descriptors are already chained, so this is the next one
+        // either way
+        i = d->next;
+    }
+
+    vq->free_head = i;
+    vq->nfree -= n;
+    vq->cookie[head] = cookie;
+
+    vq->avail->ring[vq->avail_idx % vq->num] = head;
+    vq->avail_idx++;
+
+    return head;
+}
+
+void virtq_kick(struct virtq* vq) {
+    // Ring entries before the index that covers them
+    virtio_wmb();
+    vq->avail->idx = vq->avail_idx;
+
+    // And the index before we look at whether the device wants a kick
+    virtio_mb();
+
+    if (!(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY))
+        *VIRTIO_REG(vq->dev, VIRTIO_QUEUE_NOTIFY_OFFSET) = vq->index;
+}
+
+void* virtq_get(struct virtq* vq, uint32_t* len) {
+    if (!virtq_pending(vq))
+        return NULL;
+
+    // Used entry only after we saw the index move
+    virtio_rmb();
+
+    struct virtq_used_elem* e = &vq->used->ring[vq->last_used % vq->num];
+    uint16_t head = e->id;
+
+    if (len)
+        *len = e->len;
+
+    vq->last_used++;
+
+    // Give the whole chain back
+    uint16_t i = head;
+    uint16_t n = 1;
+    while (vq->desc[i].flags & VIRTQ_DESC_F_NEXT) {
+        i = vq->desc[i].next;
+        n++;
+    }
+
+    vq->desc[i].next = vq->free_head;
+    vq->free_head = head;
+    vq->nfree += n;
+
+    void* cookie = vq->cookie[head];
+    vq->cookie[head] = NULL;
+
+    return cookie;
+}
@@ -1,25 +1,38 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
-// Addresses
-// TODO: Automate with Device Tree
-#define BLOCK_ADDRESS 0x10001000
+// MMIO transports. QEMU virt has eight of them, one page apart, on
+// interrupts 1 to 8. See virtio_mmio@10001000 in resources/qemu.dtc
+#define VIRTIO_MMIO_BASE 0x10001000
+#define VIRTIO_MMIO_STRIDE 0x1000
+#define VIRTIO_MMIO_SLOTS 8
+#define VIRTIO_MMIO_IRQ(slot) (1 + (slot))
 
 // Expected Values
 #define VIRTIO_MAGIC 0x74726976
 #define VIRTIO_VERSION 0x02
 
+// Device IDs
+#define VIRTIO_ID_NET 1
+#define VIRTIO_ID_BLOCK 2
+#define VIRTIO_ID_CONSOLE 3
+
 // Property offsets
 #define VIRTIO_MAGIC_OFFSET 0x00
 #define VIRTIO_VERSION_OFFSET 0x04
 #define VIRTIO_DEVICE_ID_OFFSET 0x08
 #define VIRTIO_DEVICE_FEATURES_OFFSET 0x10
+#define VIRTIO_DEVICE_FEATURES_SEL_OFFSET 0x14
 #define VIRTIO_DRIVER_FEATURES_OFFSET 0x20
+#define VIRTIO_DRIVER_FEATURES_SEL_OFFSET 0x24
 #define VIRTIO_QUEUE_SEL_OFFSET 0x30
 #define VIRTIO_QUEUE_NUM_MAX_OFFSET 0x34
 #define VIRTIO_QUEUE_NUM_OFFSET 0x38
 #define VIRTIO_QUEUE_READY_OFFSET 0x44
 #define VIRTIO_QUEUE_NOTIFY_OFFSET 0x50
+#define VIRTIO_INTERRUPT_STATUS_OFFSET 0x60
+#define VIRTIO_INTERRUPT_ACK_OFFSET 0x64
 #define VIRTIO_STATUS_OFFSET 0x70
 
 #define VIRTIO_QUEUE_DESC_LOW 0x80
@@ -34,14 +47,17 @@
 #define VIRTIO_CONFIG_OFFSET 0x100
 
 // Macros
-#define RESET_VIRTIO() *BLOCK_REG(VIRTIO_STATUS_OFFSET) = 0
-#define BLOCK_REG(x) ((volatile uint32_t *)(BLOCK_ADDRESS + (x)))
+#define VIRTIO_REG(dev, x) ((volatile uint32_t *)((dev)->base + (x)))
 
 // Status bits
 #define VIRTIO_STATUS_ACKNOWLEDGE 1
 #define VIRTIO_STATUS_DRIVER 2
 #define VIRTIO_STATUS_DRIVER_OK 4
 #define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+// Device independent feature bits
+#define VIRTIO_F_VERSION_1 32
 
 // Block Commands
 #define VIRTIO_BLK_T_IN 0
@@ -53,24 +69,34 @@
 #define VIRTIO_BLK_T_WRITE_ZEROES 13
 #define VIRTIO_BLK_T_SECURE_ERASE 14
 
+// Block request status
+#define VIRTIO_BLK_S_OK 0
+
 // Descriptor Flags
 #define VIRTQ_DESC_F_NEXT 1
 #define VIRTQ_DESC_F_WRITE 2
 #define VIRTQ_DESC_F_INDIRECT 4
 
+// Ring flags, both are only hints
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
 // BLK Feature bits
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD        13	/* Discard command support */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // BLK queue size
 //
-// Changed down to four. A page is about 4KiB. With 8, it would go over a page
-#define VIRTIO_BLK_QUEUE_SIZE 8
+// Every part of the queue has its own page now, so this is only bounded by
+// VIRTQ_MAX_SIZE. A request takes up to three descriptors.
+#define VIRTIO_BLK_QUEUE_SIZE 128
 
 // BLK config struct
 // see https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.pdf#5a
@@ -117,6 +143,13 @@ struct virtio_blk_req {
     volatile uint64_t sector;
 } __attribute__((packed));
 
+// Data of a discard request, one range
+struct virtio_blk_discard {
+    volatile uint64_t sector;
+    volatile uint32_t num_sectors;
+    volatile uint32_t flags;
+};
+
 struct virtq_desc {
     volatile uint64_t addr;
     volatile uint32_t len;
@@ -141,14 +174,154 @@ struct virtq_used {
     struct virtq_used_elem ring[];
 };
 
+// Most descriptors we give a queue, so every part of it fits in a page
+#define VIRTQ_MAX_SIZE 256
+
+/*
+ * One transport with a device behind it. features holds what was
+ * negotiated.
+ */
+struct virtio_dev {
+    uint64_t base;
+    int irq;
+    uint32_t device_id;
+    uint64_t features;
+};
+
+/*
+ * A split virtqueue. Unused descriptors are chained through next starting
+ * at free_head. Entries go into the avail ring as they are added but the
+ * device only sees them once virtq_kick() publishes avail_idx.
+ */
 struct virtq {
     unsigned int num;
     struct virtq_desc *desc;
     struct virtq_avail *avail;
     struct virtq_used *used;
+
+    struct virtio_dev* dev;
+    uint16_t index;
+    uint16_t free_head;
+    uint16_t nfree;
+    uint16_t avail_idx;
+    // Next used entry we haven't looked at
+    uint16_t last_used;
+    // Handed back by virtq_get(), by head descriptor
+    void* cookie[VIRTQ_MAX_SIZE];
+};
+
+// One piece of a descriptor chain
+struct virtq_buf {
+    void* addr;
+    uint32_t len;
+    // Device writes it rather than reads it
+    bool write;
 };
 
+#ifdef __riscv
 static inline void virtio_wmb(void) {
     __asm__ __volatile__("fence w, w" ::: "memory");
 }
 
+static inline void virtio_rmb(void) {
+    __asm__ __volatile__("fence r, r" ::: "memory");
+}
+
+static inline void virtio_mb(void) {
+    __asm__ __volatile__("fence rw, rw" ::: "memory");
+}
+#else
+// Host build (see host/), where the "device" is the test itself
+static inline void virtio_wmb(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void virtio_rmb(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void virtio_mb(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#endif
+
+static inline bool virtio_has_feature(struct virtio_dev* dev, int bit) {
+    return dev->features & (1ULL << bit);
+}
+
+static inline volatile void* virtio_config(struct virtio_dev* dev) {
+    return (volatile void*)(dev->base + VIRTIO_CONFIG_OFFSET);
+}
+
+/*
+ * Scans the MMIO slots for the first device with the given ID. Returns 0
+ * and fills in dev, or -1 if there is none.
+ */
+int virtio_find(uint32_t device_id, struct virtio_dev* dev);
+
+/*
+ * Resets the device and negotiates the features in wanted that it offers.
+ * VIRTIO_F_VERSION_1 is always asked for and required. Returns -1 if the
+ * device won't take the result.
+ */
+int virtio_setup(struct virtio_dev* dev, uint64_t wanted);
+
+/*
+ * Tells the device we're done setting up queues.
+ */
+void virtio_driver_ok(struct virtio_dev* dev);
+
+/*
+ * Acknowledges whatever the device interrupted for and returns the
+ * interrupt status bits.
+ */
+uint32_t virtio_intr_ack(struct virtio_dev* dev);
+
+/*
+ * Sets up queue index with up to num descriptors, fewer if the device or
+ * VIRTQ_MAX_SIZE says so. Must come between virtio_setup() and
+ * virtio_driver_ok(). Needs kalloc().
+ */
+struct virtq* virtq_create(struct virtio_dev* dev, uint16_t index,
+        unsigned int num);
+
+/*
+ * Chains n buffers onto free descriptors and queues the chain. cookie must
+ * not be NULL, virtq_get() hands it back when the device is done. Returns
+ * the head descriptor, or -1 if there aren't n free descriptors. Nothing
+ * reaches the device before virtq_kick().
+ */
+int virtq_add(struct virtq* vq, const struct virtq_buf* bufs, int n,
+        void* cookie);
+
+/*
+ * Publishes everything added since the last kick and notifies the device,
+ * unless it asked not to be.
+ */
+void virtq_kick(struct virtq* vq);
+
+/*
+ * Takes the next finished chain off the used ring and frees its
+ * descriptors. Returns its cookie and stores the bytes written in len, or
+ * returns NULL if there's nothing new.
+ */
+void* virtq_get(struct virtq* vq, uint32_t* len);
+
+static inline bool virtq_pending(struct virtq* vq) {
+    return vq->last_used != vq->used->idx;
+}
+
+/*
+ * Asks the device not to interrupt for this queue, or to interrupt again.
+ * virtq_intr_on() returns true if something was used in the meantime, the
+ * caller has to look at that itself since no interrupt will come for it.
+ */
+static inline void virtq_intr_off(struct virtq* vq) {
+    vq->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
+
+static inline bool virtq_intr_on(struct virtq* vq) {
+    vq->avail->flags = 0;
+    virtio_mb();
+    return virtq_pending(vq);
+}
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Parallel loops over the idle harts. The caller posts a job and takes
+// items itself; idle harts see it from work_poll() and take items too.
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "work.h"
+#include "lock.h"
+
+struct work_job {
+    void (*fn)(void* arg, int i);
+    void* arg;
+    int n;
+    atomic_int next;
+    atomic_int done;
+};
+
+// Held by the caller for the whole job
+static spinlock work_lock;
+static _Atomic(struct work_job*) work_cur;
+// Harts that might be looking at work_cur's job
+static atomic_int work_users;
+
+static int work_run(struct work_job* job) {
+    int did = 0;
+    int i;
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->n) {
+        job->fn(job->arg, i);
+        atomic_fetch_add(&job->done, 1);
+        did++;
+    }
+
+    return did;
+}
+
+int work_poll(void) {
+    if (!atomic_load_explicit(&work_cur, memory_order_relaxed))
+        return 0;
+
+    // Announce ourselves before looking, so the job can't go away under us
+    atomic_fetch_add(&work_users, 1);
+
+    int did = 0;
+    struct work_job* job = atomic_load(&work_cur);
+    if (job)
+        did = work_run(job);
+
+    atomic_fetch_sub(&work_users, 1);
+
+    return did;
+}
+
+void work_parallel(void (*fn)(void* arg, int i), void* arg, int n) {
+    struct work_job job = {
+        .fn = fn,
+        .arg = arg,
+        .n = n,
+    };
+
+    if (n <= 0)
+        return;
+
+    // Not worth waking anyone for
+    if (n == 1) {
+        fn(arg, 0);
+        return;
+    }
+
+    acquire(&work_lock);
+
+    atomic_store(&work_cur, &job);
+    work_run(&job);
+
+    while (atomic_load(&job.done) < n) {
+        __asm__ volatile ("nop");
+    }
+
+    // The job lives on our stack, wait until nobody can still see it
+    atomic_store(&work_cur, NULL);
+    while (atomic_load(&work_users)) {
+        __asm__ volatile ("nop");
+    }
+
+    release(&work_lock);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * Runs fn(arg, i) for every i below n, spread over the calling hart and
+ * whichever harts are idle. Returns once all of them are done. One job
+ * runs at a time, later callers wait for it.
+ *
+ * fn runs on other harts while the caller spins, so it must not take any
+ * lock the caller holds.
+ */
+void work_parallel(void (*fn)(void* arg, int i), void* arg, int n);
+
+/*
+ * Called from the idle loop. Helps with whatever job is running and
+ * returns how many items it did.
+ */
+int work_poll(void);